@@ -0,0 +1,634 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+
+  */
+
+/*
+ *  Microbenchmarks of the block format and of the read/write paths
+ *
+ *  The file system is compiled into the benchmark, the handle layer is
+ *  called directly against a temporary backing directory without mounting.
+ *  Every result is printed as one JSON object per line, so that the output
+ *  of two builds can be compared by a script.
+ */
+
+#define FAILSAFE_NO_MAIN
+#include "failsafefs.cpp"
+
+#include <stdio.h>
+#include <time.h>
+
+/// Default minimal run time of a microbenchmark in seconds
+#define BENCH_MIN_TIME 0.2
+
+/// Default size of the files of the file system benchmarks in MiB
+#define BENCH_FILE_SIZE 64
+
+/// Size of the requests of the sequential file system benchmarks
+#define BENCH_REQUEST_SIZE (128<<10)
+
+/// Size of the requests of the random file system benchmarks
+#define BENCH_SMALL_SIZE 4096
+
+/*!
+ *  Settings and output of a benchmark run
+ */
+struct BenchRun {
+        BenchRun() :
+                        minTime(BENCH_MIN_TIME), fileSize(static_cast<int64_t>(BENCH_FILE_SIZE)<<20), filter(NULL), out(stdout) {
+        }
+
+        double minTime;
+        int64_t fileSize;
+        /// Only benchmarks whose name contains it are run
+        const char* filter;
+        FILE* out;
+
+private:
+        BenchRun(const BenchRun&);
+        BenchRun& operator=(const BenchRun&);
+};
+
+/*!
+ *  Body of a microbenchmark: runs the measured operation a number of times
+ */
+typedef void (*BenchFunction)(void* context,int64_t iterations);
+
+inline double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+inline bool selected(const BenchRun& run,const std::string& name)
+{
+        return run.filter==NULL || name.find(run.filter)!=std::string::npos;
+}
+
+/*!
+ * prints a result line
+ * @param bytes bytes processed by one operation (0: no throughput)
+ */
+static void report(BenchRun& run,const std::string& name,int64_t iterations,double seconds,int64_t bytes)
+{
+        const double nsPerOp=seconds*1e9/iterations;
+        fprintf(run.out,"{\"benchmark\":\"%s\",\"iterations\":%lld,\"seconds\":%.6f,\"ns_per_op\":%.2f",
+                name.c_str(),static_cast<long long>(iterations),seconds,nsPerOp);
+        if (bytes>0)
+                fprintf(run.out,",\"bytes_per_op\":%lld,\"mb_per_s\":%.2f",static_cast<long long>(bytes),
+                        static_cast<double>(bytes)*iterations/seconds/(1<<20));
+        fprintf(run.out,"}\n");
+        fflush(run.out);
+}
+
+/*!
+ * runs a microbenchmark with a doubling number of iterations until one
+ * round takes at least the minimal time
+ */
+static void measure(BenchRun& run,const std::string& name,BenchFunction function,void* context,int64_t bytes)
+{
+        if (!selected(run,name))
+                return;
+        // warm up the caches and the lazy initializations
+        function(context,1);
+        for (int64_t iterations=1;;iterations*=2) {
+                const double start=now();
+                function(context,iterations);
+                const double seconds=now()-start;
+                if (seconds>=run.minTime || iterations>=(static_cast<int64_t>(1)<<40)) {
+                        report(run,name,iterations,seconds,bytes);
+                        return;
+                }
+        }
+}
+
+/*!
+ *  Buffer and block shared by the block format benchmarks
+ */
+struct FormatContext {
+        FormatContext() :
+                        algorithm(HASH_SHA1), size(0), buffer(COMPRESS_CHUNK_SIZE), block(), prev(), hash() {
+        }
+
+        int algorithm;
+        size_t size;
+        std::vector<char> buffer;
+        FailSafeStoreStruct block;
+        FailSafeStoreStruct prev;
+        char hash[HASH_SIZE];
+};
+
+static void benchHashBuffer(void* context,int64_t iterations)
+{
+        FormatContext& format=*static_cast<FormatContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                hashBuffer(format.algorithm,format.hash,&format.buffer[0],format.size);
+}
+
+static void benchCalculateHASH(void* context,int64_t iterations)
+{
+        FormatContext& format=*static_cast<FormatContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                calculateHASH(format.block);
+}
+
+static void benchCheckConsistency(void* context,int64_t iterations)
+{
+        FormatContext& format=*static_cast<FormatContext*>(context);
+        int64_t failures=0;
+        for (int64_t i=0;i<iterations;++i)
+                failures+=!checkConsistency(format.block);
+        if (failures)
+                abort();
+}
+
+static void benchCalculateHeader(void* context,int64_t iterations)
+{
+        FormatContext& format=*static_cast<FormatContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                calculateHeader(format.block,format.prev,FAILSAFE_DATA_SIZE,1+(i&1023),(1+(i&1023))*FAILSAFE_DATA_SIZE,1,format.algorithm);
+}
+
+static void benchRandomize(void* context,int64_t iterations)
+{
+        FormatContext& format=*static_cast<FormatContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                randomize(&format.buffer[0],format.size);
+}
+
+/*!
+ *  Chunk compressed and decompressed by the compression benchmarks
+ */
+struct CompressContext {
+        CompressContext() :
+                        level(1), data(COMPRESS_CHUNK_SIZE), extent(COMPRESS_CHUNK_BLOCKS) {
+        }
+
+        int level;
+        std::vector<char> data;
+        BlockBuffer extent;
+};
+
+static void benchCompressChunk(void* context,int64_t iterations)
+{
+        CompressContext& compress=*static_cast<CompressContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                if (compressChunk(&compress.extent[0],&compress.data[0],COMPRESS_CHUNK_SIZE,compress.level))
+                        abort();
+}
+
+static void benchDecompressChunk(void* context,int64_t iterations)
+{
+        CompressContext& compress=*static_cast<CompressContext*>(context);
+        for (int64_t i=0;i<iterations;++i)
+                if (decompressChunk(&compress.extent[0],&compress.data[0]))
+                        abort();
+}
+
+/// requests of the offset arithmetic benchmark
+#define BENCH_OFFSETS 1024
+
+/*!
+ *  Requests whose block ranges are calculated like fs_read/fs_write do it
+ */
+struct OffsetContext {
+        OffsetContext() :
+                        offsets(BENCH_OFFSETS), sizes(BENCH_OFFSETS), sum(0) {
+        }
+
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> sizes;
+        int64_t sum;
+};
+
+static void benchOffsets(void* context,int64_t iterations)
+{
+        OffsetContext& offsets=*static_cast<OffsetContext*>(context);
+        int64_t sum=0;
+        for (int64_t i=0;i<iterations;++i) {
+                const int64_t offset=offsets.offsets[i%BENCH_OFFSETS];
+                int64_t remain=offsets.sizes[i%BENCH_OFFSETS];
+                const int64_t firstBlockNr=offset/FAILSAFE_DATA_SIZE;
+                const int64_t count=(offset+remain-1)/FAILSAFE_DATA_SIZE-firstBlockNr+1;
+                int64_t localoffset=offset;
+                for (int64_t blockNr=firstBlockNr;remain>0;++blockNr) {
+                        const int64_t start=localoffset%FAILSAFE_DATA_SIZE;
+                        const int64_t transfer=(remain>FAILSAFE_DATA_SIZE-start)?(FAILSAFE_DATA_SIZE-start):remain;
+                        sum+=blockNr*FAILSAFE_BLOCK_SIZE+FAILSAFE_HEADER_SIZE+start;
+                        remain-=transfer;
+                        localoffset+=transfer;
+                }
+                sum+=count;
+        }
+        offsets.sum+=sum;
+}
+
+/*!
+ *  Backing file of the block I/O benchmarks
+ */
+struct BlockIOContext {
+        BlockIOContext() :
+                        inode(NULL), fd(-1), blocks(0), block(), next(0) {
+        }
+
+        InodeStruct* inode;
+        int fd;
+        int64_t blocks;
+        FailSafeStoreStruct block;
+        uint64_t next;
+
+private:
+        BlockIOContext(const BlockIOContext&);
+        BlockIOContext& operator=(const BlockIOContext&);
+};
+
+/// block number of the next operation, spread over the file
+inline int64_t nextBlockNr(BlockIOContext& io)
+{
+        io.next=io.next*6364136223846793005ULL+1442695040888963407ULL;
+        return (io.next>>33)%io.blocks;
+}
+
+static void benchReadBlock(void* context,int64_t iterations)
+{
+        BlockIOContext& io=*static_cast<BlockIOContext*>(context);
+        ReadLock lock(io.inode->lock);
+        for (int64_t i=0;i<iterations;++i)
+                if (readBlock(*(io.inode),io.fd,io.block,nextBlockNr(io)))
+                        abort();
+}
+
+static void benchAttributes(void* context,int64_t iterations)
+{
+        BlockIOContext& io=*static_cast<BlockIOContext*>(context);
+        struct stat stbuf;
+        for (int64_t i=0;i<iterations;++i)
+                if (inodeAttributes(*(io.inode),stbuf))
+                        abort();
+}
+
+static void benchWriteBlock(void* context,int64_t iterations)
+{
+        BlockIOContext& io=*static_cast<BlockIOContext*>(context);
+        for (int64_t i=0;i<iterations;++i) {
+                const int64_t blockNr=nextBlockNr(io);
+                io.block.mBlockCounter=blockNr;
+                if (writeBlock(io.fd,&io.block,blockNr))
+                        abort();
+        }
+}
+
+/*!
+ * collects the data of a read in a buffer
+ */
+static int copySink(void* context,const struct iovec* iov,int count)
+{
+        char* start=static_cast<char*>(context);
+        char* ptr=start;
+        for (int i=0;i<count;++i) {
+                memcpy(ptr,iov[i].iov_base,iov[i].iov_len);
+                ptr+=iov[i].iov_len;
+        }
+        return ptr-start;
+}
+
+/*!
+ *  A file of the temporary backing directory opened through the handle layer
+ */
+class BenchFile
+{
+public:
+        BenchFile(const char* name,int flags) :
+                        mInode(NULL), mHandle(NULL) {
+                struct fuse_entry_param e;
+                int res=lookupEntry(*rootInode,name,e);
+                if (res==-ENOENT)
+                        res=makeNode(*rootInode,name,S_IFREG|0644,0,NULL,e);
+                if (res==0) {
+                        // the lookup is kept like the kernel keeps it for an open file
+                        mInode=&inodeOf(e.ino);
+                        res=openHandle(*mInode,flags,mHandle);
+                }
+                if (res) {
+                        std::cerr<<name<<": "<<strerror(-res)<<std::endl;
+                        exit(1);
+                }
+        }
+
+        ~BenchFile() {
+                if (releaseHandle(mHandle))
+                        std::cerr<<"release failed"<<std::endl;
+                inodes.forget(mInode,1);
+        }
+
+        int write(const char* data,size_t size,off_t offset) {
+                struct fuse_bufvec src;
+                src.count=1;
+                src.idx=0;
+                src.off=0;
+                src.buf[0].size=size;
+                src.buf[0].flags=static_cast<enum fuse_buf_flags>(0);
+                src.buf[0].mem=const_cast<char*>(data);
+                src.buf[0].fd=-1;
+                src.buf[0].pos=0;
+                return writeHandle(*mHandle,src,offset);
+        }
+
+        int read(char* data,size_t size,off_t offset) {
+                return readHandle(*mHandle,size,offset,copySink,data);
+        }
+
+private:
+        BenchFile(const BenchFile&);
+        BenchFile& operator=(const BenchFile&);
+
+        InodeStruct* mInode;
+        CacheStruct* mHandle;
+};
+
+/*!
+ * times one pass of a file system benchmark
+ * @param requests number of requests made
+ * @param bytes bytes per request
+ */
+static void reportPass(BenchRun& run,const std::string& name,double start,int64_t requests,int64_t bytes)
+{
+        report(run,name,requests,now()-start,bytes);
+}
+
+/*!
+ * benchmarks the read and write paths of the handle layer
+ * @param name prefix of the results, the options of the pass
+ */
+static void fileSystemBenchmarks(BenchRun& run,const std::string& name)
+{
+        const int64_t size=run.fileSize;
+        std::vector<char> data(BENCH_REQUEST_SIZE);
+        // text like data, so that compressed files behave like logs
+        for (size_t i=0;i<data.size();++i)
+                data[i]=(rand()%8==0)?'\n':'a'+rand()%16;
+        const std::string file=name.substr(name.find('/')+1);
+
+        if (selected(run,name+"/write_seq")) {
+                const double start=now();
+                {
+                        BenchFile bench(file.c_str(),O_WRONLY);
+                        for (int64_t offset=0;offset<size;offset+=BENCH_REQUEST_SIZE)
+                                if (bench.write(&data[0],BENCH_REQUEST_SIZE,offset)!=BENCH_REQUEST_SIZE)
+                                        abort();
+                }
+                reportPass(run,name+"/write_seq",start,size/BENCH_REQUEST_SIZE,BENCH_REQUEST_SIZE);
+        }
+        std::vector<char> buffer(BENCH_REQUEST_SIZE);
+        if (selected(run,name+"/read_seq")) {
+                BenchFile bench(file.c_str(),O_RDONLY);
+                // the first pass verifies the blocks, the second one may trust them
+                const char* passes[]= {"/read_seq","/read_seq_again"};
+                for (int pass=0;pass<2;++pass) {
+                        const double start=now();
+                        int64_t requests=0;
+                        for (int64_t offset=0;offset<size;offset+=BENCH_REQUEST_SIZE,++requests)
+                                if (bench.read(&buffer[0],BENCH_REQUEST_SIZE,offset)<0)
+                                        abort();
+                        reportPass(run,name+passes[pass],start,requests,BENCH_REQUEST_SIZE);
+                }
+        }
+        const int64_t smallRequests=std::max(size/BENCH_REQUEST_SIZE*4,static_cast<int64_t>(1));
+        if (selected(run,name+"/read_random")) {
+                BenchFile bench(file.c_str(),O_RDONLY);
+                const double start=now();
+                for (int64_t i=0;i<smallRequests;++i)
+                        if (bench.read(&buffer[0],BENCH_SMALL_SIZE,rand()%(size-BENCH_SMALL_SIZE))<0)
+                                abort();
+                reportPass(run,name+"/read_random",start,smallRequests,BENCH_SMALL_SIZE);
+        }
+        if (selected(run,name+"/write_random")) {
+                const double start=now();
+                {
+                        BenchFile bench(file.c_str(),O_WRONLY);
+                        for (int64_t i=0;i<smallRequests;++i)
+                                if (bench.write(&data[0],BENCH_SMALL_SIZE,rand()%(size-BENCH_SMALL_SIZE))!=BENCH_SMALL_SIZE)
+                                        abort();
+                }
+                reportPass(run,name+"/write_random",start,smallRequests,BENCH_SMALL_SIZE);
+        }
+        if (selected(run,name+"/append")) {
+                // log style appends of odd sizes, each one continues a block written before
+                const int64_t appendSize=1000;
+                const double start=now();
+                {
+                        BenchFile bench((file+".log").c_str(),O_WRONLY);
+                        for (int64_t i=0;i<smallRequests;++i)
+                                if (bench.write(&data[i%BENCH_REQUEST_SIZE/2],appendSize,i*appendSize)!=appendSize)
+                                        abort();
+                }
+                reportPass(run,name+"/append",start,smallRequests,appendSize);
+        }
+}
+
+static void usage(const char* name)
+{
+        std::cerr<<"Usage: "<<name<<" [-t seconds] [-s file MiB] [-f filter] [-d directory] [-o output]"<<std::endl;
+}
+
+int main(int argc,char* argv[])
+{
+        BenchRun run;
+        const char* directory="/tmp";
+        const char* output=NULL;
+        int opt;
+        while ((opt=getopt(argc,argv,"t:s:f:d:o:"))!=-1) {
+                switch (opt) {
+                case 't':
+                        run.minTime=strtod(optarg,NULL);
+                        break;
+                case 's':
+                        run.fileSize=strtoll(optarg,NULL,10)<<20;
+                        break;
+                case 'f':
+                        run.filter=optarg;
+                        break;
+                case 'd':
+                        directory=optarg;
+                        break;
+                case 'o':
+                        output=optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind!=argc || run.minTime<=0 || run.fileSize<BENCH_REQUEST_SIZE) {
+                usage(argv[0]);
+                return 1;
+        }
+        if (output) {
+                run.out=fopen(output,"w");
+                if (run.out==NULL) {
+                        std::cerr<<output<<": "<<strerror(errno)<<std::endl;
+                        return 1;
+                }
+        }
+        gcry_check_version(NULL);
+        gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+        srand(1);
+
+        // block format
+        FormatContext format;
+        randomize(&format.buffer[0],format.buffer.size());
+        const size_t sizes[]= {64,512,FAILSAFE_DATA_SIZE,FAILSAFE_BLOCK_SIZE,COMPRESS_CHUNK_SIZE};
+        for (int algorithm=0;algorithm<HASH_ALGORITHMS;++algorithm) {
+                const std::string hash=HashAlgorithmNames[algorithm];
+                format.algorithm=algorithm;
+                for (size_t i=0;i<sizeof(sizes)/sizeof(sizes[0]);++i) {
+                        std::ostringstream name;
+                        name<<"hash/"<<hash<<"/"<<sizes[i];
+                        format.size=sizes[i];
+                        measure(run,name.str(),benchHashBuffer,&format,sizes[i]);
+                }
+                memset(&format.prev,0,sizeof(format.prev));
+                calculateHeader(format.prev,format.prev,FAILSAFE_DATA_SIZE,0,0,1,algorithm);
+                calculateHASH(format.prev);
+                measure(run,"calculateHeader/"+hash,benchCalculateHeader,&format,0);
+                calculateHeader(format.block,format.prev,FAILSAFE_DATA_SIZE,1,FAILSAFE_DATA_SIZE,1,algorithm);
+                memcpy(format.block.data,&format.buffer[0],FAILSAFE_DATA_SIZE);
+                measure(run,"calculateHASH/"+hash,benchCalculateHASH,&format,FAILSAFE_DATA_SIZE);
+                calculateHASH(format.block);
+                measure(run,"checkConsistency/"+hash,benchCheckConsistency,&format,FAILSAFE_DATA_SIZE);
+        }
+        format.size=sizeof(format.block.mRandomNumber);
+        measure(run,"randomize/32",benchRandomize,&format,format.size);
+        format.size=FAILSAFE_DATA_SIZE;
+        measure(run,"randomize/3840",benchRandomize,&format,format.size);
+
+        OffsetContext offsets;
+        for (int i=0;i<BENCH_OFFSETS;++i) {
+                offsets.offsets[i]=(static_cast<int64_t>(rand())<<8)%(static_cast<int64_t>(1)<<36);
+                offsets.sizes[i]=1+rand()%BENCH_REQUEST_SIZE;
+        }
+        measure(run,"offsets/request",benchOffsets,&offsets,0);
+
+        CompressContext compress;
+        for (size_t i=0;i<compress.data.size();++i)
+                compress.data[i]=(rand()%8==0)?'\n':'a'+rand()%16;
+        calculateHeader(compress.extent[0],compress.extent[0],COMPRESS_CHUNK_SIZE,0,0,1,HASH_SHA1,FAILSAFE_FLAG_COMPRESSED);
+        const int levels[]= {1,6};
+        for (size_t i=0;i<sizeof(levels)/sizeof(levels[0]);++i) {
+                std::ostringstream name;
+                name<<"compressChunk/"<<levels[i];
+                compress.level=levels[i];
+                measure(run,name.str(),benchCompressChunk,&compress,COMPRESS_CHUNK_SIZE);
+        }
+        measure(run,"decompressChunk",benchDecompressChunk,&compress,COMPRESS_CHUNK_SIZE);
+
+        // temporary backing directory, set up like main() does it
+        std::string root=std::string(directory)+"/failsafe-bench-XXXXXX";
+        std::vector<char> rootName(root.begin(),root.end());
+        rootName.push_back('\0');
+        if (mkdtemp(&rootName[0])==NULL) {
+                std::cerr<<directory<<": "<<strerror(errno)<<std::endl;
+                return 1;
+        }
+        basepath=&rootName[0];
+        const int rootFd=open(basepath.c_str(),O_PATH|O_DIRECTORY);
+        struct stat st;
+        if (rootFd==-1 || fstat(rootFd,&st)==-1) {
+                std::cerr<<basepath<<": "<<strerror(errno)<<std::endl;
+                return 1;
+        }
+        const InodeKey rootKey= {st.st_dev,st.st_ino};
+        rootInode=inodes.lookup(rootKey,rootFd);
+        dedupStore.setRoot(rootFd);
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+        options.hashThreads=cpus>1?cpus-1:0;
+        options.cacheSize=64;
+        options.readahead=1024;
+        options.writeback=5;
+        options.dirtySize=32;
+        options.hashAlgorithm=HASH_SHA1;
+#ifdef HAVE_IO_URING
+        if (uringIO.available())
+                blockIO=&uringIO;
+#endif
+        hashPool.start(options.hashThreads);
+        blockCache.setCapacity(static_cast<size_t>(options.cacheSize)<<20);
+        writeBack.start(writeBackThread);
+
+        // single blocks through the block layer, the cache is off for the uncached reads
+        {
+                BlockIOContext io;
+                {
+                        // released, so the description is written before the lookup
+                        BenchFile bench("blocks",O_WRONLY);
+                        std::vector<char> data(FAILSAFE_DATA_SIZE*256);
+                        randomize(&data[0],data.size());
+                        bench.write(&data[0],data.size(),0);
+                }
+                flushAllDirty();
+                io.fd=open((basepath+"/blocks").c_str(),O_RDWR);
+                struct fuse_entry_param e;
+                const int res=io.fd<0?-errno:lookupEntry(*rootInode,"blocks",e);
+                if (res) {
+                        std::cerr<<"blocks: "<<strerror(-res)<<std::endl;
+                        return 1;
+                }
+                io.inode=&inodeOf(e.ino);
+                io.blocks=256;
+                measure(run,"readBlock/cached",benchReadBlock,&io,FAILSAFE_DATA_SIZE);
+                blockCache.setCapacity(0);
+                measure(run,"readBlock/uncached",benchReadBlock,&io,FAILSAFE_DATA_SIZE);
+                blockCache.setCapacity(static_cast<size_t>(options.cacheSize)<<20);
+                measure(run,"inodeAttributes",benchAttributes,&io,0);
+                readBlock(*(io.inode),io.fd,io.block,0);
+                measure(run,"writeBlock",benchWriteBlock,&io,FAILSAFE_BLOCK_SIZE);
+                close(io.fd);
+                inodes.forget(io.inode,1);
+        }
+
+        // the read and write paths with the format options of new files
+        fileSystemBenchmarks(run,"fs/plain");
+        options.hashAlgorithm=HASH_CRC32C;
+        fileSystemBenchmarks(run,"fs/crc32c");
+        options.hashAlgorithm=HASH_SHA1;
+        options.merkle=1;
+        fileSystemBenchmarks(run,"fs/merkle");
+        options.merkle=0;
+        options.compress=1;
+        fileSystemBenchmarks(run,"fs/compress");
+        options.compress=0;
+        options.blockShift=16;
+        fileSystemBenchmarks(run,"fs/block64k");
+        options.blockShift=20;
+        fileSystemBenchmarks(run,"fs/block1m");
+        // write_seq repeats its request, the payloads after the first ones are known
+        options.blockShift=16;
+        options.dedup=1;
+        fileSystemBenchmarks(run,"fs/dedup");
+        options.dedup=0;
+        options.blockShift=0;
+        // the same files without the page cache of the host
+        options.directBacking=1;
+        directIO.setEngine(blockIO);
+        blockIO=&directIO;
+        fileSystemBenchmarks(run,"fs/direct");
+        options.blockShift=16;
+        fileSystemBenchmarks(run,"fs/direct64k");
+        options.blockShift=0;
+        blockIO=directIO.engine();
+        options.directBacking=0;
+
+        writeBack.stop();
+        flushAllDirty();
+        hashPool.stop();
+        std::string cleanup="rm -rf '"+basepath+"'";
+        if (system(cleanup.c_str())!=0)
+                std::cerr<<"could not remove "<<basepath<<std::endl;
+        if (run.out!=stdout)
+                fclose(run.out);
+        return 0;
+}
@@ -0,0 +1,490 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_CACHE_HEADER__
+#define __FAILSAFE_CACHE_HEADER__
+
+#include "failsafe.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <list>
+#include <map>
+#include <vector>
+
+/// Number of independently locked block cache shards
+#define BLOCK_CACHE_SHARDS 16
+
+/*!
+ *  Identity of a data block: backing file and block number
+ */
+struct BlockKey {
+        dev_t dev;
+        ino_t ino;
+        int64_t blockNr;
+
+        bool operator<(const BlockKey& other) const {
+                if (ino!=other.ino)
+                        return ino<other.ino;
+                if (blockNr!=other.blockNr)
+                        return blockNr<other.blockNr;
+                return dev<other.dev;
+        }
+};
+
+/*!
+ *  Verified data block held by the cache
+ *
+ *  Entries are reference counted: a block returned by lookup stays valid
+ *  until it is given back with release, even if it is evicted meanwhile.
+ */
+struct CachedBlock {
+        CachedBlock(const BlockKey& k,uint64_t g,const FailSafeStoreStruct& b) :
+                        key(k), generation(g), refs(0), detached(false), lru(), block(b) {
+        }
+
+        BlockKey key;
+        /// Version of the inode the block was read from
+        uint64_t generation;
+        /// References held by lookups (guarded by the shard mutex)
+        int refs;
+        /// Removed from the cache, freed by the last release
+        bool detached;
+        std::list<CachedBlock*>::iterator lru;
+        FailSafeStoreStruct block;
+};
+
+/*!
+ *  Memory bounded LRU cache of verified blocks shared by every open file
+ *
+ */
+class BlockCache
+{
+public:
+        BlockCache() :
+                        mShards(), mCapacity(0), mHits(0), mMisses(0), mEvictions(0) {
+        }
+
+        ~BlockCache() {
+                for (int i=0;i<BLOCK_CACHE_SHARDS;++i)
+                        clear(mShards[i]);
+        }
+
+        /*!
+         * sets the memory limit of the cache
+         * @param bytes memory used for block payloads, 0 disables the cache
+         */
+        void setCapacity(size_t bytes) {
+                mCapacity=bytes/BLOCK_CACHE_SHARDS/sizeof(CachedBlock);
+        }
+
+        bool enabled() const {
+                return mCapacity>0;
+        }
+
+        /// Memory limit in blocks
+        size_t capacity() const {
+                return mCapacity*BLOCK_CACHE_SHARDS;
+        }
+
+        /*!
+         * finds a block and takes a reference to it
+         * @param key block identity
+         * @param generation current version of the inode
+         * @return the block or NULL, a found block must be given back by release
+         */
+        CachedBlock* lookup(const BlockKey& key,uint64_t generation) {
+                if (!enabled())
+                        return NULL;
+                Shard& shard=shardOf(key);
+                pthread_mutex_lock(&shard.mutex);
+                std::map<BlockKey,CachedBlock*>::iterator it=shard.blocks.find(key);
+                CachedBlock* entry=NULL;
+                if (it!=shard.blocks.end()) {
+                        if (it->second->generation==generation) {
+                                entry=it->second;
+                                ++entry->refs;
+                                shard.lru.splice(shard.lru.begin(),shard.lru,entry->lru);
+                        } else {
+                                detach(shard,it);
+                        }
+                }
+                pthread_mutex_unlock(&shard.mutex);
+                __sync_fetch_and_add(entry?&mHits:&mMisses,1);
+                return entry;
+        }
+
+        /*!
+         * gives back a block returned by lookup
+         */
+        void release(CachedBlock* entry) {
+                Shard& shard=shardOf(entry->key);
+                pthread_mutex_lock(&shard.mutex);
+                const bool destroy=(--entry->refs==0) && entry->detached;
+                pthread_mutex_unlock(&shard.mutex);
+                if (destroy)
+                        delete entry;
+        }
+
+        /*!
+         * stores a verified block, evicting the least recently used ones
+         * @param key block identity
+         * @param generation version of the inode the block was read from
+         * @param block verified block
+         */
+        void insert(const BlockKey& key,uint64_t generation,const FailSafeStoreStruct& block) {
+                if (!enabled())
+                        return;
+                CachedBlock* entry=new CachedBlock(key,generation,block);
+
+                Shard& shard=shardOf(key);
+                pthread_mutex_lock(&shard.mutex);
+                std::map<BlockKey,CachedBlock*>::iterator it=shard.blocks.find(key);
+                if (it!=shard.blocks.end())
+                        detach(shard,it);
+                shard.lru.push_front(entry);
+                entry->lru=shard.lru.begin();
+                shard.blocks[key]=entry;
+                while (shard.blocks.size()>mCapacity) {
+                        detach(shard,shard.blocks.find(shard.lru.back()->key));
+                        __sync_fetch_and_add(&mEvictions,1);
+                }
+                pthread_mutex_unlock(&shard.mutex);
+        }
+
+        /*!
+         * drops a range of blocks of a file (write-through invalidation)
+         * @param dev device of the backing file
+         * @param ino inode of the backing file
+         * @param firstBlockNr first block to drop
+         * @param count number of blocks
+         */
+        void invalidate(dev_t dev,ino_t ino,int64_t firstBlockNr,int64_t count) {
+                if (!enabled())
+                        return;
+                BlockKey key= {dev,ino,firstBlockNr};
+                for (;key.blockNr<firstBlockNr+count;++key.blockNr) {
+                        Shard& shard=shardOf(key);
+                        pthread_mutex_lock(&shard.mutex);
+                        std::map<BlockKey,CachedBlock*>::iterator it=shard.blocks.find(key);
+                        if (it!=shard.blocks.end())
+                                detach(shard,it);
+                        pthread_mutex_unlock(&shard.mutex);
+                }
+        }
+
+        uint64_t hits() const {
+                return mHits;
+        }
+
+        uint64_t misses() const {
+                return mMisses;
+        }
+
+        uint64_t evictions() const {
+                return mEvictions;
+        }
+
+        /// Number of cached blocks
+        size_t size() {
+                size_t result=0;
+                for (int i=0;i<BLOCK_CACHE_SHARDS;++i) {
+                        pthread_mutex_lock(&(mShards[i].mutex));
+                        result+=mShards[i].blocks.size();
+                        pthread_mutex_unlock(&(mShards[i].mutex));
+                }
+                return result;
+        }
+
+private:
+        BlockCache(const BlockCache&);
+        BlockCache& operator=(const BlockCache&);
+
+        struct Shard {
+                Shard() :
+                                mutex(), blocks(), lru() {
+                        pthread_mutex_init(&mutex,NULL);
+                }
+
+                pthread_mutex_t mutex;
+                std::map<BlockKey,CachedBlock*> blocks;
+                /// Most recently used first
+                std::list<CachedBlock*> lru;
+        };
+
+        Shard& shardOf(const BlockKey& key) {
+                uint64_t h=(static_cast<uint64_t>(key.ino)*0x9E3779B97F4A7C15ULL)^static_cast<uint64_t>(key.blockNr);
+                return mShards[(h*0x9E3779B97F4A7C15ULL>>40)%BLOCK_CACHE_SHARDS];
+        }
+
+        /// removes an entry from the shard (called with the shard mutex held)
+        static void detach(Shard& shard,std::map<BlockKey,CachedBlock*>::iterator it) {
+                CachedBlock* entry=it->second;
+                shard.lru.erase(entry->lru);
+                shard.blocks.erase(it);
+                entry->detached=true;
+                if (entry->refs==0)
+                        delete entry;
+        }
+
+        static void clear(Shard& shard) {
+                while (!shard.blocks.empty())
+                        detach(shard,shard.blocks.begin());
+        }
+
+        Shard mShards[BLOCK_CACHE_SHARDS];
+        /// Maximal number of blocks per shard
+        size_t mCapacity;
+        uint64_t mHits;
+        uint64_t mMisses;
+        uint64_t mEvictions;
+};
+
+/*!
+ *  References to cached blocks of a request, released together
+ *
+ */
+class CachedBlockRefs
+{
+public:
+        CachedBlockRefs(BlockCache& cache,size_t count) :
+                        mCache(cache), mBlocks(count,static_cast<CachedBlock*>(NULL)) {
+        }
+
+        ~CachedBlockRefs() {
+                for (size_t i=0;i<mBlocks.size();++i)
+                        if (mBlocks[i])
+                                mCache.release(mBlocks[i]);
+        }
+
+        CachedBlock*& operator[](size_t index) {
+                return mBlocks[index];
+        }
+
+private:
+        CachedBlockRefs(const CachedBlockRefs&);
+        CachedBlockRefs& operator=(const CachedBlockRefs&);
+
+        BlockCache& mCache;
+        std::vector<CachedBlock*> mBlocks;
+};
+
+/*!
+ *  Blocks of an inode written but not stored yet, ordered by block number
+ *
+ *  The payload and the header are kept up to date by every write, the
+ *  links of the hash chain and the hash are only calculated when the
+ *  blocks are flushed.
+ */
+class DirtyBlocks
+{
+public:
+        typedef std::map<int64_t,FailSafeStoreStruct*>::iterator iterator;
+
+        DirtyBlocks() :
+                        mBlocks() {
+        }
+
+        ~DirtyBlocks() {
+                while (!mBlocks.empty())
+                        erase(mBlocks.begin());
+        }
+
+        /*!
+         * dirty copy of a block or NULL
+         */
+        FailSafeStoreStruct* find(int64_t blockNr) const {
+                std::map<int64_t,FailSafeStoreStruct*>::const_iterator it=mBlocks.find(blockNr);
+                return it==mBlocks.end()?NULL:it->second;
+        }
+
+        /*!
+         * adds an uninitialized block
+         * @return the block or NULL if out of memory
+         */
+        FailSafeStoreStruct* insert(int64_t blockNr) {
+                void* memory=NULL;
+                if (posix_memalign(&memory,FAILSAFE_BLOCK_SIZE,sizeof(FailSafeStoreStruct))!=0)
+                        return NULL;
+                FailSafeStoreStruct* block=static_cast<FailSafeStoreStruct*>(memory);
+                mBlocks[blockNr]=block;
+                __sync_fetch_and_add(&counter(),1);
+                return block;
+        }
+
+        void erase(iterator it) {
+                free(it->second);
+                mBlocks.erase(it);
+                __sync_fetch_and_sub(&counter(),1);
+        }
+
+        iterator begin() {
+                return mBlocks.begin();
+        }
+
+        iterator end() {
+                return mBlocks.end();
+        }
+
+        bool empty() const {
+                return mBlocks.empty();
+        }
+
+        /// Number of dirty blocks of every inode
+        static uint64_t total() {
+                return counter();
+        }
+
+private:
+        DirtyBlocks(const DirtyBlocks&);
+        DirtyBlocks& operator=(const DirtyBlocks&);
+
+        static uint64_t& counter() {
+                static uint64_t blocks=0;
+                return blocks;
+        }
+
+        std::map<int64_t,FailSafeStoreStruct*> mBlocks;
+};
+
+/*!
+ *  Copy of the last block an inode stored through this mount
+ *
+ *  Writes appending to the file link to it and complete it without
+ *  reading and verifying it again, a rewrite of the block itself keeps
+ *  its link to the block before it. A block of version 2.00 keeps the used
+ *  part of its payload apart from the header. Blocks of a Merkle tree
+ *  take the identity of the file from block 0 instead, it is kept too.
+ *  The copies belong to a generation of the inode, a backing file changed
+ *  by someone else does not match them any more.
+ */
+class ChainTail
+{
+public:
+        ChainTail() :
+                        mBlockNr(-1), mHasIdentity(false), mGeneration(0), mBlocks(NULL), mPayload(NULL), mCapacity(0) {
+        }
+
+        ~ChainTail() {
+                clear();
+        }
+
+        /*!
+         * the kept copy of a block or NULL
+         * @param blockNr number of the block
+         * @param generation current generation of the inode
+         */
+        const FailSafeStoreStruct* find(int64_t blockNr,uint64_t generation) const {
+                return (mBlockNr>=0 && mBlockNr==blockNr && mGeneration==generation)?&mBlocks[TAIL_BLOCK]:NULL;
+        }
+
+        /*!
+         * the predecessor of a block in the hash chain: the kept block or,
+         * when the block itself is kept, a stand-in with its link
+         * @return NULL if the predecessor has to be read
+         */
+        const FailSafeStoreStruct* predecessor(int64_t blockNr,uint64_t generation) const {
+                if (find(blockNr-1,generation))
+                        return &mBlocks[TAIL_BLOCK];
+                return find(blockNr,generation)?&mBlocks[TAIL_LINK]:NULL;
+        }
+
+        /// payload of the kept block of version 2.00
+        const char* payload() const {
+                return mPayload;
+        }
+
+        /// header with the identity of the file or NULL
+        const FailSafeStoreStruct* identity(uint64_t generation) const {
+                return (mHasIdentity && mGeneration==generation)?&mBlocks[TAIL_IDENTITY]:NULL;
+        }
+
+        /*!
+         * keeps a copy of a block just stored, unless a later block is kept
+         * @param payload the mSizeOfDataInCurrentBlock bytes of a block of
+         *        version 2.00, NULL for version 1.x
+         */
+        void keep(int64_t blockNr,uint64_t generation,const FailSafeStoreStruct& block,const char* payload) {
+                if (mBlockNr>blockNr && mGeneration==generation)
+                        return;
+                if (!adopt(generation))
+                        return;
+                mBlockNr=-1;
+                const size_t size=payload?block.mSizeOfDataInCurrentBlock:0;
+                if (size>mCapacity) {
+                        char* grown=static_cast<char*>(realloc(mPayload,size));
+                        if (grown==NULL)
+                                return;
+                        mPayload=grown;
+                        mCapacity=size;
+                }
+                memcpy(&mBlocks[TAIL_BLOCK],&block,payload?FAILSAFE_HEADER_SIZE:sizeof(FailSafeStoreStruct));
+                // the stand-in for the predecessor only carries the link
+                FailSafeStoreStruct& link=mBlocks[TAIL_LINK];
+                memcpy(&link,&block,FAILSAFE_HEADER_SIZE);
+                memcpy(link.mCurrentHash,block.mLastHash,HASH_SIZE);
+                link.mBlockCounter=blockNr-1;
+                if (size)
+                        memcpy(mPayload,payload,size);
+                mBlockNr=blockNr;
+        }
+
+        /// keeps the identity of the file from its block 0
+        void keepIdentity(uint64_t generation,const FailSafeStoreStruct& first) {
+                if (!adopt(generation))
+                        return;
+                memcpy(&mBlocks[TAIL_IDENTITY],&first,FAILSAFE_HEADER_SIZE);
+                mHasIdentity=true;
+        }
+
+        /// forgets the copies and frees their memory
+        void clear() {
+                free(mBlocks);
+                free(mPayload);
+                mBlockNr=-1;
+                mHasIdentity=false;
+                mBlocks=NULL;
+                mPayload=NULL;
+                mCapacity=0;
+        }
+
+private:
+        ChainTail(const ChainTail&);
+        ChainTail& operator=(const ChainTail&);
+
+        enum {
+                TAIL_BLOCK=0,
+                TAIL_LINK,
+                TAIL_IDENTITY,
+                TAIL_BLOCKS
+        };
+
+        /// drops the copies of an older generation, allocates the blocks
+        bool adopt(uint64_t generation) {
+                if (mGeneration!=generation) {
+                        mBlockNr=-1;
+                        mHasIdentity=false;
+                        mGeneration=generation;
+                }
+                if (mBlocks==NULL)
+                        mBlocks=static_cast<FailSafeStoreStruct*>(malloc(TAIL_BLOCKS*sizeof(FailSafeStoreStruct)));
+                return mBlocks!=NULL;
+        }
+
+        /// Number of the kept block, -1 if there is none
+        int64_t mBlockNr;
+        bool mHasIdentity;
+        uint64_t mGeneration;
+        /// The kept block, the stand-in for its predecessor and the identity
+        FailSafeStoreStruct* mBlocks;
+        char* mPayload;
+        size_t mCapacity;
+};
+
+#endif
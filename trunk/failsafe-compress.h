@@ -0,0 +1,138 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_COMPRESS_HEADER__
+#define __FAILSAFE_COMPRESS_HEADER__
+
+#include "failsafe.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ *  Layout of a file with FAILSAFE_FLAG_COMPRESSED
+ *
+ *  The data is cut into chunks of COMPRESS_CHUNK_SIZE logical bytes. Chunk
+ *  i owns the COMPRESS_CHUNK_BLOCKS backing blocks starting at block
+ *  i*COMPRESS_CHUNK_BLOCKS, so the position of a chunk is still found with
+ *  a division. The chunk is stored as an extent: a normal block header
+ *  (mBlockCounter is the chunk number, mSizeOfDataInCurrentBlock its
+ *  logical size) followed by mStoredSize bytes of zlib data, which continue
+ *  over the following blocks of the chunk without further headers. The
+ *  rest of the chunk is never written and stays a hole of the backing file.
+ *  The hash covers the whole extent, an extent of one block is hashed like
+ *  a plain block. The description follows the last chunk.
+ */
+
+/* COMPRESS_CHUNK_BLOCKS and COMPRESS_CHUNK_SIZE are part of the format, see failsafe.h */
+
+/// Bytes of compressed data an extent can hold, more than zlib needs for an incompressible chunk
+#define COMPRESS_EXTENT_CAPACITY (COMPRESS_CHUNK_BLOCKS*FAILSAFE_BLOCK_SIZE-FAILSAFE_HEADER_SIZE)
+
+/*!
+ * number of blocks of the extent starting with a header
+ * @return 1 for a plain block, 0 for an invalid compressed header
+ */
+inline int64_t extentBlocksOf(const FailSafeStoreStruct& header)
+{
+        if (!(formatFlagsOf(header)&FAILSAFE_FLAG_COMPRESSED))
+                return 1;
+        const uint32_t stored=extensionOf(header).mStoredSize;
+        if (stored>COMPRESS_EXTENT_CAPACITY)
+                return 0;
+        return (FAILSAFE_HEADER_SIZE+stored+FAILSAFE_BLOCK_SIZE-1)/FAILSAFE_BLOCK_SIZE;
+}
+
+/// compressed data of an extent
+inline char* storedDataOf(FailSafeStoreStruct* extent)
+{
+        return reinterpret_cast<char*>(extent)+FAILSAFE_HEADER_SIZE;
+}
+
+inline const char* storedDataOf(const FailSafeStoreStruct* extent)
+{
+        return reinterpret_cast<const char*>(extent)+FAILSAFE_HEADER_SIZE;
+}
+
+/*!
+ * hash calculation of an extent, the header is complete
+ * @param extent header followed by the rest of the extent in memory
+ */
+inline void calculateExtentHASH(FailSafeStoreStruct* extent)
+{
+        char* ptr=(reinterpret_cast<char*>(extent))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
+        const int64_t len=extentBlocksOf(*extent)*FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE);
+        hashBuffer(hashAlgorithmOf(*extent),extent->mCurrentHash,ptr,len);
+}
+
+/*!
+ * checking the consistency of an extent
+ * @param extent header followed by the rest of the extent in memory
+ * @param available blocks in memory starting with the header
+ * @return true, if the extent is complete and its hash is correct
+ */
+inline bool checkExtentConsistency(const FailSafeStoreStruct* extent,int64_t available)
+{
+        const int64_t blocks=extentBlocksOf(*extent);
+        if (blocks==0 || blocks>available)
+                return false;
+        if (blocks==1)
+                return checkConsistency(*extent);
+        if (memcmp(extent->mSignature,FSSignature,sizeof(extent->mSignature))!=0)
+                return false;
+        const int algorithm=hashAlgorithmOf(*extent);
+        if (algorithm<0)
+                return false;
+        char hash[HASH_SIZE];
+        const char* ptr=(reinterpret_cast<const char*>(extent))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
+        hashBuffer(algorithm,hash,ptr,blocks*FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE));
+        return memcmp(extent->mCurrentHash,hash,HASH_SIZE)==0;
+}
+
+/*!
+ * compresses the data of a chunk into an extent whose header is prepared,
+ * the unused end of its last block is zeroed and the extent is hashed
+ * @param extent COMPRESS_CHUNK_BLOCKS blocks, the first one has the header
+ * @param data logical data of the chunk
+ * @param size mSizeOfDataInCurrentBlock of the header
+ * @param level zlib compression level
+ * @return 0 or -EIO
+ */
+inline int compressChunk(FailSafeStoreStruct* extent,const char* data,int64_t size,int level)
+{
+        uLongf stored=COMPRESS_EXTENT_CAPACITY;
+        if (compress2(reinterpret_cast<Bytef*>(storedDataOf(extent)),&stored,reinterpret_cast<const Bytef*>(data),size,level)!=Z_OK)
+                return -EIO;
+        extensionOf(*extent).mStoredSize=stored;
+        const int64_t end=extentBlocksOf(*extent)*FAILSAFE_BLOCK_SIZE-FAILSAFE_HEADER_SIZE;
+        memset(storedDataOf(extent)+stored,0,end-stored);
+        calculateExtentHASH(extent);
+        return 0;
+}
+
+/*!
+ * decompresses a verified extent
+ * @param extent complete extent
+ * @param data destination of COMPRESS_CHUNK_SIZE bytes
+ * @return 0 or -EIO if the data does not match the header
+ */
+inline int decompressChunk(const FailSafeStoreStruct* extent,char* data)
+{
+        uLongf size=COMPRESS_CHUNK_SIZE;
+        if (extent->mSizeOfDataInCurrentBlock<0 || extent->mSizeOfDataInCurrentBlock>COMPRESS_CHUNK_SIZE)
+                return -EIO;
+        if (uncompress(reinterpret_cast<Bytef*>(data),&size,reinterpret_cast<const Bytef*>(storedDataOf(extent)),
+                       extensionOf(*extent).mStoredSize)!=Z_OK)
+                return -EIO;
+        if (static_cast<int64_t>(size)!=extent->mSizeOfDataInCurrentBlock)
+                return -EIO;
+        return 0;
+}
+
+#endif
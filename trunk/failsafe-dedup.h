@@ -0,0 +1,430 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_DEDUP_HEADER__
+#define __FAILSAFE_DEDUP_HEADER__
+
+#include "failsafe.h"
+#include "failsafe-geometry.h"
+#include "failsafe-merkle.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ *  Shared payloads of the files of version 2.00 with FAILSAFE_FLAG_DEDUP
+ *
+ *  Every block size has its own store in DEDUP_DIR:
+ *      extents-<shift>  payload slots of 2^shift bytes, slot s at s<<shift
+ *      index-<shift>    one DedupRecord per slot, a slot without references is free
+ *  The block map of a file (DEDUP_MAP_DIR/<dev>-<ino>) holds the shift
+ *  followed by one int64_t per block: the slot of its payload plus one, 0
+ *  if the payload is stored in the backing file itself.
+ *
+ *  Only full blocks are shared. Their headers stay in the backing file and
+ *  their hash covers the shared payload, so a payload is verified by every
+ *  file using it. The payload slot of a shared block is a hole of the
+ *  backing file.
+ */
+
+/// Directory of the shared payloads
+#define DEDUP_DIR FAILSAFE_META_DIR "/dedup"
+
+/// Directory of the block maps, one file per backing inode
+#define DEDUP_MAP_DIR DEDUP_DIR "/maps"
+
+/// Bytes of the content key of a payload (SHA-256)
+#define DEDUP_KEY_SIZE 32
+
+/// Bytes in front of the entries of a block map
+#define DEDUP_MAP_HEADER 8
+
+/*!
+ *  Entry of the index of a store
+ */
+struct DedupRecord {
+        /// Content key of the payload in the slot
+        char mKey[DEDUP_KEY_SIZE];
+        /// Block map entries referring to the slot
+        int64_t mReferences;
+} __attribute__((__packed__)) ;
+
+/*!
+ * path of the block map of a backing file relative to the backing root
+ */
+inline std::string dedupMapPath(dev_t dev,ino_t ino)
+{
+        std::ostringstream path;
+        path<<DEDUP_MAP_DIR<<"/"<<std::hex<<static_cast<uint64_t>(dev)<<"-"<<static_cast<uint64_t>(ino);
+        return path.str();
+}
+
+/// path of the payload slots of a block size relative to the backing root
+inline std::string dedupExtentsPath(int shift)
+{
+        std::ostringstream path;
+        path<<DEDUP_DIR<<"/extents-"<<shift;
+        return path.str();
+}
+
+/// path of the index of a block size relative to the backing root
+inline std::string dedupIndexPath(int shift)
+{
+        std::ostringstream path;
+        path<<DEDUP_DIR<<"/index-"<<shift;
+        return path.str();
+}
+
+/*!
+ * reads entries of a block map, the entries beyond its end are 0
+ * @param slots receives count entries
+ * @return 0 or -errno
+ */
+inline int readDedupMap(int mapFd,int64_t firstBlockNr,int64_t count,int64_t* slots)
+{
+        const ssize_t res=pread(mapFd,slots,count*sizeof(int64_t),DEDUP_MAP_HEADER+firstBlockNr*sizeof(int64_t));
+        if (res<0)
+                return -errno;
+        memset(reinterpret_cast<char*>(slots)+res/sizeof(int64_t)*sizeof(int64_t),0,(count-res/sizeof(int64_t))*sizeof(int64_t));
+        return 0;
+}
+
+/*!
+ *  The stores of the shared payloads and the block maps of a backing tree
+ *
+ *  The index of a store is loaded into memory when the store is first
+ *  used, every change of a reference count is written through. Payloads
+ *  are written once, when their key is new, and their slot is punched out
+ *  when the last reference goes.
+ */
+class DedupStore
+{
+public:
+        DedupStore() :
+                        mRootFd(-1), mMutex(), mStores(), mHits(0), mStored(0) {
+                pthread_mutex_init(&mMutex,NULL);
+        }
+
+        ~DedupStore() {
+                for (int i=0;i<DEDUP_STORES;++i)
+                        delete mStores[i];
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        /// the backing root, the stores are below it
+        void setRoot(int rootFd) {
+                mRootFd=rootFd;
+        }
+
+        /// content key of a payload of 2^shift bytes
+        static void keyOf(const char* payload,int shift,char* key) {
+                gcry_md_hash_buffer(GCRY_MD_SHA256,key,payload,static_cast<size_t>(1)<<shift);
+        }
+
+        /*!
+         * descriptor of the payload slots of a block size
+         * @return descriptor or -errno
+         */
+        int extentFd(int shift) {
+                pthread_mutex_lock(&mMutex);
+                Store* store=storeOf(shift);
+                const int res=store?store->extentFd:-errno;
+                pthread_mutex_unlock(&mMutex);
+                return res;
+        }
+
+        /*!
+         * takes a reference to the slot of a payload, a payload not known
+         * yet is stored in a free slot
+         * @param key content key of the payload
+         * @param payload 2^shift bytes
+         * @return the slot or -errno
+         */
+        int64_t reference(int shift,const char* key,const char* payload) {
+                pthread_mutex_lock(&mMutex);
+                int64_t res;
+                Store* store=storeOf(shift);
+                if (store==NULL) {
+                        res=-errno;
+                } else {
+                        const std::string k(key,DEDUP_KEY_SIZE);
+                        std::map<std::string,int64_t>::iterator it=store->slots.find(k);
+                        if (it!=store->slots.end()) {
+                                res=it->second;
+                                ++(store->references[res]);
+                                const int saved=save(*store,res);
+                                if (saved<0) {
+                                        --(store->references[res]);
+                                        res=saved;
+                                } else {
+                                        __atomic_fetch_add(&mHits,1,__ATOMIC_RELAXED);
+                                }
+                        } else {
+                                res=store->free.empty()?static_cast<int64_t>(store->references.size()):store->free.back();
+                                const ssize_t size=static_cast<ssize_t>(1)<<shift;
+                                if (pwrite(store->extentFd,payload,size,res<<shift)!=size) {
+                                        res=-(errno?errno:EIO);
+                                } else {
+                                        if (res==static_cast<int64_t>(store->references.size())) {
+                                                store->references.push_back(0);
+                                                store->keys.push_back(store->slots.end());
+                                        } else {
+                                                store->free.pop_back();
+                                        }
+                                        store->references[res]=1;
+                                        store->keys[res]=store->slots.insert(std::make_pair(k,res)).first;
+                                        const int saved=save(*store,res);
+                                        if (saved<0) {
+                                                drop(*store,res,shift);
+                                                res=saved;
+                                        } else {
+                                                __atomic_fetch_add(&mStored,1,__ATOMIC_RELAXED);
+                                        }
+                                }
+                        }
+                }
+                pthread_mutex_unlock(&mMutex);
+                return res;
+        }
+
+        /*!
+         * gives back a reference taken by reference, the slot is freed with
+         * its last one
+         */
+        void release(int shift,int64_t slot) {
+                pthread_mutex_lock(&mMutex);
+                Store* store=storeOf(shift);
+                if (store && slot>=0 && slot<static_cast<int64_t>(store->references.size()) && store->references[slot]>0) {
+                        if (--(store->references[slot])==0)
+                                drop(*store,slot,shift);
+                        else
+                                save(*store,slot);
+                }
+                pthread_mutex_unlock(&mMutex);
+        }
+
+        /*!
+         * opens the block map of a backing file
+         * @param create a missing map is created for blocks of 2^shift bytes
+         * @return descriptor, -ENOENT if there is no map or -errno
+         */
+        int openMap(dev_t dev,ino_t ino,int shift,bool create) {
+                if (create) {
+                        mkdirat(mRootFd,FAILSAFE_META_DIR,0700);
+                        mkdirat(mRootFd,DEDUP_DIR,0700);
+                        mkdirat(mRootFd,DEDUP_MAP_DIR,0700);
+                }
+                const int fd=openat(mRootFd,dedupMapPath(dev,ino).c_str(),O_RDWR|(create?O_CREAT:0),0600);
+                if (fd<0)
+                        return -errno;
+                int64_t header=0;
+                const ssize_t res=pread(fd,&header,sizeof(header),0);
+                if (res==0 && create) {
+                        header=shift;
+                        if (pwrite(fd,&header,sizeof(header),0)==static_cast<ssize_t>(sizeof(header)))
+                                return fd;
+                } else if (res==static_cast<ssize_t>(sizeof(header)) && header==shift) {
+                        return fd;
+                }
+                close(fd);
+                return -EIO;
+        }
+
+        /*!
+         * replaces entries of a block map, the references of the replaced
+         * entries are given back
+         * @param entries slot plus one or 0 of each block, their references are taken
+         * @return 0 or -errno
+         */
+        int updateMap(int mapFd,int shift,int64_t firstBlockNr,const std::vector<int64_t>& entries) {
+                std::vector<int64_t> replaced(entries.size());
+                int res=readDedupMap(mapFd,firstBlockNr,entries.size(),&replaced[0]);
+                if (res)
+                        return res;
+                const ssize_t size=entries.size()*sizeof(int64_t);
+                if (pwrite(mapFd,&entries[0],size,DEDUP_MAP_HEADER+firstBlockNr*sizeof(int64_t))!=size)
+                        return -(errno?errno:EIO);
+                for (size_t i=0;i<replaced.size();++i)
+                        if (replaced[i]>0)
+                                release(shift,replaced[i]-1);
+                return 0;
+        }
+
+        /*!
+         * gives back the references of the blocks of a backing file cut to
+         * size bytes, a map of a file cut to 0 bytes is removed, nothing is
+         * done before setRoot
+         * @return 0 or -errno
+         */
+        int truncateMap(dev_t dev,ino_t ino,int64_t size) {
+                if (mRootFd<0)
+                        return 0;
+                const int fd=openat(mRootFd,dedupMapPath(dev,ino).c_str(),O_RDWR);
+                if (fd<0)
+                        return errno==ENOENT?0:-errno;
+                int64_t shift=0;
+                struct stat stbuf;
+                int res=0;
+                if (pread(fd,&shift,sizeof(shift),0)!=static_cast<ssize_t>(sizeof(shift)) || shift<LARGE_MIN_SHIFT || shift>LARGE_MAX_SHIFT || fstat(fd,&stbuf)==-1) {
+                        res=-EIO;
+                } else {
+                        // the blocks whose payload slot starts before the cut are kept
+                        const int64_t count=(stbuf.st_size-DEDUP_MAP_HEADER)/static_cast<int64_t>(sizeof(int64_t));
+                        int64_t kept=0;
+                        while (kept<count && largeDataPosition(shift,kept)<size)
+                                ++kept;
+                        if (kept<count) {
+                                std::vector<int64_t> entries(count-kept);
+                                res=readDedupMap(fd,kept,entries.size(),&entries[0]);
+                                if (res==0 && ftruncate(fd,DEDUP_MAP_HEADER+kept*sizeof(int64_t))==-1)
+                                        res=-errno;
+                                for (size_t i=0;res==0 && i<entries.size();++i)
+                                        if (entries[i]>0)
+                                                release(shift,entries[i]-1);
+                        }
+                }
+                close(fd);
+                if (res==0 && size==0)
+                        unlinkat(mRootFd,dedupMapPath(dev,ino).c_str(),0);
+                return res;
+        }
+
+        /// payloads found in a store instead of being written
+        uint64_t hits() const {
+                return __atomic_load_n(&mHits,__ATOMIC_RELAXED);
+        }
+
+        /// payloads written to a store
+        uint64_t stored() const {
+                return __atomic_load_n(&mStored,__ATOMIC_RELAXED);
+        }
+
+private:
+        DedupStore(const DedupStore&);
+        DedupStore& operator=(const DedupStore&);
+
+        /// Number of block sizes of version 2.00
+        static const int DEDUP_STORES=LARGE_MAX_SHIFT-LARGE_MIN_SHIFT+1;
+
+        /// Store of one block size
+        struct Store {
+                Store() :
+                                indexFd(-1), extentFd(-1), slots(), references(), keys(), free() {
+                }
+
+                ~Store() {
+                        if (indexFd>=0)
+                                close(indexFd);
+                        if (extentFd>=0)
+                                close(extentFd);
+                }
+
+                int indexFd;
+                int extentFd;
+                /// Slot of every stored payload by its key
+                std::map<std::string,int64_t> slots;
+                /// References of every slot
+                std::vector<int64_t> references;
+                /// Key of every slot, slots.end() for a free one
+                std::vector<std::map<std::string,int64_t>::iterator> keys;
+                /// Slots without references
+                std::vector<int64_t> free;
+
+        private:
+                Store(const Store&);
+                Store& operator=(const Store&);
+        };
+
+        /*!
+         * the store of a block size, loaded on first use (called with mMutex held)
+         * @return the store or NULL with errno set
+         */
+        Store* storeOf(int shift) {
+                if (shift<LARGE_MIN_SHIFT || shift>LARGE_MAX_SHIFT) {
+                        errno=EINVAL;
+                        return NULL;
+                }
+                Store*& store=mStores[shift-LARGE_MIN_SHIFT];
+                if (store)
+                        return store;
+                mkdirat(mRootFd,FAILSAFE_META_DIR,0700);
+                mkdirat(mRootFd,DEDUP_DIR,0700);
+                Store* loaded=new Store;
+                loaded->indexFd=openat(mRootFd,dedupIndexPath(shift).c_str(),O_RDWR|O_CREAT,0600);
+                loaded->extentFd=openat(mRootFd,dedupExtentsPath(shift).c_str(),O_RDWR|O_CREAT,0600);
+                struct stat stbuf;
+                if (loaded->indexFd<0 || loaded->extentFd<0 || fstat(loaded->indexFd,&stbuf)==-1) {
+                        const int err=errno;
+                        delete loaded;
+                        errno=err;
+                        return NULL;
+                }
+                const int64_t count=stbuf.st_size/sizeof(DedupRecord);
+                std::vector<DedupRecord> records(count);
+                if (count>0 && pread(loaded->indexFd,&records[0],count*sizeof(DedupRecord),0)!=static_cast<ssize_t>(count*sizeof(DedupRecord))) {
+                        delete loaded;
+                        errno=EIO;
+                        return NULL;
+                }
+                loaded->references.resize(count,0);
+                loaded->keys.resize(count,loaded->slots.end());
+                for (int64_t slot=0;slot<count;++slot) {
+                        const std::string key(records[slot].mKey,DEDUP_KEY_SIZE);
+                        if (records[slot].mReferences>0 && loaded->slots.find(key)==loaded->slots.end()) {
+                                loaded->references[slot]=records[slot].mReferences;
+                                loaded->keys[slot]=loaded->slots.insert(std::make_pair(key,slot)).first;
+                        } else {
+                                loaded->free.push_back(slot);
+                        }
+                }
+                store=loaded;
+                return store;
+        }
+
+        /// writes the record of a slot to the index (called with mMutex held)
+        static int save(Store& store,int64_t slot) {
+                DedupRecord record;
+                memset(&record,0,sizeof(record));
+                if (store.keys[slot]!=store.slots.end())
+                        memcpy(record.mKey,store.keys[slot]->first.data(),DEDUP_KEY_SIZE);
+                record.mReferences=store.references[slot];
+                if (pwrite(store.indexFd,&record,sizeof(record),slot*sizeof(record))!=static_cast<ssize_t>(sizeof(record)))
+                        return -(errno?errno:EIO);
+                return 0;
+        }
+
+        /// frees a slot and its space (called with mMutex held)
+        static void drop(Store& store,int64_t slot,int shift) {
+                if (store.keys[slot]!=store.slots.end())
+                        store.slots.erase(store.keys[slot]);
+                store.keys[slot]=store.slots.end();
+                store.references[slot]=0;
+                store.free.push_back(slot);
+                save(store,slot);
+                fallocate(store.extentFd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,slot<<shift,static_cast<off_t>(1)<<shift);
+        }
+
+        int mRootFd;
+        /// Protects the stores
+        pthread_mutex_t mMutex;
+        Store* mStores[DEDUP_STORES];
+        uint64_t mHits;
+        uint64_t mStored;
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_GEOMETRY_HEADER__
+#define __FAILSAFE_GEOMETRY_HEADER__
+
+#include "failsafe.h"
+#include <stdint.h>
+
+/*
+ *  Layout of a file of version 2.00
+ *
+ *  The blocks hold 2^shift bytes of data each (LARGE_MIN_SHIFT..LARGE_MAX_SHIFT)
+ *  and their headers are stored apart from the data. The file is a
+ *  sequence of groups of 1+2^(shift-8) slots of 2^shift bytes: the first
+ *  slot is the header region with the FAILSAFE_HEADER_SIZE byte headers of
+ *  the blocks of the group (the data member of FailSafeStoreStruct is not
+ *  stored), the other slots are their payloads. Every payload starts at a
+ *  multiple of the block size, the unwritten parts of the header region
+ *  and the end of a short payload stay holes of the backing file.
+ *
+ *  The hash of a block covers its header without mSignature and
+ *  mCurrentHash followed by the mSizeOfDataInCurrentBlock bytes of its
+ *  payload. The description follows the payload slot of the last block.
+ */
+
+/// Smallest block shift of version 2.00 (4 KiB)
+#define LARGE_MIN_SHIFT 12
+
+/// Largest block shift of version 2.00 (1 MiB)
+#define LARGE_MAX_SHIFT 20
+
+/// Unit of the payload transfers, also the alignment of the description
+#define LARGE_PAGE_SHIFT 12
+
+/*!
+ *  Position of the headers and payloads of the blocks of 2^Shift bytes,
+ *  resolved to shifts and masks at compile time
+ */
+template<int Shift>
+struct BlockGeometry {
+        /// Bytes of data of a block
+        static const int64_t PAYLOAD_SIZE=static_cast<int64_t>(1)<<Shift;
+        /// log2 of the blocks of a group, as many as headers fit into a slot
+        static const int GROUP_SHIFT=Shift-8;
+        static const int64_t GROUP_MASK=(static_cast<int64_t>(1)<<GROUP_SHIFT)-1;
+        /// Slots of a group: the header region and the payloads
+        static const int64_t GROUP_SLOTS=GROUP_MASK+2;
+
+        /// block containing a logical position
+        static int64_t blockOf(int64_t offset) {
+                return offset>>Shift;
+        }
+
+        /// position of a logical offset inside its block
+        static int64_t offsetInBlock(int64_t offset) {
+                return offset&(PAYLOAD_SIZE-1);
+        }
+
+        /// first byte of the group of a block in the backing file
+        static int64_t groupOffset(int64_t blockNr) {
+                return ((blockNr>>GROUP_SHIFT)*GROUP_SLOTS)<<Shift;
+        }
+
+        /// header of a block in the backing file
+        static int64_t headerOffset(int64_t blockNr) {
+                return groupOffset(blockNr)+((blockNr&GROUP_MASK)<<8);
+        }
+
+        /// payload of a block in the backing file
+        static int64_t dataOffset(int64_t blockNr) {
+                return groupOffset(blockNr)+(((blockNr&GROUP_MASK)+1)<<Shift);
+        }
+
+        /// description following the last block, a multiple of FAILSAFE_BLOCK_SIZE
+        static int64_t descOffset(int64_t lastBlockNr) {
+                return dataOffset(lastBlockNr)+PAYLOAD_SIZE;
+        }
+};
+
+template<int Shift> const int64_t BlockGeometry<Shift>::PAYLOAD_SIZE;
+template<int Shift> const int BlockGeometry<Shift>::GROUP_SHIFT;
+template<int Shift> const int64_t BlockGeometry<Shift>::GROUP_MASK;
+template<int Shift> const int64_t BlockGeometry<Shift>::GROUP_SLOTS;
+
+/*!
+ * checks the block size of a mount option
+ * @return log2 of the size or -1 if it is no power of two between 4 KiB and 1 MiB
+ */
+inline int largeBlockShiftOf(unsigned int size)
+{
+        for (int shift=LARGE_MIN_SHIFT;shift<=LARGE_MAX_SHIFT;++shift)
+                if (size==(1u<<shift))
+                        return shift;
+        return -1;
+}
+
+/*!
+ * header of a block in the backing file, for the callers off the hot
+ * paths which do not know the block size at compile time
+ * @param shift log2 of the block size
+ */
+inline int64_t largeHeaderPosition(int shift,int64_t blockNr)
+{
+        const int groupShift=shift-8;
+        const int64_t index=blockNr&((static_cast<int64_t>(1)<<groupShift)-1);
+        return (((blockNr>>groupShift)*((static_cast<int64_t>(1)<<groupShift)+1))<<shift)+(index<<8);
+}
+
+/// payload of a block in the backing file, see largeHeaderPosition
+inline int64_t largeDataPosition(int shift,int64_t blockNr)
+{
+        const int groupShift=shift-8;
+        const int64_t index=blockNr&((static_cast<int64_t>(1)<<groupShift)-1);
+        return (((blockNr>>groupShift)*((static_cast<int64_t>(1)<<groupShift)+1))<<shift)+((index+1)<<shift);
+}
+
+/// description following the last block, see largeHeaderPosition
+inline int64_t largeDescPosition(int shift,int64_t lastBlockNr)
+{
+        return largeDataPosition(shift,lastBlockNr)+(static_cast<int64_t>(1)<<shift);
+}
+
+/*!
+ * position of the payload belonging to a header found in the backing
+ * file, derived from the block counter, so the payload is located without
+ * knowing where the file starts
+ * @param header verified signature and version 2.00
+ * @param headerPosition position of the header in the backing file
+ * @return position of the payload or -1 if the header is not at a valid place
+ */
+inline int64_t largePayloadPosition(const FailSafeStoreStruct& header,int64_t headerPosition)
+{
+        const int shift=blockShiftOf(header);
+        if (shift<LARGE_MIN_SHIFT || shift>LARGE_MAX_SHIFT || header.mBlockCounter<0)
+                return -1;
+        const int64_t index=header.mBlockCounter&((static_cast<int64_t>(1)<<(shift-8))-1);
+        const int64_t group=headerPosition-(index<<8);
+        if (group<0)
+                return -1;
+        return group+((index+1)<<shift);
+}
+
+/// bytes of a payload transfer: the data rounded up to LARGE_PAGE_SHIFT
+inline int64_t largeStoredSize(int64_t datasize)
+{
+        const int64_t page=static_cast<int64_t>(1)<<LARGE_PAGE_SHIFT;
+        return (datasize+page-1)&~(page-1);
+}
+
+#endif
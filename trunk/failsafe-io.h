@@ -0,0 +1,585 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_IO_HEADER__
+#define __FAILSAFE_IO_HEADER__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <vector>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*!
+ *  One vectored transfer of a batch
+ */
+struct IORequest {
+        int fd;
+        bool write;
+        /// Buffers of the transfer, adjusted while short transfers are continued
+        struct iovec* iov;
+        int iovcnt;
+        off_t offset;
+        /// Bytes transferred or -errno
+        ssize_t result;
+};
+
+/*!
+ *  Block I/O engine
+ *
+ */
+class IOBackend
+{
+public:
+        virtual ~IOBackend() {
+        }
+
+        /*!
+         * runs a batch of independent transfers and waits for all of them,
+         * writes are completed fully, reads stop at the end of the file
+         * @param requests transfers, their result is set
+         * @param count number of transfers
+         */
+        virtual void run(IORequest* requests,size_t count)=0;
+
+        virtual const char* name() const=0;
+
+protected:
+        /*!
+         * finishes a transfer synchronously after its first done bytes
+         */
+        static void complete(IORequest& request,size_t done) {
+                struct iovec* iov=request.iov;
+                int iovcnt=request.iovcnt;
+                size_t skip=done;
+                while (iovcnt>0 && skip>=iov->iov_len) {
+                        skip-=iov->iov_len;
+                        ++iov;
+                        --iovcnt;
+                }
+                if (iovcnt>0) {
+                        iov->iov_base=static_cast<char*>(iov->iov_base)+skip;
+                        iov->iov_len-=skip;
+                }
+                while (iovcnt>0) {
+                        const off_t offset=request.offset+done;
+                        ssize_t res=request.write?pwritev(request.fd,iov,iovcnt,offset):preadv(request.fd,iov,iovcnt,offset);
+                        if (res==-1) {
+                                if (errno==EINTR)
+                                        continue;
+                                request.result=-errno;
+                                return;
+                        }
+                        if (res==0 && !request.write)
+                                break;
+                        done+=res;
+                        while (iovcnt>0 && static_cast<size_t>(res)>=iov->iov_len) {
+                                res-=iov->iov_len;
+                                ++iov;
+                                --iovcnt;
+                        }
+                        if (iovcnt>0) {
+                                iov->iov_base=static_cast<char*>(iov->iov_base)+res;
+                                iov->iov_len-=res;
+                        }
+                }
+                request.result=done;
+        }
+};
+
+/*!
+ *  preadv/pwritev on the calling thread, one transfer after the other
+ *
+ */
+class PosixIO : public IOBackend
+{
+public:
+        virtual void run(IORequest* requests,size_t count) {
+                for (size_t i=0;i<count;++i)
+                        complete(requests[i],0);
+        }
+
+        virtual const char* name() const {
+                return "posix";
+        }
+};
+
+/// Alignment of the buffers, offsets and lengths of transfers on O_DIRECT descriptors
+#define DIRECT_IO_ALIGNMENT 4096
+
+/// Places a buffer declared on the stack so that it is transferred without a bounce buffer
+#define DIRECT_IO_ALIGNED __attribute__((aligned(DIRECT_IO_ALIGNMENT)))
+
+/// Size classes of the pooled bounce buffers, DIRECT_IO_ALIGNMENT<<class bytes
+#define DIRECT_POOL_CLASSES 10
+
+/// Free bounce buffers kept per size class
+#define DIRECT_POOL_FREE 16
+
+/*!
+ *  Engine for descriptors opened with O_DIRECT, on top of another engine
+ *
+ *  Aligned transfers are passed to the other engine unchanged. The others
+ *  are staged in aligned bounce buffers of a pool: reads cover the aligned
+ *  range around them, writes of aligned ranges from unaligned memory are
+ *  copied. Writes of unaligned ranges read and merge their partial pages
+ *  first, they run after the rest of the batch and one after the other,
+ *  so two of them never merge the same page at the same time.
+ */
+class DirectIO : public IOBackend
+{
+public:
+        DirectIO() :
+                        mEngine(NULL), mPoolMutex(), mMergeMutex(), mFree() {
+                pthread_mutex_init(&mPoolMutex,NULL);
+                pthread_mutex_init(&mMergeMutex,NULL);
+        }
+
+        virtual ~DirectIO() {
+                for (int c=0;c<DIRECT_POOL_CLASSES;++c)
+                        for (size_t i=0;i<mFree[c].size();++i)
+                                free(mFree[c][i]);
+                pthread_mutex_destroy(&mMergeMutex);
+                pthread_mutex_destroy(&mPoolMutex);
+        }
+
+        /// the engine running the aligned transfers
+        void setEngine(IOBackend* engine) {
+                mEngine=engine;
+        }
+
+        IOBackend* engine() const {
+                return mEngine;
+        }
+
+        static bool aligned(uint64_t value) {
+                return (value&(DIRECT_IO_ALIGNMENT-1))==0;
+        }
+
+        virtual void run(IORequest* requests,size_t count) {
+                std::vector<IORequest> staged;
+                std::vector<struct iovec> bounces(count);
+                // index of the staged transfer of each request, -1 for a write merged afterwards
+                std::vector<ssize_t> stagedOf(count,-1);
+                staged.reserve(count);
+                for (size_t i=0;i<count;++i) {
+                        IORequest& request=requests[i];
+                        bounces[i].iov_base=NULL;
+                        bool alignedMemory=true;
+                        for (int k=0;k<request.iovcnt;++k)
+                                alignedMemory=alignedMemory && aligned(reinterpret_cast<uintptr_t>(request.iov[k].iov_base)) && aligned(request.iov[k].iov_len);
+                        const size_t size=length(request);
+                        const bool alignedRange=aligned(request.offset) && aligned(size);
+                        if (request.write && !alignedRange)
+                                continue;
+                        IORequest transfer=request;
+                        if (!alignedMemory || !alignedRange) {
+                                // the bounce buffer covers the pages of the range
+                                const off_t start=request.offset&~static_cast<off_t>(DIRECT_IO_ALIGNMENT-1);
+                                bounces[i].iov_len=(request.offset+size-start+DIRECT_IO_ALIGNMENT-1)&~static_cast<size_t>(DIRECT_IO_ALIGNMENT-1);
+                                bounces[i].iov_base=acquire(bounces[i].iov_len);
+                                if (bounces[i].iov_base==NULL) {
+                                        request.result=-ENOMEM;
+                                        continue;
+                                }
+                                if (request.write)
+                                        gather(request,static_cast<char*>(bounces[i].iov_base));
+                                transfer.iov=&bounces[i];
+                                transfer.iovcnt=1;
+                                transfer.offset=start;
+                        }
+                        stagedOf[i]=staged.size();
+                        staged.push_back(transfer);
+                }
+                if (!staged.empty())
+                        mEngine->run(&staged[0],staged.size());
+                for (size_t i=0;i<count;++i) {
+                        IORequest& request=requests[i];
+                        if (stagedOf[i]<0) {
+                                if (request.write && !(aligned(request.offset) && aligned(length(request))))
+                                        merge(request);
+                                continue;
+                        }
+                        const IORequest& done=staged[stagedOf[i]];
+                        if (bounces[i].iov_base==NULL) {
+                                request.result=done.result;
+                                continue;
+                        }
+                        if (done.result<0) {
+                                request.result=done.result;
+                        } else if (request.write) {
+                                request.result=length(request);
+                        } else {
+                                // the bytes read in front of the range do not count
+                                const ssize_t before=request.offset-done.offset;
+                                const ssize_t available=std::max(done.result-before,static_cast<ssize_t>(0));
+                                request.result=scatter(request,static_cast<char*>(bounces[i].iov_base)+before,available);
+                        }
+                        release(bounces[i].iov_base,bounces[i].iov_len);
+                }
+        }
+
+        virtual const char* name() const {
+                return mEngine->name();
+        }
+
+private:
+        DirectIO(const DirectIO&);
+        DirectIO& operator=(const DirectIO&);
+
+        static size_t length(const IORequest& request) {
+                size_t length=0;
+                for (int k=0;k<request.iovcnt;++k)
+                        length+=request.iov[k].iov_len;
+                return length;
+        }
+
+        /// copies the buffers of a write into its bounce buffer
+        static void gather(const IORequest& request,char* bounce) {
+                char* ptr=bounce+(request.offset&(DIRECT_IO_ALIGNMENT-1));
+                for (int k=0;k<request.iovcnt;++k) {
+                        memcpy(ptr,request.iov[k].iov_base,request.iov[k].iov_len);
+                        ptr+=request.iov[k].iov_len;
+                }
+        }
+
+        /// copies at most available bytes of a read to its buffers
+        static ssize_t scatter(const IORequest& request,const char* data,ssize_t available) {
+                ssize_t copied=0;
+                for (int k=0;k<request.iovcnt && copied<available;++k) {
+                        const size_t n=std::min(request.iov[k].iov_len,static_cast<size_t>(available-copied));
+                        memcpy(request.iov[k].iov_base,data+copied,n);
+                        copied+=n;
+                }
+                return copied;
+        }
+
+        /*!
+         * writes an unaligned range: its first and last page are read,
+         * the data is merged into them and the pages are written, a file
+         * ending inside the last page is cut back to its new end
+         */
+        void merge(IORequest& request) {
+                const size_t size=length(request);
+                const off_t start=request.offset&~static_cast<off_t>(DIRECT_IO_ALIGNMENT-1);
+                const size_t span=(request.offset+size-start+DIRECT_IO_ALIGNMENT-1)&~static_cast<size_t>(DIRECT_IO_ALIGNMENT-1);
+                char* bounce=static_cast<char*>(acquire(span));
+                if (bounce==NULL) {
+                        request.result=-ENOMEM;
+                        return;
+                }
+                pthread_mutex_lock(&mMergeMutex);
+                // pages beyond the end of the file are read as zeros
+                memset(bounce,0,span);
+                struct iovec edges[2]= {{bounce,DIRECT_IO_ALIGNMENT},{bounce+span-DIRECT_IO_ALIGNMENT,DIRECT_IO_ALIGNMENT}};
+                IORequest reads[2]= {{request.fd,false,&edges[0],1,start,0},{request.fd,false,&edges[1],1,static_cast<off_t>(start+span-DIRECT_IO_ALIGNMENT),0}};
+                complete(reads[0],0);
+                if (span>DIRECT_IO_ALIGNMENT)
+                        complete(reads[1],0);
+                if (reads[0].result<0 || reads[1].result<0) {
+                        request.result=reads[0].result<0?reads[0].result:reads[1].result;
+                } else {
+                        // the last page is read short when the file ends inside it
+                        const ssize_t tail=span>DIRECT_IO_ALIGNMENT?reads[1].result:reads[0].result;
+                        const off_t end=std::max(static_cast<off_t>(request.offset+size),static_cast<off_t>(start+span-DIRECT_IO_ALIGNMENT+tail));
+                        gather(request,bounce);
+                        struct iovec whole= {bounce,span};
+                        IORequest write= {request.fd,true,&whole,1,start,0};
+                        complete(write,0);
+                        if (write.result>=0 && end<static_cast<off_t>(start+span) && ftruncate(request.fd,end)==-1)
+                                write.result=-errno;
+                        request.result=write.result<0?write.result:static_cast<ssize_t>(size);
+                }
+                pthread_mutex_unlock(&mMergeMutex);
+                release(bounce,span);
+        }
+
+        static int classOf(size_t length) {
+                int c=0;
+                while (c<DIRECT_POOL_CLASSES && (static_cast<size_t>(DIRECT_IO_ALIGNMENT)<<c)<length)
+                        ++c;
+                return c;
+        }
+
+        /// aligned buffer of at least length bytes from the pool
+        void* acquire(size_t length) {
+                const int c=classOf(length);
+                if (c<DIRECT_POOL_CLASSES) {
+                        pthread_mutex_lock(&mPoolMutex);
+                        void* buffer=NULL;
+                        if (!mFree[c].empty()) {
+                                buffer=mFree[c].back();
+                                mFree[c].pop_back();
+                        }
+                        pthread_mutex_unlock(&mPoolMutex);
+                        if (buffer)
+                                return buffer;
+                        length=static_cast<size_t>(DIRECT_IO_ALIGNMENT)<<c;
+                }
+                void* memory=NULL;
+                if (posix_memalign(&memory,DIRECT_IO_ALIGNMENT,length)!=0)
+                        return NULL;
+                return memory;
+        }
+
+        void release(void* buffer,size_t length) {
+                const int c=classOf(length);
+                if (c<DIRECT_POOL_CLASSES) {
+                        pthread_mutex_lock(&mPoolMutex);
+                        const bool kept=mFree[c].size()<DIRECT_POOL_FREE;
+                        if (kept)
+                                mFree[c].push_back(buffer);
+                        pthread_mutex_unlock(&mPoolMutex);
+                        if (kept)
+                                return;
+                }
+                free(buffer);
+        }
+
+        IOBackend* mEngine;
+        /// Protects the free lists
+        pthread_mutex_t mPoolMutex;
+        /// Serializes the writes merged into partial pages
+        pthread_mutex_t mMergeMutex;
+        /// Free bounce buffers of each size class
+        std::vector<void*> mFree[DIRECT_POOL_CLASSES];
+};
+
+#ifdef HAVE_IO_URING
+
+/// Submission queue entries of each thread's ring
+#define IO_URING_ENTRIES 64
+
+/*!
+ *  io_uring with one ring per calling thread, the transfers of a batch are
+ *  submitted together and are in flight at the same time
+ *
+ */
+class UringIO : public IOBackend
+{
+public:
+        UringIO() :
+                        mKey() {
+                pthread_key_create(&mKey,destroyRing);
+        }
+
+        virtual ~UringIO() {
+                pthread_key_delete(mKey);
+        }
+
+        /*!
+         * checks that the kernel provides io_uring
+         */
+        bool available() {
+                return ring()!=NULL;
+        }
+
+        virtual void run(IORequest* requests,size_t count) {
+                Ring* r=ring();
+                if (r==NULL) {
+                        for (size_t i=0;i<count;++i)
+                                complete(requests[i],0);
+                        return;
+                }
+                for (size_t begin=0;begin<count;begin+=r->entries)
+                        runChunk(*r,requests+begin,std::min(count-begin,static_cast<size_t>(r->entries)));
+        }
+
+        virtual const char* name() const {
+                return "uring";
+        }
+
+private:
+        UringIO(const UringIO&);
+        UringIO& operator=(const UringIO&);
+
+        /// Result of a transfer that is still in flight
+        static const ssize_t UNFINISHED=-EINPROGRESS;
+
+        struct Ring {
+                Ring() :
+                                fd(-1), entries(0), sqMemory(NULL), sqLength(0), cqMemory(NULL), cqLength(0),
+                                sqes(NULL), sqesLength(0), sqTail(NULL), sqMask(NULL), sqArray(NULL),
+                                cqHead(NULL), cqTail(NULL), cqMask(NULL), cqes(NULL) {
+                }
+
+                ~Ring() {
+                        if (sqes)
+                                munmap(sqes,sqesLength);
+                        if (cqMemory && cqMemory!=sqMemory)
+                                munmap(cqMemory,cqLength);
+                        if (sqMemory)
+                                munmap(sqMemory,sqLength);
+                        if (fd>=0)
+                                close(fd);
+                }
+
+                int fd;
+                unsigned int entries;
+                void* sqMemory;
+                size_t sqLength;
+                void* cqMemory;
+                size_t cqLength;
+                struct io_uring_sqe* sqes;
+                size_t sqesLength;
+                unsigned int* sqTail;
+                unsigned int* sqMask;
+                unsigned int* sqArray;
+                unsigned int* cqHead;
+                unsigned int* cqTail;
+                unsigned int* cqMask;
+                struct io_uring_cqe* cqes;
+
+        private:
+                Ring(const Ring&);
+                Ring& operator=(const Ring&);
+        };
+
+        static void destroyRing(void* ring) {
+                delete static_cast<Ring*>(ring);
+        }
+
+        /// ring of the calling thread, NULL if io_uring is not available
+        Ring* ring() {
+                Ring* r=static_cast<Ring*>(pthread_getspecific(mKey));
+                if (r==NULL) {
+                        r=createRing();
+                        if (r)
+                                pthread_setspecific(mKey,r);
+                }
+                return r;
+        }
+
+        static Ring* createRing() {
+                struct io_uring_params params;
+                memset(&params,0,sizeof(params));
+                const int fd=syscall(__NR_io_uring_setup,IO_URING_ENTRIES,&params);
+                if (fd<0)
+                        return NULL;
+                Ring* r=new Ring;
+                r->fd=fd;
+                r->entries=params.sq_entries;
+                r->sqLength=params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+                r->cqLength=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+                const bool single=(params.features&IORING_FEAT_SINGLE_MMAP)!=0;
+                if (single && r->cqLength>r->sqLength)
+                        r->sqLength=r->cqLength;
+                r->sqMemory=mmap(NULL,r->sqLength,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+                if (r->sqMemory==MAP_FAILED) {
+                        r->sqMemory=NULL;
+                        delete r;
+                        return NULL;
+                }
+                if (single) {
+                        r->cqMemory=r->sqMemory;
+                } else {
+                        r->cqMemory=mmap(NULL,r->cqLength,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+                        if (r->cqMemory==MAP_FAILED) {
+                                r->cqMemory=NULL;
+                                delete r;
+                                return NULL;
+                        }
+                }
+                r->sqesLength=params.sq_entries*sizeof(struct io_uring_sqe);
+                void* sqes=mmap(NULL,r->sqesLength,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+                if (sqes==MAP_FAILED) {
+                        delete r;
+                        return NULL;
+                }
+                r->sqes=static_cast<struct io_uring_sqe*>(sqes);
+                char* sq=static_cast<char*>(r->sqMemory);
+                char* cq=static_cast<char*>(r->cqMemory);
+                r->sqTail=reinterpret_cast<unsigned int*>(sq+params.sq_off.tail);
+                r->sqMask=reinterpret_cast<unsigned int*>(sq+params.sq_off.ring_mask);
+                r->sqArray=reinterpret_cast<unsigned int*>(sq+params.sq_off.array);
+                r->cqHead=reinterpret_cast<unsigned int*>(cq+params.cq_off.head);
+                r->cqTail=reinterpret_cast<unsigned int*>(cq+params.cq_off.tail);
+                r->cqMask=reinterpret_cast<unsigned int*>(cq+params.cq_off.ring_mask);
+                r->cqes=reinterpret_cast<struct io_uring_cqe*>(cq+params.cq_off.cqes);
+                return r;
+        }
+
+        /// submits at most entries transfers and reaps their completions
+        static void runChunk(Ring& r,IORequest* requests,size_t count) {
+                // completions left behind by a failed batch belong to nobody
+                __atomic_store_n(r.cqHead,__atomic_load_n(r.cqTail,__ATOMIC_ACQUIRE),__ATOMIC_RELEASE);
+                unsigned int tail=*(r.sqTail);
+                for (size_t i=0;i<count;++i,++tail) {
+                        const unsigned int index=tail&*(r.sqMask);
+                        struct io_uring_sqe& sqe=r.sqes[index];
+                        memset(&sqe,0,sizeof(sqe));
+                        sqe.opcode=requests[i].write?IORING_OP_WRITEV:IORING_OP_READV;
+                        sqe.fd=requests[i].fd;
+                        sqe.addr=reinterpret_cast<uint64_t>(requests[i].iov);
+                        sqe.len=requests[i].iovcnt;
+                        sqe.off=requests[i].offset;
+                        sqe.user_data=i;
+                        r.sqArray[index]=index;
+                        requests[i].result=UNFINISHED;
+                }
+                __atomic_store_n(r.sqTail,tail,__ATOMIC_RELEASE);
+
+                size_t submitted=0;
+                size_t reaped=0;
+                while (reaped<count) {
+                        const unsigned int toSubmit=count-submitted;
+                        int res=syscall(__NR_io_uring_enter,r.fd,toSubmit,1,IORING_ENTER_GETEVENTS,NULL,0);
+                        if (res<0) {
+                                if (errno==EINTR || errno==EAGAIN || errno==EBUSY)
+                                        continue;
+                                // the ring is unusable: what did not complete is done synchronously
+                                for (size_t i=0;i<count;++i)
+                                        if (requests[i].result==UNFINISHED)
+                                                complete(requests[i],0);
+                                return;
+                        }
+                        submitted+=res;
+                        unsigned int head=*(r.cqHead);
+                        const unsigned int cqTail=__atomic_load_n(r.cqTail,__ATOMIC_ACQUIRE);
+                        for (;head!=cqTail;++head,++reaped) {
+                                const struct io_uring_cqe& cqe=r.cqes[head&*(r.cqMask)];
+                                IORequest& request=requests[cqe.user_data];
+                                if (cqe.user_data>=count || request.result!=UNFINISHED)
+                                        continue;
+                                if (cqe.res<0)
+                                        request.result=cqe.res;
+                                else
+                                        finish(request,cqe.res);
+                        }
+                        __atomic_store_n(r.cqHead,head,__ATOMIC_RELEASE);
+                }
+        }
+
+        /// short transfers are continued synchronously
+        static void finish(IORequest& request,size_t done) {
+                size_t length=0;
+                for (int i=0;i<request.iovcnt;++i)
+                        length+=request.iov[i].iov_len;
+                if (done<length && (done>0 || request.write))
+                        complete(request,done);
+                else
+                        request.result=done;
+        }
+
+        pthread_key_t mKey;
+};
+
+#endif
+
+#endif
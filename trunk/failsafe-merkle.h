@@ -0,0 +1,245 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_MERKLE_HEADER__
+#define __FAILSAFE_MERKLE_HEADER__
+
+#include "failsafe.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Directory of the file system's own data in the root of the backing tree
+#define FAILSAFE_META_DIR ".failsafefs"
+
+/// Directory of the Merkle trees, one file per backing inode
+#define MERKLE_DIR FAILSAFE_META_DIR "/merkle"
+
+/*!
+ * path of the Merkle tree of a backing file relative to the backing root
+ */
+inline std::string merklePath(dev_t dev,ino_t ino)
+{
+        std::ostringstream path;
+        path<<MERKLE_DIR<<"/"<<std::hex<<static_cast<uint64_t>(dev)<<"-"<<static_cast<uint64_t>(ino);
+        return path.str();
+}
+
+/*!
+ * depth of the tree of a number of leaves (the root of one leaf is the leaf)
+ */
+inline int merkleDepth(int64_t leaves)
+{
+        int depth=0;
+        while ((static_cast<int64_t>(1)<<depth)<leaves)
+                ++depth;
+        return depth;
+}
+
+/*!
+ *  Merkle tree over the block hashes of a file, stored in a separate file
+ *
+ *  Leaf i is the first MERKLE_HASH_SIZE bytes of mCurrentHash of block i,
+ *  a parent is the hash of its two children. Subtrees beyond the last leaf
+ *  are zero and are never read. The nodes are stored in in-order layout,
+ *  node (depth,position) at index ((2*position+1)<<depth)-1, so nodes keep
+ *  their place while the file grows.
+ */
+class MerkleTree
+{
+public:
+        /*!
+         * @param fd file of the tree
+         * @param algorithm HashAlgorithm of the file
+         */
+        MerkleTree(int fd,int algorithm) :
+                        mFd(fd), mAlgorithm(algorithm) {
+        }
+
+        /*!
+         * stores leaves and recalculates their ancestors up to the root,
+         * O(log n) nodes per leaf
+         * @param updates block numbers in ascending order with their leaf hash
+         * @param leaves number of leaves of the tree
+         * @param root receives the root (MERKLE_HASH_SIZE bytes)
+         * @return 0 or -errno
+         */
+        int update(const std::vector<std::pair<int64_t,const char*> >& updates,int64_t leaves,char* root) const {
+                std::vector<int64_t> positions;
+                for (size_t i=0;i<updates.size();++i) {
+                        if (updates[i].first>=leaves)
+                                continue;
+                        int res=writeNode(0,updates[i].first,updates[i].second);
+                        if (res<0)
+                                return res;
+                        positions.push_back(updates[i].first);
+                }
+                const int depth=merkleDepth(leaves);
+                for (int d=0;d<depth;++d) {
+                        std::vector<int64_t> parents;
+                        for (size_t i=0;i<positions.size();++i)
+                                if (parents.empty() || parents.back()!=positions[i]/2)
+                                        parents.push_back(positions[i]/2);
+                        for (size_t i=0;i<parents.size();++i) {
+                                char left[MERKLE_HASH_SIZE];
+                                char right[MERKLE_HASH_SIZE];
+                                char parent[MERKLE_HASH_SIZE];
+                                int res=readNode(d,2*parents[i],leaves,left);
+                                if (res==0)
+                                        res=readNode(d,2*parents[i]+1,leaves,right);
+                                if (res<0)
+                                        return res;
+                                merkleParent(mAlgorithm,left,right,parent);
+                                res=writeNode(d+1,parents[i],parent);
+                                if (res<0)
+                                        return res;
+                        }
+                        positions.swap(parents);
+                }
+                return readRoot(leaves,root);
+        }
+
+        /*!
+         * reads the root of the stored tree
+         * @return 0 or -errno
+         */
+        int readRoot(int64_t leaves,char* root) const {
+                if (leaves==0) {
+                        memset(root,0,MERKLE_HASH_SIZE);
+                        return 0;
+                }
+                return readNode(merkleDepth(leaves),0,leaves,root);
+        }
+
+        /*!
+         * proves a single block against a root with the log n sibling nodes
+         * on the way up, without reading other blocks
+         * @param blockNr number of the block
+         * @param leaf leaf hash of the block
+         * @param leaves number of leaves of the tree
+         * @param root expected root, recorded in the description
+         * @return 0, -EIO if the proof fails or -errno
+         */
+        int prove(int64_t blockNr,const char* leaf,int64_t leaves,const char* root) const {
+                if (blockNr<0 || blockNr>=leaves)
+                        return -EIO;
+                char node[MERKLE_HASH_SIZE];
+                memcpy(node,leaf,MERKLE_HASH_SIZE);
+                const int depth=merkleDepth(leaves);
+                int64_t position=blockNr;
+                for (int d=0;d<depth;++d,position/=2) {
+                        char sibling[MERKLE_HASH_SIZE];
+                        int res=readNode(d,position^1,leaves,sibling);
+                        if (res<0)
+                                return res;
+                        if (position%2==0)
+                                merkleParent(mAlgorithm,node,sibling,node);
+                        else
+                                merkleParent(mAlgorithm,sibling,node,node);
+                }
+                return memcmp(node,root,MERKLE_HASH_SIZE)==0?0:-EIO;
+        }
+
+private:
+        static off_t offsetOf(int depth,int64_t position) {
+                return static_cast<off_t>(((2*position+1)<<depth)-1)*MERKLE_HASH_SIZE;
+        }
+
+        int readNode(int depth,int64_t position,int64_t leaves,char* node) const {
+                if ((position<<depth)>=leaves) {
+                        memset(node,0,MERKLE_HASH_SIZE);
+                        return 0;
+                }
+                ssize_t res=pread(mFd,node,MERKLE_HASH_SIZE,offsetOf(depth,position));
+                if (res<0)
+                        return -errno;
+                // a node inside the tree that was never written
+                if (res!=MERKLE_HASH_SIZE)
+                        return -EIO;
+                return 0;
+        }
+
+        int writeNode(int depth,int64_t position,const char* node) const {
+                if (pwrite(mFd,node,MERKLE_HASH_SIZE,offsetOf(depth,position))!=MERKLE_HASH_SIZE)
+                        return errno?-errno:-EIO;
+                return 0;
+        }
+
+        int mFd;
+        int mAlgorithm;
+};
+
+/*!
+ *  Root of a Merkle tree calculated from its leaves in block order,
+ *  without storing the tree
+ */
+class MerkleBuilder
+{
+public:
+        MerkleBuilder(int algorithm) :
+                        mAlgorithm(algorithm), mLeaves(0), mStack() {
+        }
+
+        /// adds the next leaf
+        void add(const char* leaf) {
+                Node node;
+                node.depth=0;
+                memcpy(node.hash,leaf,MERKLE_HASH_SIZE);
+                ++mLeaves;
+                // complete subtrees of the same depth are merged
+                while (!mStack.empty() && mStack.back().depth==node.depth) {
+                        merkleParent(mAlgorithm,mStack.back().hash,node.hash,node.hash);
+                        ++node.depth;
+                        mStack.pop_back();
+                }
+                mStack.push_back(node);
+        }
+
+        /// root of the leaves added so far
+        void root(char* result) const {
+                if (mStack.empty()) {
+                        memset(result,0,MERKLE_HASH_SIZE);
+                        return;
+                }
+                const int depth=merkleDepth(mLeaves);
+                // the partial subtrees are closed with empty right siblings
+                std::vector<Node> stack(mStack);
+                Node node=stack.back();
+                stack.pop_back();
+                static const char empty[MERKLE_HASH_SIZE]= {0};
+                while (node.depth<depth) {
+                        if (!stack.empty() && stack.back().depth==node.depth) {
+                                merkleParent(mAlgorithm,stack.back().hash,node.hash,node.hash);
+                                stack.pop_back();
+                        } else {
+                                merkleParent(mAlgorithm,node.hash,empty,node.hash);
+                        }
+                        ++node.depth;
+                }
+                memcpy(result,node.hash,MERKLE_HASH_SIZE);
+        }
+
+private:
+        struct Node {
+                int depth;
+                char hash[MERKLE_HASH_SIZE];
+        };
+
+        int mAlgorithm;
+        int64_t mLeaves;
+        /// Roots of the complete subtrees, deepest first
+        std::vector<Node> mStack;
+};
+
+#endif
@@ -0,0 +1,236 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_POOL_HEADER__
+#define __FAILSAFE_POOL_HEADER__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+
+/*!
+ *  Completion counter of a group of tasks, the owner waits for all of them
+ *
+ */
+class TaskGroup
+{
+public:
+        TaskGroup() :
+                        mMutex(), mCondition(), mPending(0) {
+                pthread_mutex_init(&mMutex,NULL);
+                pthread_cond_init(&mCondition,NULL);
+        }
+
+        ~TaskGroup() {
+                pthread_cond_destroy(&mCondition);
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        void add() {
+                pthread_mutex_lock(&mMutex);
+                ++mPending;
+                pthread_mutex_unlock(&mMutex);
+        }
+
+        void done() {
+                pthread_mutex_lock(&mMutex);
+                if (--mPending==0)
+                        pthread_cond_broadcast(&mCondition);
+                pthread_mutex_unlock(&mMutex);
+        }
+
+        void wait() {
+                pthread_mutex_lock(&mMutex);
+                while (mPending>0)
+                        pthread_cond_wait(&mCondition,&mMutex);
+                pthread_mutex_unlock(&mMutex);
+        }
+
+private:
+        TaskGroup(const TaskGroup&);
+        TaskGroup& operator=(const TaskGroup&);
+
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCondition;
+        int mPending;
+};
+
+/*!
+ *  Fixed size pool of worker threads executing queued tasks
+ *
+ *  Without started threads every task runs inline on the caller's thread,
+ *  so does a child forked after start, the threads stay in the parent.
+ */
+class WorkerPool
+{
+public:
+        /// Queued unit of work
+        typedef void (*Task)(void* argument);
+        /// Unit of work processing the items [begin,end) of a range
+        typedef void (*RangeTask)(void* context,size_t begin,size_t end);
+
+        WorkerPool() :
+                        mMutex(), mCondition(), mQueue(), mThreads(), mOwner(0), mStopping(false) {
+                pthread_mutex_init(&mMutex,NULL);
+                pthread_cond_init(&mCondition,NULL);
+        }
+
+        ~WorkerPool() {
+                stop();
+                // the condition of a forked child still counts the waiters of the parent
+                if (mOwner!=0 && getpid()!=mOwner)
+                        return;
+                pthread_cond_destroy(&mCondition);
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        /*!
+         * starts the worker threads
+         * @param threads number of threads, 0 keeps the pool inline
+         */
+        void start(unsigned int threads) {
+                pthread_mutex_lock(&mMutex);
+                mStopping=false;
+                pthread_mutex_unlock(&mMutex);
+                mOwner=getpid();
+                for (unsigned int i=0;i<threads;++i) {
+                        pthread_t thread;
+                        if (pthread_create(&thread,NULL,run,this)!=0)
+                                break;
+                        mThreads.push_back(thread);
+                }
+        }
+
+        /*!
+         * finishes the queued tasks and joins the worker threads
+         */
+        void stop() {
+                if (threads()==0) {
+                        mThreads.clear();
+                        return;
+                }
+                pthread_mutex_lock(&mMutex);
+                mStopping=true;
+                pthread_cond_broadcast(&mCondition);
+                pthread_mutex_unlock(&mMutex);
+                for (size_t i=0;i<mThreads.size();++i)
+                        pthread_join(mThreads[i],NULL);
+                mThreads.clear();
+        }
+
+        /// worker threads running for the calling process
+        unsigned int threads() const {
+                if (mThreads.empty() || getpid()!=mOwner)
+                        return 0;
+                return mThreads.size();
+        }
+
+        /*!
+         * queues a task for a worker thread
+         * @param task function to call
+         * @param argument passed to the task
+         */
+        void submit(Task task,void* argument) {
+                if (threads()==0) {
+                        task(argument);
+                        return;
+                }
+                QueueItem item= {task,argument};
+                pthread_mutex_lock(&mMutex);
+                mQueue.push_back(item);
+                pthread_cond_signal(&mCondition);
+                pthread_mutex_unlock(&mMutex);
+        }
+
+        /*!
+         * splits [0,count) into chunks of at least grain items, runs them
+         * on the workers and on the calling thread, and waits for all
+         * @param count number of items
+         * @param grain minimal number of items in a chunk
+         * @param task called for each chunk
+         * @param context passed to the task
+         */
+        void parallelFor(size_t count,size_t grain,RangeTask task,void* context) {
+                size_t chunks=grain>0?count/grain:count;
+                const size_t workers=threads();
+                if (chunks>workers+1)
+                        chunks=workers+1;
+                if (chunks<=1) {
+                        task(context,0,count);
+                        return;
+                }
+                TaskGroup group;
+                std::vector<RangeItem> items(chunks);
+                for (size_t i=0;i<chunks;++i) {
+                        items[i].task=task;
+                        items[i].context=context;
+                        items[i].begin=count*i/chunks;
+                        items[i].end=count*(i+1)/chunks;
+                        items[i].group=&group;
+                }
+                for (size_t i=1;i<chunks;++i) {
+                        group.add();
+                        submit(runRange,&items[i]);
+                }
+                task(context,items[0].begin,items[0].end);
+                group.wait();
+        }
+
+private:
+        WorkerPool(const WorkerPool&);
+        WorkerPool& operator=(const WorkerPool&);
+
+        struct QueueItem {
+                Task task;
+                void* argument;
+        };
+
+        struct RangeItem {
+                RangeTask task;
+                void* context;
+                size_t begin;
+                size_t end;
+                TaskGroup* group;
+        };
+
+        static void runRange(void* argument) {
+                RangeItem* item=static_cast<RangeItem*>(argument);
+                item->task(item->context,item->begin,item->end);
+                item->group->done();
+        }
+
+        static void* run(void* argument) {
+                WorkerPool* pool=static_cast<WorkerPool*>(argument);
+                pthread_mutex_lock(&(pool->mMutex));
+                for (;;) {
+                        while (pool->mQueue.empty() && !pool->mStopping)
+                                pthread_cond_wait(&(pool->mCondition),&(pool->mMutex));
+                        if (pool->mQueue.empty())
+                                break;
+                        QueueItem item=pool->mQueue.front();
+                        pool->mQueue.pop_front();
+                        pthread_mutex_unlock(&(pool->mMutex));
+                        item.task(item.argument);
+                        pthread_mutex_lock(&(pool->mMutex));
+                }
+                pthread_mutex_unlock(&(pool->mMutex));
+                return NULL;
+        }
+
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCondition;
+        std::deque<QueueItem> mQueue;
+        std::vector<pthread_t> mThreads;
+        /// Process which started the threads
+        pid_t mOwner;
+        bool mStopping;
+};
+
+#endif
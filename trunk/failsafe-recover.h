@@ -0,0 +1,386 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_RECOVER_HEADER__
+#define __FAILSAFE_RECOVER_HEADER__
+
+#include "failsafe.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <vector>
+
+/// Bytes of a hash used by the index, the longest hash algorithm needs 32
+#define INDEX_HASH_SIZE 32
+
+/// Buffer of a run file while the runs are merged
+#define INDEX_RUN_BUFFER (64<<10)
+
+/*!
+ *  Valid data block found on the device
+ */
+struct IndexEntry {
+        char random[32];
+        int64_t blockCounter;
+        int64_t revision;
+        char currentHash[INDEX_HASH_SIZE];
+        char lastHash[INDEX_HASH_SIZE];
+        /// Offset of the block on the device
+        int64_t offset;
+
+        /// orders by file, block number, revision and hash
+        bool operator<(const IndexEntry& other) const {
+                int res=memcmp(random,other.random,sizeof(random));
+                if (res!=0)
+                        return res<0;
+                if (blockCounter!=other.blockCounter)
+                        return blockCounter<other.blockCounter;
+                if (revision!=other.revision)
+                        return revision<other.revision;
+                return memcmp(currentHash,other.currentHash,INDEX_HASH_SIZE)<0;
+        }
+} __attribute__((__packed__)) ;
+
+/*!
+ * index entry of a verified data block
+ * @param block data block
+ * @param offset offset of the block on the device
+ */
+inline IndexEntry indexEntryOf(const FailSafeStoreStruct& block,int64_t offset)
+{
+        IndexEntry entry;
+        memcpy(entry.random,block.mRandomNumber,sizeof(entry.random));
+        entry.blockCounter=block.mBlockCounter;
+        entry.revision=block.mRevision;
+        memcpy(entry.currentHash,block.mCurrentHash,INDEX_HASH_SIZE);
+        memcpy(entry.lastHash,block.mLastHash,INDEX_HASH_SIZE);
+        entry.offset=offset;
+        return entry;
+}
+
+/*!
+ *  Sorted index of the data blocks of a device with a fixed memory budget
+ *
+ *  Entries are collected in memory, a full buffer is sorted and written to
+ *  an unlinked temporary file (run). finish() merges the runs into one
+ *  sorted file which is searched with pread, an index that fits into the
+ *  memory is searched in place.
+ */
+class BlockIndex
+{
+public:
+        /*!
+         * @param directory place of the temporary files
+         * @param memory bytes of entries kept in memory
+         */
+        BlockIndex(const std::string& directory,size_t memory) :
+                        mDirectory(directory), mEntries(), mCapacity(std::max(memory/sizeof(IndexEntry),static_cast<size_t>(1))),
+                        mRuns(), mSpilled(0), mFd(-1), mSize(0) {
+        }
+
+        ~BlockIndex() {
+                for (size_t i=0;i<mRuns.size();++i)
+                        close(mRuns[i]);
+                if (mFd>=0)
+                        close(mFd);
+        }
+
+        /*!
+         * adds an entry, spills the buffer when it is full
+         * @return 0 or -errno
+         */
+        int add(const IndexEntry& entry) {
+                if (mEntries.capacity()==0)
+                        mEntries.reserve(mCapacity);
+                mEntries.push_back(entry);
+                if (mEntries.size()<mCapacity)
+                        return 0;
+                return spill();
+        }
+
+        /*!
+         * prepares the index for lookups, no entry can be added later
+         * @return 0 or -errno
+         */
+        int finish() {
+                std::sort(mEntries.begin(),mEntries.end());
+                if (mRuns.empty()) {
+                        mSize=mEntries.size();
+                        return 0;
+                }
+                int res=spill();
+                if (res<0)
+                        return res;
+                std::vector<IndexEntry>().swap(mEntries);
+                return merge();
+        }
+
+        /// Number of entries
+        int64_t size() const {
+                return mSize;
+        }
+
+        /// Number of runs written to disk
+        size_t spilled() const {
+                return mSpilled;
+        }
+
+        /*!
+         * finds a block of a file by its hash
+         * @param random random number of the file
+         * @param blockCounter block number
+         * @param hash mCurrentHash of the block
+         * @param result found entry
+         * @return 0, -ENOENT or -errno
+         */
+        int find(const char* random,int64_t blockCounter,const char* hash,IndexEntry& result) const {
+                int64_t low;
+                int res=lowerBound(random,blockCounter,low);
+                if (res<0)
+                        return res;
+                for (;low<mSize;++low) {
+                        int res=entryAt(low,result);
+                        if (res<0)
+                                return res;
+                        if (memcmp(result.random,random,sizeof(result.random))!=0 || result.blockCounter!=blockCounter)
+                                break;
+                        if (memcmp(result.currentHash,hash,INDEX_HASH_SIZE)==0)
+                                return 0;
+                }
+                return -ENOENT;
+        }
+
+        /*!
+         * finds the newest revision of a block up to a revision
+         * @param random random number of the file
+         * @param blockCounter block number
+         * @param maxRevision newest revision accepted
+         * @param result found entry
+         * @return 0, -ENOENT or -errno
+         */
+        int findNewest(const char* random,int64_t blockCounter,int64_t maxRevision,IndexEntry& result) const {
+                int64_t low;
+                int res=lowerBound(random,blockCounter,low);
+                if (res<0)
+                        return res;
+                res=-ENOENT;
+                for (;low<mSize;++low) {
+                        IndexEntry entry;
+                        int err=entryAt(low,entry);
+                        if (err<0)
+                                return err;
+                        if (memcmp(entry.random,random,sizeof(entry.random))!=0 || entry.blockCounter!=blockCounter ||
+                            entry.revision>maxRevision)
+                                break;
+                        result=entry;
+                        res=0;
+                }
+                return res;
+        }
+
+private:
+        BlockIndex(const BlockIndex&);
+        BlockIndex& operator=(const BlockIndex&);
+
+        /*!
+         *  Buffered sequential reader of a run
+         */
+        struct RunReader {
+                RunReader() :
+                                fd(-1), offset(0), buffer(), position(0), filled(0) {
+                }
+
+                /// reads the next entry, returns 1, 0 at the end of the run or -errno
+                int next(IndexEntry& entry) {
+                        if (position==filled) {
+                                buffer.resize(INDEX_RUN_BUFFER/sizeof(IndexEntry));
+                                ssize_t res=pread(fd,&buffer[0],buffer.size()*sizeof(IndexEntry),offset);
+                                if (res<0)
+                                        return -errno;
+                                offset+=res;
+                                filled=res/sizeof(IndexEntry);
+                                position=0;
+                                if (filled==0)
+                                        return 0;
+                        }
+                        entry=buffer[position++];
+                        return 1;
+                }
+
+                int fd;
+                off_t offset;
+                std::vector<IndexEntry> buffer;
+                size_t position;
+                size_t filled;
+        };
+
+        /// merge queue item, the smallest entry is on the top
+        struct MergeItem {
+                IndexEntry entry;
+                size_t run;
+
+                bool operator<(const MergeItem& other) const {
+                        return other.entry<entry;
+                }
+        };
+
+        /// anonymous temporary file
+        int createTemporary() const {
+                std::string name=mDirectory+"/.failsafe-index-XXXXXX";
+                std::vector<char> buffer(name.begin(),name.end());
+                buffer.push_back('\0');
+                int fd=mkstemp(&buffer[0]);
+                if (fd<0)
+                        return -errno;
+                unlink(&buffer[0]);
+                return fd;
+        }
+
+        static int writeAll(int fd,const void* data,size_t size,off_t offset) {
+                const char* ptr=static_cast<const char*>(data);
+                while (size>0) {
+                        ssize_t res=pwrite(fd,ptr,size,offset);
+                        if (res<0) {
+                                if (errno==EINTR)
+                                        continue;
+                                return -errno;
+                        }
+                        ptr+=res;
+                        size-=res;
+                        offset+=res;
+                }
+                return 0;
+        }
+
+        /// writes the sorted buffer as a new run
+        int spill() {
+                if (mEntries.empty())
+                        return 0;
+                std::sort(mEntries.begin(),mEntries.end());
+                int fd=createTemporary();
+                if (fd<0)
+                        return fd;
+                int res=writeAll(fd,&mEntries[0],mEntries.size()*sizeof(IndexEntry),0);
+                if (res<0) {
+                        close(fd);
+                        return res;
+                }
+                mRuns.push_back(fd);
+                ++mSpilled;
+                mEntries.clear();
+                return 0;
+        }
+
+        /// merges the runs into the index file
+        int merge() {
+                int fd=createTemporary();
+                if (fd<0)
+                        return fd;
+                std::vector<RunReader> readers(mRuns.size());
+                std::priority_queue<MergeItem> queue;
+                for (size_t i=0;i<mRuns.size();++i) {
+                        readers[i].fd=mRuns[i];
+                        MergeItem item;
+                        item.run=i;
+                        int res=readers[i].next(item.entry);
+                        if (res<0) {
+                                close(fd);
+                                return res;
+                        }
+                        if (res>0)
+                                queue.push(item);
+                }
+                std::vector<IndexEntry> output;
+                output.reserve(INDEX_RUN_BUFFER/sizeof(IndexEntry));
+                off_t offset=0;
+                int res=0;
+                while (!queue.empty() && res>=0) {
+                        MergeItem item=queue.top();
+                        queue.pop();
+                        output.push_back(item.entry);
+                        if (output.size()==output.capacity()) {
+                                res=writeAll(fd,&output[0],output.size()*sizeof(IndexEntry),offset);
+                                offset+=output.size()*sizeof(IndexEntry);
+                                output.clear();
+                        }
+                        if (res>=0)
+                                res=readers[item.run].next(item.entry);
+                        if (res>0)
+                                queue.push(item);
+                }
+                if (res>=0 && !output.empty()) {
+                        res=writeAll(fd,&output[0],output.size()*sizeof(IndexEntry),offset);
+                        offset+=output.size()*sizeof(IndexEntry);
+                }
+                if (res<0) {
+                        close(fd);
+                        return res;
+                }
+                for (size_t i=0;i<mRuns.size();++i)
+                        close(mRuns[i]);
+                mRuns.clear();
+                mFd=fd;
+                mSize=offset/sizeof(IndexEntry);
+                return 0;
+        }
+
+        /// position of the first entry of a block, the revisions of it follow
+        int lowerBound(const char* random,int64_t blockCounter,int64_t& low) const {
+                IndexEntry key;
+                memset(&key,0,sizeof(key));
+                memcpy(key.random,random,sizeof(key.random));
+                key.blockCounter=blockCounter;
+                key.revision=INT64_MIN;
+
+                low=0;
+                int64_t high=mSize;
+                while (low<high) {
+                        const int64_t middle=low+(high-low)/2;
+                        IndexEntry entry;
+                        int res=entryAt(middle,entry);
+                        if (res<0)
+                                return res;
+                        if (entry<key)
+                                low=middle+1;
+                        else
+                                high=middle;
+                }
+                return 0;
+        }
+
+        int entryAt(int64_t index,IndexEntry& entry) const {
+                if (mFd<0) {
+                        entry=mEntries[index];
+                        return 0;
+                }
+                ssize_t res=pread(mFd,&entry,sizeof(entry),index*sizeof(IndexEntry));
+                if (res<0)
+                        return -errno;
+                if (res!=sizeof(entry))
+                        return -EIO;
+                return 0;
+        }
+
+        std::string mDirectory;
+        /// Buffer of the next run, or the whole index if nothing was spilled
+        std::vector<IndexEntry> mEntries;
+        size_t mCapacity;
+        /// Spilled runs waiting for the merge
+        std::vector<int> mRuns;
+        size_t mSpilled;
+        /// Merged index file, -1 while the index is in memory
+        int mFd;
+        int64_t mSize;
+};
+
+#endif
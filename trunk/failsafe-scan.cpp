@@ -5,6 +5,20 @@
 #endif
 
 #include "failsafe.h"
+#include "failsafe-compress.h"
+#include "failsafe-geometry.h"
+#include "failsafe-merkle.h"
+#include "failsafe-pool.h"
+#include "failsafe-recover.h"
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 /*#include <fuse.h>
 #include <assert.h>
@@ -23,38 +37,565 @@
 #endif
 */
 
+/// Bytes of the device scanned by one task
+#define SCAN_SEGMENT_SIZE (static_cast<int64_t>(64)<<20)
 
-int main(int argc,char*argv[])
+/// Bytes requested by one read of a task
+#define SCAN_READ_SIZE (4<<20)
+
+/// Default memory of the block index in extraction mode (MiB)
+#define SCAN_INDEX_MEMORY 256
+
+/// Length of the block signatures, they share the first four bytes
+#define SIGNATURE_LENGTH 8
+
+/*!
+ * checks for one of the block signatures
+ */
+inline bool isSignature(const char* ptr)
+{
+        return memcmp(ptr,FSSignature,SIGNATURE_LENGTH)==0 || memcmp(ptr,FSDescSignature,SIGNATURE_LENGTH)==0;
+}
+
+/*!
+ * finds the next block signature with memchr
+ * @param ptr start of the search
+ * @param end signatures starting before end are found, the bytes after it
+ *        are readable
+ * @return the signature or NULL
+ */
+inline const char* findSignatureScalar(const char* ptr,const char* end)
+{
+        while (ptr<end) {
+                ptr=static_cast<const char*>(memchr(ptr,FSSignature[0],end-ptr));
+                if (ptr==NULL)
+                        return NULL;
+                if (isSignature(ptr))
+                        return ptr;
+                ++ptr;
+        }
+        return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/*!
+ * finds the next block signature 16 positions at a time: candidates have
+ * the first and the fourth byte of "FAIL" at the right distance
+ */
+inline const char* findSignatureSSE2(const char* ptr,const char* end)
+{
+        const __m128i first=_mm_set1_epi8(FSSignature[0]);
+        const __m128i fourth=_mm_set1_epi8(FSSignature[3]);
+        for (;ptr+16<=end;ptr+=16) {
+                const __m128i a=_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+                const __m128i b=_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr+3));
+                unsigned int mask=_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,first),_mm_cmpeq_epi8(b,fourth)));
+                for (;mask!=0;mask&=mask-1) {
+                        const char* candidate=ptr+__builtin_ctz(mask);
+                        if (isSignature(candidate))
+                                return candidate;
+                }
+        }
+        return findSignatureScalar(ptr,end);
+}
+
+/*!
+ * finds the next block signature 32 positions at a time
+ */
+__attribute__((target("avx2")))
+inline const char* findSignatureAVX2(const char* ptr,const char* end)
+{
+        const __m256i first=_mm256_set1_epi8(FSSignature[0]);
+        const __m256i fourth=_mm256_set1_epi8(FSSignature[3]);
+        for (;ptr+32<=end;ptr+=32) {
+                const __m256i a=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+                const __m256i b=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr+3));
+                unsigned int mask=_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a,first),_mm256_cmpeq_epi8(b,fourth)));
+                for (;mask!=0;mask&=mask-1) {
+                        const char* candidate=ptr+__builtin_ctz(mask);
+                        if (isSignature(candidate))
+                                return candidate;
+                }
+        }
+        return findSignatureScalar(ptr,end);
+}
+#endif
+
+/*!
+ * finds the next "FAILSAFE" or "FAILDESC" signature, using the widest
+ * vector instructions of the CPU
+ * @param ptr start of the search
+ * @param end signatures starting before end are found, at least
+ *        SIGNATURE_LENGTH bytes after it are readable
+ * @return the signature or NULL
+ */
+inline const char* findSignature(const char* ptr,const char* end)
 {
-        int res,fd;
-        char storebuffer[FAILSAFE_BLOCK_SIZE*3];
-        memset(storebuffer,0,FAILSAFE_BLOCK_SIZE*3);
-        int64_t ptr=0;
-        const int sign_length=strlen(FSDescSignature);
-        char* sigPtr=0;
-
-        if (argc!=2) {
-                std::cerr<<argc<<" arguments!"<<std::endl;
-                return 0;
-        }
-
-        fd = open(argv[1], O_RDWR);
-        if (fd>0) {
-                do {
-                        memcpy(storebuffer,storebuffer+FAILSAFE_BLOCK_SIZE,FAILSAFE_BLOCK_SIZE);
-                        res = pread(fd, storebuffer+FAILSAFE_BLOCK_SIZE, FAILSAFE_BLOCK_SIZE*2, ptr);
-                        if ( (sigPtr=static_cast<char*>(memchr(static_cast<void *>(storebuffer+FAILSAFE_BLOCK_SIZE+1-sign_length), (FSDescSignature[0]),(FAILSAFE_BLOCK_SIZE-1+sign_length)))) && res) {
-                                if (memcmp(sigPtr,FSDescSignature,sign_length)==0) {
-                                        FailSafeDescription desc;
-                                        memcpy(&desc,sigPtr,sizeof(FailSafeDescription));
-                                        if (checkDescConsistency(desc)==true) {
-                                                std::cout<<"Offset: "<<(ptr+static_cast<int64_t>(sigPtr-storebuffer)-FAILSAFE_BLOCK_SIZE)<<" Size: "<<desc.mOffset<<"Rev: "<<desc.mRevision<<" Name: "<<desc.mLastPath<<std::endl;
-                                        }
+#if defined(__x86_64__) && defined(__GNUC__)
+        static const bool avx2=__builtin_cpu_supports("avx2");
+        if (avx2)
+                return findSignatureAVX2(ptr,end);
+        return findSignatureSSE2(ptr,end);
+#else
+        return findSignatureScalar(ptr,end);
+#endif
+}
+
+/*!
+ *  Valid description block found on the device
+ */
+struct FoundDescription {
+        int64_t offset;
+        FailSafeDescription desc;
+};
+
+/*!
+ *  Part of the device scanned by one task, blocks starting in it belong
+ *  to it even if they end in the next one
+ */
+struct ScanSegment {
+        ScanSegment() :
+                        begin(0), end(0), blocks(0), descriptions(), entries(), error(0) {
+        }
+
+        int64_t begin;
+        int64_t end;
+        /// Valid data blocks
+        int64_t blocks;
+        /// Valid description blocks in offset order
+        std::vector<FoundDescription> descriptions;
+        /// Index entries of the valid data blocks (extraction mode)
+        std::vector<IndexEntry> entries;
+        /// errno of a failed read, 0 otherwise
+        int error;
+};
+
+/*!
+ *  Shared state of a parallel scan
+ */
+struct ScanContext {
+        int fd;
+        /// Index entries are collected
+        bool extract;
+        ScanSegment* segments;
+};
+
+/*!
+ * checks a compressed extent longer than a block, its data is read again
+ * @param fd device
+ * @param header first block of the extent
+ * @param offset position of the extent on the device
+ */
+static bool isValidExtent(int fd,const FailSafeStoreStruct& header,int64_t offset)
+{
+        const int64_t blocks=extentBlocksOf(header);
+        if (blocks<2)
+                return false;
+        std::vector<FailSafeStoreStruct> extent(blocks);
+        if (pread(fd,&extent[0],blocks*FAILSAFE_BLOCK_SIZE,offset)!=blocks*FAILSAFE_BLOCK_SIZE)
+                return false;
+        return checkExtentConsistency(&extent[0],blocks);
+}
+
+/*!
+ * checks a header of version 2.00, its payload is read from the slot the
+ * block counter gives in the group of the header
+ * @param fd device
+ * @param header header found by the scan
+ * @param offset position of the header on the device
+ * @param payload receives the data of the block
+ */
+static bool isValidLargeBlock(int fd,const FailSafeStoreStruct& header,int64_t offset,std::vector<char>& payload)
+{
+        const int shift=blockShiftOf(header);
+        const int64_t position=largePayloadPosition(header,offset);
+        if (shift==0 || position<0 || header.mSizeOfDataInCurrentBlock<0 || header.mSizeOfDataInCurrentBlock>(static_cast<int64_t>(1)<<shift))
+                return false;
+        payload.resize(header.mSizeOfDataInCurrentBlock);
+        if (payload.size()>0 && pread(fd,&payload[0],payload.size(),position)!=static_cast<ssize_t>(payload.size()))
+                return false;
+        return checkLargeConsistency(header,payload.empty()?NULL:&payload[0],static_cast<int64_t>(1)<<shift);
+}
+
+/*!
+ * scans a segment with large sequential reads, the last block size - 1
+ * bytes of a read are kept for the next one, so that blocks crossing the
+ * boundary of two reads are seen whole
+ */
+static void scanSegment(const ScanContext& scan,ScanSegment& segment)
+{
+        const int fd=scan.fd;
+        std::vector<char> buffer(SCAN_READ_SIZE+FAILSAFE_BLOCK_SIZE);
+        std::vector<char> payload;
+        // the buffer holds the bytes [position,position+filled) of the device
+        int64_t position=segment.begin;
+        size_t filled=0;
+        bool eof=false;
+        while (!eof && position<segment.end) {
+                const ssize_t res=pread(fd,&buffer[filled],buffer.size()-filled,position+filled);
+                if (res<0) {
+                        if (errno==EINTR)
+                                continue;
+                        segment.error=errno;
+                        return;
+                }
+                eof=(res==0);
+                filled+=res;
+                if (filled<FAILSAFE_BLOCK_SIZE)
+                        continue;
+
+                // only blocks that are complete in the buffer are checked
+                const int64_t limit=std::min(segment.end,position+static_cast<int64_t>(filled)-FAILSAFE_BLOCK_SIZE+1);
+                const char* base=&buffer[0];
+                const char* end=base+(limit-position);
+                for (const char* hit=findSignature(base,end);hit;hit=findSignature(hit+1,end)) {
+                        if (memcmp(hit,FSDescSignature,SIGNATURE_LENGTH)==0) {
+                                FoundDescription found;
+                                found.offset=position+(hit-base);
+                                memcpy(&found.desc,hit,sizeof(FailSafeDescription));
+                                if (checkDescConsistency(found.desc))
+                                        segment.descriptions.push_back(found);
+                        } else {
+                                FailSafeStoreStruct block;
+                                memcpy(&block,hit,sizeof(FailSafeStoreStruct));
+                                if (checkConsistency(block) || isValidExtent(fd,block,position+(hit-base)) ||
+                                    isValidLargeBlock(fd,block,position+(hit-base),payload)) {
+                                        ++segment.blocks;
+                                        if (scan.extract)
+                                                segment.entries.push_back(indexEntryOf(block,position+(hit-base)));
                                 }
                         }
-                        ptr+=(res>FAILSAFE_BLOCK_SIZE?FAILSAFE_BLOCK_SIZE:res);
-                } while (res>0);
-                close(fd);
+                }
+                const size_t consumed=limit-position;
+                memmove(&buffer[0],&buffer[consumed],filled-consumed);
+                filled-=consumed;
+                position=limit;
+        }
+}
+
+/*!
+ * worker task scanning a range of segments
+ */
+static void scanSegments(void* context,size_t begin,size_t end)
+{
+        ScanContext* scan=static_cast<ScanContext*>(context);
+        for (size_t i=begin;i<end;++i)
+                scanSegment(*scan,scan->segments[i]);
+}
+
+/*!
+ *  File version known from a description block (extraction mode)
+ */
+struct RecoverableFile {
+        RecoverableFile(const FailSafeDescription& desc) :
+                        blockCounter(desc.mBlockCounter), revision(desc.mRevision), size(desc.mOffset),
+                        permissions(desc.mPermissions), hashAlgorithm(hashAlgorithmOf(desc)),
+                        merkle((formatFlagsOf(desc)&FAILSAFE_FLAG_MERKLE)!=0), path() {
+                memcpy(random,desc.mRandomNumber,sizeof(random));
+                memcpy(currentHash,desc.mCurrentHash,INDEX_HASH_SIZE);
+                memcpy(lastHash,desc.mLastHash,INDEX_HASH_SIZE);
+                memset(merkleRoot,0,sizeof(merkleRoot));
+                if (merkle)
+                        memcpy(merkleRoot,merkleRootOf(desc),MERKLE_HASH_SIZE);
+                path.assign(desc.mLastPath,strnlen(desc.mLastPath,sizeof(desc.mLastPath)));
+        }
+
+        /// orders by file and newest revision first
+        bool operator<(const RecoverableFile& other) const {
+                int res=memcmp(random,other.random,sizeof(random));
+                if (res!=0)
+                        return res<0;
+                if (revision!=other.revision)
+                        return revision>other.revision;
+                return memcmp(currentHash,other.currentHash,INDEX_HASH_SIZE)<0;
+        }
+
+        /// the same description block
+        bool operator==(const RecoverableFile& other) const {
+                return memcmp(random,other.random,sizeof(random))==0 && revision==other.revision &&
+                       memcmp(currentHash,other.currentHash,INDEX_HASH_SIZE)==0;
+        }
+
+        char random[32];
+        int64_t blockCounter;
+        int64_t revision;
+        /// File size
+        int64_t size;
+        int64_t permissions;
+        char currentHash[INDEX_HASH_SIZE];
+        char lastHash[INDEX_HASH_SIZE];
+        int hashAlgorithm;
+        /// The blocks are verified by a Merkle tree instead of a hash chain
+        bool merkle;
+        char merkleRoot[MERKLE_HASH_SIZE];
+        std::string path;
+};
+
+/*!
+ * creates the output file of a recovered path below the directory, "." and
+ * ".." components are dropped and taken names get a numbered suffix
+ * @return file descriptor or -errno
+ */
+static int createOutput(const std::string& directory,const std::string& path,std::string& name)
+{
+        std::string relative;
+        size_t begin=0;
+        while (begin<path.size()) {
+                size_t end=path.find('/',begin);
+                if (end==std::string::npos)
+                        end=path.size();
+                const std::string component=path.substr(begin,end-begin);
+                begin=end+1;
+                if (component.empty() || component=="." || component=="..")
+                        continue;
+                if (!relative.empty()) {
+                        // parent directories of the file
+                        mkdir((directory+"/"+relative).c_str(),0755);
+                        relative+="/";
+                }
+                relative+=component;
+        }
+        if (relative.empty())
+                relative="unnamed";
+        name=directory+"/"+relative;
+        for (int n=1;;++n) {
+                int fd=open(name.c_str(),O_WRONLY|O_CREAT|O_EXCL,0600);
+                if (fd>=0 || errno!=EEXIST)
+                        return fd<0?-errno:fd;
+                std::ostringstream numbered;
+                numbered<<directory<<"/"<<relative<<"~"<<n;
+                name=numbered.str();
+        }
+}
+
+/*!
+ * writes a file version following its hash chain back from the description,
+ * or the blocks proven by its Merkle root
+ * @param device scanned device
+ * @param index index of the valid data blocks
+ * @param file description of the version
+ * @param out output file
+ * @return 0, -ENOENT if the chain is broken or the root does not match, or -errno
+ */
+static int extractFile(int device,const BlockIndex& index,const RecoverableFile& file,int out)
+{
+        char hash[INDEX_HASH_SIZE];
+        memcpy(hash,file.lastHash,INDEX_HASH_SIZE);
+        // blocks of a Merkle tree are not linked, the newest revision of each block
+        // older than the description is taken and the root decides
+        MerkleBuilder tree(file.hashAlgorithm);
+        for (int64_t i=0;i<file.blockCounter;++i) {
+                const int64_t blockNr=file.merkle?i:file.blockCounter-1-i;
+                IndexEntry entry;
+                int res=file.merkle?index.findNewest(file.random,blockNr,file.revision-1,entry):
+                        index.find(file.random,blockNr,hash,entry);
+                if (res<0)
+                        return res;
+                // the rest of a compressed extent is read after its header
+                std::vector<FailSafeStoreStruct> extent(1);
+                if (pread(device,&extent[0],FAILSAFE_BLOCK_SIZE,entry.offset)!=FAILSAFE_BLOCK_SIZE)
+                        return errno?-errno:-EIO;
+                const int64_t blocks=extentBlocksOf(extent[0]);
+                if (blocks>1) {
+                        extent.resize(blocks);
+                        if (pread(device,&extent[1],(blocks-1)*FAILSAFE_BLOCK_SIZE,entry.offset+FAILSAFE_BLOCK_SIZE)!=(blocks-1)*FAILSAFE_BLOCK_SIZE)
+                                return errno?-errno:-EIO;
+                }
+                const FailSafeStoreStruct& block=extent[0];
+                const bool compressed=(formatFlagsOf(block)&FAILSAFE_FLAG_COMPRESSED)!=0;
+                // the payload of a block of version 2.00 is in another slot of its group
+                std::vector<char> chunk;
+                if (blockShiftOf(block)!=0) {
+                        if (!isValidLargeBlock(device,block,entry.offset,chunk) || block.mBlockCounter<0)
+                                return -EIO;
+                } else if (!checkExtentConsistency(&extent[0],extent.size()) || block.mSizeOfDataInCurrentBlock<0 ||
+                           block.mSizeOfDataInCurrentBlock>(compressed?COMPRESS_CHUNK_SIZE:FAILSAFE_DATA_SIZE) || block.mBlockCounter<0) {
+                        // the device may have changed since the scan
+                        return -EIO;
+                }
+                const char* data=chunk.empty()?block.data:&chunk[0];
+                if (compressed) {
+                        chunk.resize(COMPRESS_CHUNK_SIZE);
+                        int res=decompressChunk(&extent[0],&chunk[0]);
+                        if (res<0)
+                                return res;
+                        data=&chunk[0];
+                }
+                // the data starts at the block boundary, mOffset may hold the position of a write inside it
+                if (pwrite(out,data,block.mSizeOfDataInCurrentBlock,blockDataOffset(block))!=block.mSizeOfDataInCurrentBlock)
+                        return -errno;
+                memcpy(hash,entry.lastHash,INDEX_HASH_SIZE);
+                tree.add(block.mCurrentHash);
         }
+        if (file.merkle) {
+                char root[MERKLE_HASH_SIZE];
+                tree.root(root);
+                if (memcmp(root,file.merkleRoot,MERKLE_HASH_SIZE)!=0)
+                        return -ENOENT;
+        }
+        if (ftruncate(out,file.size)!=0)
+                return -errno;
+        fchmod(out,file.permissions&07777);
         return 0;
 }
+
+/*!
+ * writes the newest version of every file whose hash chain is complete
+ * @return number of files that could not be recovered
+ */
+static int extractFiles(int device,const BlockIndex& index,std::vector<RecoverableFile>& files,const std::string& directory)
+{
+        std::sort(files.begin(),files.end());
+        files.erase(std::unique(files.begin(),files.end()),files.end());
+        int failed=0;
+        for (size_t first=0;first<files.size();) {
+                // versions of the same file, newest first
+                size_t last=first+1;
+                while (last<files.size() && memcmp(files[last].random,files[first].random,sizeof(files[first].random))==0)
+                        ++last;
+                bool recovered=false;
+                int res=0;
+                for (size_t i=first;i<last && !recovered;++i) {
+                        std::string name;
+                        int out=createOutput(directory,files[i].path,name);
+                        if (out<0) {
+                                res=out;
+                                break;
+                        }
+                        res=extractFile(device,index,files[i],out);
+                        close(out);
+                        if (res==0) {
+                                std::cout<<"Recovered: "<<name<<" Size: "<<files[i].size<<" Rev: "<<files[i].revision<<std::endl;
+                                recovered=true;
+                        } else {
+                                unlink(name.c_str());
+                        }
+                }
+                if (!recovered) {
+                        std::cerr<<"Not recovered: "<<files[first].path<<" Rev: "<<files[first].revision<<": "<<
+                                 (res==-ENOENT?(files[first].merkle?"Merkle root mismatch":"broken hash chain"):strerror(-res))<<std::endl;
+                        ++failed;
+                }
+                first=last;
+        }
+        return failed;
+}
+
+static void usage(const char* name)
+{
+        std::cerr<<"Usage: "<<name<<" [-j threads] [-x directory [-m index MiB]] device"<<std::endl;
+}
+
+int main(int argc,char*argv[])
+{
+        int fd;
+        long threads=sysconf(_SC_NPROCESSORS_ONLN);
+        long indexMemory=SCAN_INDEX_MEMORY;
+        const char* directory=NULL;
+        int opt;
+
+        while ((opt=getopt(argc,argv,"j:x:m:"))!=-1) {
+                switch (opt) {
+                case 'j':
+                        threads=strtol(optarg,NULL,10);
+                        break;
+                case 'x':
+                        directory=optarg;
+                        break;
+                case 'm':
+                        indexMemory=strtol(optarg,NULL,10);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind!=argc-1 || threads<1 || indexMemory<1) {
+                usage(argv[0]);
+                return 1;
+        }
+        gcry_check_version(NULL);
+        gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+        fd = open(argv[optind], O_RDONLY);
+        if (fd<0) {
+                std::cerr<<argv[optind]<<": "<<strerror(errno)<<std::endl;
+                return 1;
+        }
+        if (directory && mkdir(directory,0755)!=0 && errno!=EEXIST) {
+                std::cerr<<directory<<": "<<strerror(errno)<<std::endl;
+                close(fd);
+                return 1;
+        }
+        // block devices report their size only through lseek
+        const int64_t size=lseek(fd,0,SEEK_END);
+        posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+
+        // the index spills into the output directory
+        BlockIndex index(directory?directory:".",static_cast<size_t>(indexMemory)<<20);
+        std::vector<RecoverableFile> files;
+
+        WorkerPool pool;
+        pool.start(threads-1);
+        // every thread scans one segment of a wave, the results of a wave are printed in offset order
+        const size_t wave=threads;
+        std::vector<ScanSegment> segments(wave);
+        int64_t blocks=0;
+        int64_t descriptions=0;
+        int result=0;
+        for (int64_t begin=0;begin<size && result==0;begin+=wave*SCAN_SEGMENT_SIZE) {
+                size_t count=0;
+                for (;count<wave && begin+static_cast<int64_t>(count)*SCAN_SEGMENT_SIZE<size;++count) {
+                        ScanSegment& segment=segments[count];
+                        segment.begin=begin+count*SCAN_SEGMENT_SIZE;
+                        segment.end=std::min(segment.begin+SCAN_SEGMENT_SIZE,size);
+                        segment.blocks=0;
+                        segment.descriptions.clear();
+                        segment.entries.clear();
+                        segment.error=0;
+                }
+                ScanContext scan= {fd,directory!=NULL,&segments[0]};
+                pool.parallelFor(count,1,scanSegments,&scan);
+                for (size_t i=0;i<count && result==0;++i) {
+                        const ScanSegment& segment=segments[i];
+                        for (size_t k=0;k<segment.descriptions.size();++k) {
+                                const FailSafeDescription& desc=segment.descriptions[k].desc;
+                                std::cout<<"Offset: "<<segment.descriptions[k].offset<<" Size: "<<desc.mOffset<<"Rev: "<<desc.mRevision<<" Name: "<<desc.mLastPath<<std::endl;
+                                if (directory)
+                                        files.push_back(RecoverableFile(desc));
+                        }
+                        for (size_t k=0;k<segment.entries.size() && result==0;++k) {
+                                int res=index.add(segment.entries[k]);
+                                if (res<0) {
+                                        std::cerr<<"Index error: "<<strerror(-res)<<std::endl;
+                                        result=1;
+                                }
+                        }
+                        blocks+=segment.blocks;
+                        descriptions+=segment.descriptions.size();
+                        if (segment.error) {
+                                std::cerr<<"Read error at "<<segment.begin<<": "<<strerror(segment.error)<<std::endl;
+                                result=1;
+                        }
+                }
+        }
+        pool.stop();
+        std::cerr<<"Valid data blocks: "<<blocks<<" Descriptions: "<<descriptions<<std::endl;
+
+        if (directory && result==0) {
+                int res=index.finish();
+                if (res<0) {
+                        std::cerr<<"Index error: "<<strerror(-res)<<std::endl;
+                        result=1;
+                } else {
+                        if (index.spilled()>0)
+                                std::cerr<<"Index runs spilled to disk: "<<index.spilled()<<std::endl;
+                        posix_fadvise(fd,0,0,POSIX_FADV_RANDOM);
+                        if (extractFiles(fd,index,files,directory)>0)
+                                result=1;
+                }
+        }
+        close(fd);
+        return result;
+}
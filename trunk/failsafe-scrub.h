@@ -0,0 +1,542 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_SCRUB_HEADER__
+#define __FAILSAFE_SCRUB_HEADER__
+
+#include "failsafe.h"
+#include "failsafe-compress.h"
+#include "failsafe-dedup.h"
+#include "failsafe-geometry.h"
+#include "failsafe-merkle.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Blocks read and verified together
+#define SCRUB_CHUNK_BLOCKS 64
+
+/// Blocks verified between two saves of the cursor
+#define SCRUB_CURSOR_BLOCKS 1024
+
+/// Seconds between two passes over the backing tree
+#define SCRUB_PASS_PAUSE 60
+
+/// I/O scheduling class and target of ioprio_set (linux/ioprio.h is not always installed)
+#define SCRUB_IOPRIO_CLASS_IDLE 3
+#define SCRUB_IOPRIO_CLASS_SHIFT 13
+#define SCRUB_IOPRIO_WHO_PROCESS 1
+
+/*!
+ *  Background thread verifying the backing tree: block hashes, the
+ *  mLastHash chain and the description block of every file
+ *
+ *  The files are visited in sorted order. The position is saved in the
+ *  cursor file, so a restart continues where the previous mount stopped.
+ *  The reads are limited to a rate in bytes/s and the thread runs with
+ *  idle I/O and lowest CPU priority. Problems are appended to the report
+ *  file.
+ */
+class Scrubber
+{
+public:
+        /// true if a backing file is being modified and has to be skipped
+        typedef bool (*BusyCheck)(const struct stat& stbuf);
+
+        Scrubber() :
+                        mMutex(), mCondition(), mThread(), mRunning(false), mStopping(false),
+                        mRoot(), mCursorFile(), mReportFile(), mRate(0), mBusy(NULL),
+                        mResume(), mResumeBlockNr(0), mSinceSave(0), mThrottleStart(), mThrottled(0),
+                        mFiles(0), mBlocks(0), mErrors(0), mPasses(0) {
+                pthread_mutex_init(&mMutex,NULL);
+                pthread_cond_init(&mCondition,NULL);
+        }
+
+        ~Scrubber() {
+                stop();
+                pthread_cond_destroy(&mCondition);
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        /*!
+         * starts the thread
+         * @param root backing directory
+         * @param cursorFile file of the saved position
+         * @param reportFile problems are appended to it
+         * @param rate bytes read per second
+         * @param busy skips files being modified, may be NULL
+         */
+        void start(const std::string& root,const std::string& cursorFile,const std::string& reportFile,uint64_t rate,BusyCheck busy) {
+                mRoot=root;
+                mCursorFile=cursorFile;
+                mReportFile=reportFile;
+                mRate=std::max(rate,static_cast<uint64_t>(1));
+                mBusy=busy;
+                mStopping=false;
+                mRunning=(pthread_create(&mThread,NULL,run,this)==0);
+        }
+
+        /*!
+         * stops the thread after saving the cursor
+         */
+        void stop() {
+                pthread_mutex_lock(&mMutex);
+                mStopping=true;
+                pthread_cond_signal(&mCondition);
+                pthread_mutex_unlock(&mMutex);
+                if (mRunning)
+                        pthread_join(mThread,NULL);
+                mRunning=false;
+        }
+
+        /// Files verified
+        uint64_t files() const {
+                return mFiles;
+        }
+
+        /// Blocks verified
+        uint64_t blocks() const {
+                return mBlocks;
+        }
+
+        /// Problems found
+        uint64_t errors() const {
+                return mErrors;
+        }
+
+        /// Completed passes over the backing tree
+        uint64_t passes() const {
+                return mPasses;
+        }
+
+private:
+        Scrubber(const Scrubber&);
+        Scrubber& operator=(const Scrubber&);
+
+        static void* run(void* argument) {
+                Scrubber* scrubber=static_cast<Scrubber*>(argument);
+                // the scrubber yields the disk and the CPU to every other thread
+                syscall(SYS_ioprio_set,SCRUB_IOPRIO_WHO_PROCESS,0,SCRUB_IOPRIO_CLASS_IDLE<<SCRUB_IOPRIO_CLASS_SHIFT);
+                setpriority(PRIO_PROCESS,syscall(SYS_gettid),19);
+                scrubber->loadCursor();
+                do {
+                        clock_gettime(CLOCK_MONOTONIC,&(scrubber->mThrottleStart));
+                        scrubber->mThrottled=0;
+                        if (!scrubber->scrubDirectory("",0,!scrubber->mResume.empty()))
+                                break;
+                        ++(scrubber->mPasses);
+                        std::ostringstream summary;
+                        summary<<"pass "<<scrubber->mPasses<<" finished, files: "<<scrubber->mFiles<<" blocks: "<<scrubber->mBlocks<<" errors: "<<scrubber->mErrors;
+                        scrubber->report(summary.str());
+                        scrubber->mResume.clear();
+                        scrubber->saveCursor("",0);
+                } while (scrubber->wait(SCRUB_PASS_PAUSE));
+                return NULL;
+        }
+
+        /*!
+         * waits unless the thread is stopped
+         * @return false when the thread has to stop
+         */
+        bool wait(double seconds) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME,&deadline);
+                const double end=deadline.tv_sec+deadline.tv_nsec*1e-9+seconds;
+                deadline.tv_sec=static_cast<time_t>(end);
+                deadline.tv_nsec=static_cast<long>((end-deadline.tv_sec)*1e9);
+                pthread_mutex_lock(&mMutex);
+                while (!mStopping && pthread_cond_timedwait(&mCondition,&mMutex,&deadline)!=ETIMEDOUT)
+                        ;
+                const bool running=!mStopping;
+                pthread_mutex_unlock(&mMutex);
+                return running;
+        }
+
+        /*!
+         * accounts read bytes and sleeps while the reads are ahead of the rate
+         * @return false when the thread has to stop
+         */
+        bool throttle(size_t bytes) {
+                mThrottled+=bytes;
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC,&now);
+                const double elapsed=(now.tv_sec-mThrottleStart.tv_sec)+(now.tv_nsec-mThrottleStart.tv_nsec)*1e-9;
+                const double due=static_cast<double>(mThrottled)/mRate;
+                if (due>elapsed)
+                        return wait(due-elapsed);
+                return !stopping();
+        }
+
+        bool stopping() {
+                pthread_mutex_lock(&mMutex);
+                const bool result=mStopping;
+                pthread_mutex_unlock(&mMutex);
+                return result;
+        }
+
+        /*!
+         * verifies the files below a directory in sorted order
+         * @param relative path of the directory below the root ("" for the root)
+         * @param depth number of components of relative
+         * @param resuming the components of the cursor up to depth are equal
+         *        to relative, the entries before the cursor are skipped
+         * @return false when the thread has to stop
+         */
+        bool scrubDirectory(const std::string& relative,size_t depth,bool resuming) {
+                DIR* dir=opendir((mRoot+relative).c_str());
+                if (dir==NULL)
+                        return true;
+                std::vector<std::string> names;
+                struct dirent* entry;
+                while ((entry=readdir(dir))!=NULL)
+                        if (strcmp(entry->d_name,".")!=0 && strcmp(entry->d_name,"..")!=0 &&
+                            (depth>0 || strcmp(entry->d_name,FAILSAFE_META_DIR)!=0))
+                                names.push_back(entry->d_name);
+                closedir(dir);
+                std::sort(names.begin(),names.end());
+
+                resuming=resuming && depth<mResume.size();
+                for (size_t i=0;i<names.size();++i) {
+                        bool resumeHere=false;
+                        if (resuming) {
+                                if (names[i]<mResume[depth])
+                                        continue;
+                                resumeHere=(names[i]==mResume[depth]);
+                                resuming=false;
+                        }
+                        const std::string child=relative+"/"+names[i];
+                        if (stopping()) {
+                                saveCursor(child,0);
+                                return false;
+                        }
+                        struct stat stbuf;
+                        if (lstat((mRoot+child).c_str(),&stbuf)!=0)
+                                continue;
+                        bool cont=true;
+                        if (S_ISDIR(stbuf.st_mode))
+                                cont=scrubDirectory(child,depth+1,resumeHere);
+                        else if (S_ISREG(stbuf.st_mode))
+                                cont=scrubFile(child,(resumeHere && depth+1==mResume.size())?mResumeBlockNr:0);
+                        if (!cont)
+                                return false;
+                }
+                return true;
+        }
+
+        /*!
+         * verifies the blocks of a file, problems are reported unless the
+         * file changed meanwhile
+         * @param relative path below the root
+         * @param firstBlockNr block to continue with
+         * @return false when the thread has to stop
+         */
+        bool scrubFile(const std::string& relative,int64_t firstBlockNr) {
+                const int fd=open((mRoot+relative).c_str(),O_RDONLY|O_NOFOLLOW);
+                if (fd<0)
+                        return true;
+                struct stat before;
+                if (fstat(fd,&before)!=0 || before.st_size<FAILSAFE_BLOCK_SIZE || (mBusy && mBusy(before))) {
+                        close(fd);
+                        return true;
+                }
+                std::vector<std::string> problems;
+                if (before.st_size%FAILSAFE_BLOCK_SIZE!=0)
+                        problems.push_back("size is not a multiple of the block size");
+                const int64_t count=before.st_size/FAILSAFE_BLOCK_SIZE;
+
+                // blocks of a Merkle tree are proven against the root in the description
+                FailSafeDescription desc;
+                memset(&desc,0,sizeof(desc));
+                int merkleFd=-1;
+                if (pread(fd,&desc,sizeof(desc),(count-1)*FAILSAFE_BLOCK_SIZE)==sizeof(desc) && checkDescConsistency(desc) &&
+                    (formatFlagsOf(desc)&FAILSAFE_FLAG_MERKLE)) {
+                        merkleFd=open((mRoot+"/"+merklePath(before.st_dev,before.st_ino)).c_str(),O_RDONLY);
+                        if (merkleFd<0)
+                                problems.push_back("Merkle tree is missing");
+                }
+                const MerkleTree tree(merkleFd,hashAlgorithmOf(desc));
+                const MerkleTree* proof=(merkleFd>=0)?&tree:NULL;
+                // extents of a compressed file start at the chunk boundaries
+                const int64_t stride=(formatFlagsOf(desc)&FAILSAFE_FLAG_COMPRESSED)?COMPRESS_CHUNK_BLOCKS:1;
+
+                // blocks of version 2.00 are not at fixed positions, they are followed through the groups
+                if (blockShiftOf(desc)!=0 && checkDescConsistency(desc)) {
+                        if (!scrubLargeBlocks(fd,relative,desc,(count-1)*FAILSAFE_BLOCK_SIZE,firstBlockNr,problems)) {
+                                close(fd);
+                                return false;
+                        }
+                } else {
+                        std::vector<FailSafeStoreStruct> blocks(SCRUB_CHUNK_BLOCKS);
+                        // the chain of a continued file is checked from the block before the cursor
+                        FailSafeStoreStruct prev;
+                        bool havePrev=false;
+                        firstBlockNr-=firstBlockNr%stride;
+                        if (firstBlockNr>0 && firstBlockNr<count)
+                                havePrev=(pread(fd,&prev,sizeof(prev),(firstBlockNr-stride)*FAILSAFE_BLOCK_SIZE)==sizeof(prev));
+                        else
+                                firstBlockNr=0;
+
+                        for (int64_t blockNr=firstBlockNr;blockNr<count;) {
+                                const int64_t n=std::min(count-blockNr,static_cast<int64_t>(SCRUB_CHUNK_BLOCKS));
+                                const ssize_t res=pread(fd,&blocks[0],n*FAILSAFE_BLOCK_SIZE,blockNr*FAILSAFE_BLOCK_SIZE);
+                                if (res!=n*FAILSAFE_BLOCK_SIZE) {
+                                        problem(problems,blockNr,res<0?strerror(errno):"short read");
+                                        break;
+                                }
+                                for (int64_t i=0;i<n;i+=stride)
+                                        checkBlock(problems,&blocks[i],n-i,blockNr+i,(blockNr+i)/stride,blockNr+i==count-1,prev,havePrev,proof,desc);
+                                blockNr+=n;
+                                __sync_fetch_and_add(&mBlocks,n);
+                                mSinceSave+=n;
+                                if (!throttle(n*FAILSAFE_BLOCK_SIZE)) {
+                                        saveCursor(relative,blockNr);
+                                        if (merkleFd>=0)
+                                                close(merkleFd);
+                                        close(fd);
+                                        return false;
+                                }
+                                if (mSinceSave>=SCRUB_CURSOR_BLOCKS)
+                                        saveCursor(relative,blockNr);
+                        }
+                }
+
+                struct stat after;
+                const bool changed=(fstat(fd,&after)!=0 || after.st_size!=before.st_size ||
+                                    after.st_mtim.tv_sec!=before.st_mtim.tv_sec || after.st_mtim.tv_nsec!=before.st_mtim.tv_nsec);
+                if (merkleFd>=0)
+                        close(merkleFd);
+                close(fd);
+                // a modified file is checked again in the next pass
+                if (!changed) {
+                        for (size_t i=0;i<problems.size();++i)
+                                report(relative+": "+problems[i]);
+                        __sync_fetch_and_add(&mErrors,problems.size());
+                }
+                __sync_fetch_and_add(&mFiles,1);
+                return true;
+        }
+
+        /*!
+         * verifies the blocks of a file of version 2.00, their chain and the
+         * position of its description, shared payloads are read from the
+         * dedup store
+         * @param descPosition position of the verified description
+         * @param firstBlockNr block to continue with
+         * @return false when the thread has to stop
+         */
+        bool scrubLargeBlocks(int fd,const std::string& relative,const FailSafeDescription& desc,int64_t descPosition,
+                              int64_t firstBlockNr,std::vector<std::string>& problems) {
+                const int shift=blockShiftOf(desc);
+                const int64_t blockSize=static_cast<int64_t>(1)<<shift;
+                const int64_t count=desc.mBlockCounter;
+                if (shift<LARGE_MIN_SHIFT || shift>LARGE_MAX_SHIFT || count<1) {
+                        problem(problems,0,"invalid block size");
+                        return true;
+                }
+                if (largeDataPosition(shift,count-1)+blockSize!=descPosition)
+                        problem(problems,count,"description does not follow the last block");
+                int mapFd=-1;
+                int extentFd=-1;
+                struct stat stbuf;
+                if ((formatFlagsOf(desc)&FAILSAFE_FLAG_DEDUP) && fstat(fd,&stbuf)==0) {
+                        mapFd=open((mRoot+"/"+dedupMapPath(stbuf.st_dev,stbuf.st_ino)).c_str(),O_RDONLY);
+                        extentFd=open((mRoot+"/"+dedupExtentsPath(shift)).c_str(),O_RDONLY);
+                }
+                std::vector<char> payload(blockSize);
+                FailSafeStoreStruct header;
+                FailSafeStoreStruct prev;
+                bool havePrev=false;
+                if (firstBlockNr>0 && firstBlockNr<count)
+                        havePrev=(pread(fd,&prev,FAILSAFE_HEADER_SIZE,largeHeaderPosition(shift,firstBlockNr-1))==FAILSAFE_HEADER_SIZE);
+                else
+                        firstBlockNr=0;
+                bool running=true;
+                for (int64_t blockNr=firstBlockNr;blockNr<count;++blockNr) {
+                        int64_t slot=0;
+                        if (mapFd>=0 && readDedupMap(mapFd,blockNr,1,&slot)!=0)
+                                slot=0;
+                        const int payloadFd=slot>0?extentFd:fd;
+                        const int64_t payloadPosition=slot>0?(slot-1)<<shift:largeDataPosition(shift,blockNr);
+                        if (pread(fd,&header,FAILSAFE_HEADER_SIZE,largeHeaderPosition(shift,blockNr))!=FAILSAFE_HEADER_SIZE ||
+                                        header.mSizeOfDataInCurrentBlock<0 || header.mSizeOfDataInCurrentBlock>blockSize ||
+                                        pread(payloadFd,&payload[0],header.mSizeOfDataInCurrentBlock,payloadPosition)!=header.mSizeOfDataInCurrentBlock)
+                                problem(problems,blockNr,"short read");
+                        else if (!checkLargeConsistency(header,&payload[0],blockSize))
+                                problem(problems,blockNr,"hash mismatch");
+                        else if (header.mBlockCounter!=blockNr)
+                                problem(problems,blockNr,"block counter mismatch");
+                        else if (blockNr>0 && havePrev && memcmp(header.mLastHash,prev.mCurrentHash,HASH_SIZE)!=0)
+                                problem(problems,blockNr,"broken hash chain");
+                        memcpy(&prev,&header,FAILSAFE_HEADER_SIZE);
+                        havePrev=true;
+                        const int64_t pages=blockSize/FAILSAFE_BLOCK_SIZE;
+                        __sync_fetch_and_add(&mBlocks,pages);
+                        mSinceSave+=pages;
+                        if (!throttle(blockSize)) {
+                                saveCursor(relative,blockNr+1);
+                                running=false;
+                                break;
+                        }
+                        if (mSinceSave>=SCRUB_CURSOR_BLOCKS)
+                                saveCursor(relative,blockNr+1);
+                }
+                if (mapFd>=0)
+                        close(mapFd);
+                if (extentFd>=0)
+                        close(extentFd);
+                if (running && havePrev && memcmp(desc.mLastHash,prev.mCurrentHash,HASH_SIZE)!=0)
+                        problem(problems,count,"description is not linked to the last block");
+                return running;
+        }
+
+        /*!
+         * verifies one block (extent) and its link to the previous one or its proof
+         * @param block block followed by the rest of its extent
+         * @param available blocks in memory starting with block
+         * @param blockNr position of the block
+         * @param counter expected mBlockCounter of the block
+         * @param last the block is the description of the file
+         * @param prev previous block, replaced by this one
+         * @param havePrev prev is known
+         * @param tree Merkle tree of the file, NULL for a hash chain
+         * @param fileDesc description of the file holding the root of the tree
+         */
+        static void checkBlock(std::vector<std::string>& problems,const FailSafeStoreStruct* extent,int64_t available,int64_t blockNr,
+                               int64_t counter,bool last,FailSafeStoreStruct& prev,bool& havePrev,const MerkleTree* tree,
+                               const FailSafeDescription& fileDesc) {
+                const FailSafeStoreStruct& block=*extent;
+                if (last) {
+                        const FailSafeDescription& desc=reinterpret_cast<const FailSafeDescription&>(block);
+                        if (!checkDescConsistency(desc))
+                                problem(problems,blockNr,"invalid description");
+                        else if (desc.mBlockCounter!=counter)
+                                problem(problems,blockNr,"description block counter mismatch");
+                        else if (tree==NULL && havePrev && memcmp(desc.mLastHash,prev.mCurrentHash,HASH_SIZE)!=0)
+                                problem(problems,blockNr,"description is not linked to the last block");
+                } else {
+                        if (!checkExtentConsistency(extent,available))
+                                problem(problems,blockNr,"hash mismatch");
+                        else if (block.mBlockCounter!=counter)
+                                problem(problems,blockNr,"block counter mismatch");
+                        else if (tree!=NULL) {
+                                if (tree->prove(counter,block.mCurrentHash,fileDesc.mBlockCounter,merkleRootOf(fileDesc))!=0)
+                                        problem(problems,blockNr,"Merkle proof failed");
+                        } else if (blockNr>0 && havePrev && memcmp(block.mLastHash,prev.mCurrentHash,HASH_SIZE)!=0)
+                                problem(problems,blockNr,"broken hash chain");
+                }
+                prev=block;
+                havePrev=true;
+        }
+
+        static void problem(std::vector<std::string>& problems,int64_t blockNr,const char* text) {
+                std::ostringstream line;
+                line<<"block "<<blockNr<<": "<<text;
+                problems.push_back(line.str());
+        }
+
+        /// appends a time stamped line to the report file
+        void report(const std::string& text) {
+                const int fd=open(mReportFile.c_str(),O_WRONLY|O_CREAT|O_APPEND,0644);
+                if (fd<0)
+                        return;
+                char stamp[32];
+                const time_t now=time(NULL);
+                struct tm local;
+                localtime_r(&now,&local);
+                strftime(stamp,sizeof(stamp),"%Y-%m-%d %H:%M:%S ",&local);
+                const std::string line=stamp+text+"\n";
+                const ssize_t written=write(fd,line.c_str(),line.size());
+                (void) written;
+                close(fd);
+        }
+
+        /*!
+         * saves the position atomically as "block path"
+         */
+        void saveCursor(const std::string& relative,int64_t blockNr) {
+                mSinceSave=0;
+                const std::string temporary=mCursorFile+".tmp";
+                const int fd=open(temporary.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+                if (fd<0)
+                        return;
+                std::ostringstream cursor;
+                cursor<<blockNr<<" "<<relative;
+                const std::string content=cursor.str();
+                const bool written=(write(fd,content.c_str(),content.size())==static_cast<ssize_t>(content.size()));
+                close(fd);
+                if (written)
+                        rename(temporary.c_str(),mCursorFile.c_str());
+        }
+
+        /// reads the saved position into mResume and mResumeBlockNr
+        void loadCursor() {
+                mResume.clear();
+                mResumeBlockNr=0;
+                const int fd=open(mCursorFile.c_str(),O_RDONLY);
+                if (fd<0)
+                        return;
+                std::string content;
+                char buffer[4096];
+                ssize_t res;
+                while ((res=read(fd,buffer,sizeof(buffer)))>0)
+                        content.append(buffer,res);
+                close(fd);
+                const size_t space=content.find(' ');
+                if (space==std::string::npos)
+                        return;
+                mResumeBlockNr=strtoll(content.c_str(),NULL,10);
+                const std::string path=content.substr(space+1);
+                size_t begin=0;
+                while (begin<path.size()) {
+                        size_t end=path.find('/',begin);
+                        if (end==std::string::npos)
+                                end=path.size();
+                        if (end>begin)
+                                mResume.push_back(path.substr(begin,end-begin));
+                        begin=end+1;
+                }
+        }
+
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCondition;
+        pthread_t mThread;
+        bool mRunning;
+        bool mStopping;
+        std::string mRoot;
+        std::string mCursorFile;
+        std::string mReportFile;
+        /// Bytes per second
+        uint64_t mRate;
+        BusyCheck mBusy;
+        /// Path components of the saved position, empty for a new pass
+        std::vector<std::string> mResume;
+        int64_t mResumeBlockNr;
+        /// Blocks verified since the cursor was saved
+        int64_t mSinceSave;
+        /// Start of the pass the rate is measured from
+        struct timespec mThrottleStart;
+        uint64_t mThrottled;
+        uint64_t mFiles;
+        uint64_t mBlocks;
+        uint64_t mErrors;
+        uint64_t mPasses;
+};
+
+#endif
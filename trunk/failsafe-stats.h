@@ -0,0 +1,148 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_STATS_HEADER__
+#define __FAILSAFE_STATS_HEADER__
+
+#include <stdint.h>
+#include <time.h>
+#include <sstream>
+#include <string>
+
+/// Operations whose calls and latencies are counted
+enum StatsOperation {
+        STATS_GETATTR=0,
+        STATS_OPEN,
+        STATS_READ,
+        STATS_WRITE,
+        STATS_RELEASE,
+        STATS_FSYNC,
+        STATS_OPERATIONS
+};
+
+/// Latency buckets, bucket i counts calls below 2^i microseconds, the last one the rest
+#define STATS_BUCKETS 24
+
+/// Name of a StatsOperation
+inline const char* statsOperationName(int operation)
+{
+        static const char* const names[STATS_OPERATIONS]= {"getattr","open","read","write","release","fsync"};
+        return names[operation];
+}
+
+/*!
+ *  Counters of the mount, updated with relaxed atomic additions so the
+ *  hot paths take no lock. Every operation has its own cache line, so
+ *  threads running different operations do not share one.
+ */
+class Statistics
+{
+public:
+        Statistics() :
+                        mOperations(), mTotals() {
+        }
+
+        /// monotonic time in nanoseconds
+        static uint64_t now() {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC,&ts);
+                return static_cast<uint64_t>(ts.tv_sec)*1000000000+ts.tv_nsec;
+        }
+
+        /*!
+         * counts a finished operation
+         * @param operation StatsOperation
+         * @param start now() at the start of the operation
+         * @param result result of the operation, negative for errors
+         */
+        void record(int operation,uint64_t start,int64_t result) {
+                const uint64_t elapsed=now()-start;
+                Operation& op=mOperations[operation];
+                add(op.calls,1);
+                if (result<0)
+                        add(op.errors,1);
+                add(op.nanoseconds,elapsed);
+                add(op.buckets[bucketOf(elapsed)],1);
+        }
+
+        /// counts blocks, extents or descriptions whose hash or structure was wrong
+        void hashFailures(uint64_t count) {
+                add(mTotals.hashFailures,count);
+        }
+
+        /// counts a lock that was not free and the time spent waiting for it
+        void lockWait(uint64_t start) {
+                add(mTotals.lockWaits,1);
+                add(mTotals.lockWaitNanoseconds,now()-start);
+        }
+
+        /*!
+         * appends the counters as "name: value" lines
+         */
+        void format(std::ostringstream& text) const {
+                for (int i=0;i<STATS_OPERATIONS;++i) {
+                        const Operation& op=mOperations[i];
+                        const uint64_t calls=load(op.calls);
+                        const uint64_t nanoseconds=load(op.nanoseconds);
+                        text<<statsOperationName(i)<<": calls "<<calls<<" errors "<<load(op.errors)
+                            <<" total_us "<<nanoseconds/1000<<" avg_us "<<(calls?nanoseconds/calls/1000:0)<<"\n";
+                        text<<statsOperationName(i)<<"_latency_us:";
+                        for (int b=0;b<STATS_BUCKETS;++b) {
+                                const uint64_t count=load(op.buckets[b]);
+                                if (count==0)
+                                        continue;
+                                if (b==STATS_BUCKETS-1)
+                                        text<<" >="<<(static_cast<uint64_t>(1)<<(b-1))<<":"<<count;
+                                else
+                                        text<<" <"<<(static_cast<uint64_t>(1)<<b)<<":"<<count;
+                        }
+                        text<<"\n";
+                }
+                text<<"hash_failures: "<<load(mTotals.hashFailures)<<"\n";
+                text<<"lock_waits: "<<load(mTotals.lockWaits)<<"\n";
+                text<<"lock_wait_us: "<<load(mTotals.lockWaitNanoseconds)/1000<<"\n";
+        }
+
+private:
+        Statistics(const Statistics&);
+        Statistics& operator=(const Statistics&);
+
+        struct Operation {
+                uint64_t calls;
+                uint64_t errors;
+                uint64_t nanoseconds;
+                uint64_t buckets[STATS_BUCKETS];
+        } __attribute__((aligned(64)));
+
+        struct Totals {
+                uint64_t hashFailures;
+                uint64_t lockWaits;
+                uint64_t lockWaitNanoseconds;
+        } __attribute__((aligned(64)));
+
+        static int bucketOf(uint64_t nanoseconds) {
+                const uint64_t us=nanoseconds/1000;
+                if (us==0)
+                        return 0;
+                const int bits=64-__builtin_clzll(us);
+                return bits<STATS_BUCKETS?bits:STATS_BUCKETS-1;
+        }
+
+        static void add(uint64_t& counter,uint64_t value) {
+                __atomic_fetch_add(&counter,value,__ATOMIC_RELAXED);
+        }
+
+        static uint64_t load(const uint64_t& counter) {
+                return __atomic_load_n(&counter,__ATOMIC_RELAXED);
+        }
+
+        Operation mOperations[STATS_OPERATIONS];
+        Totals mTotals;
+};
+
+#endif
@@ -0,0 +1,353 @@
+/*
+  FailSafeFS:
+  Copyright (C) 2009-2010  David Volgyes <david.volgyes@gmail.com>
+
+  This program can be distributed under the terms of the GNU GPL2.
+ */
+
+
+#ifndef __FAILSAFE_TRACE_HEADER__
+#define __FAILSAFE_TRACE_HEADER__
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+ *  Static tracepoints of the provider "failsafefs". With sys/sdt.h they are
+ *  USDT probes, a nop each until a tracer attaches, e.g.
+ *      bpftrace -e 'usdt:./failsafefs:failsafefs:span__begin { @start[tid]=nsecs; }
+ *                   usdt:./failsafefs:failsafefs:span__end { @[arg0]=hist(nsecs-@start[tid]); }'
+ *  Without it they are compiled out.
+ *
+ *  span__begin(event, arg) and span__end(event, arg) enclose every
+ *  TraceEvent, lock__acquire(lock), lock__acquired(lock, contended)
+ *  and lock__release(lock) follow the inode locks.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define FAILSAFE_PROBE1(name,a) DTRACE_PROBE1(failsafefs,name,a)
+#define FAILSAFE_PROBE2(name,a,b) DTRACE_PROBE2(failsafefs,name,a,b)
+#else
+#define FAILSAFE_PROBE1(name,a) do {} while (0)
+#define FAILSAFE_PROBE2(name,a,b) do {} while (0)
+#endif
+
+/// Traced spans: the FUSE operations followed by the internal steps
+enum TraceEvent {
+        TRACE_LOOKUP=0,
+        TRACE_FORGET,
+        TRACE_GETATTR,
+        TRACE_SETATTR,
+        TRACE_ACCESS,
+        TRACE_READLINK,
+        TRACE_OPENDIR,
+        TRACE_READDIR,
+        TRACE_RELEASEDIR,
+        TRACE_MKNOD,
+        TRACE_SYMLINK,
+        TRACE_UNLINK,
+        TRACE_RMDIR,
+        TRACE_RENAME,
+        TRACE_LINK,
+        TRACE_OPEN,
+        TRACE_READ,
+        TRACE_WRITE,
+        TRACE_STATFS,
+        TRACE_RELEASE,
+        TRACE_FSYNC,
+        TRACE_SETXATTR,
+        TRACE_GETXATTR,
+        TRACE_LISTXATTR,
+        TRACE_REMOVEXATTR,
+        /// first internal event
+        TRACE_LOCK_WAIT,
+        TRACE_BLOCK_READ,
+        TRACE_BLOCK_VERIFY,
+        TRACE_BLOCK_WRITE,
+        TRACE_HASH,
+        TRACE_FLUSH,
+        TRACE_DESCRIPTION,
+        TRACE_EVENTS
+};
+
+/// Name of a TraceEvent
+inline const char* traceEventName(int event)
+{
+        static const char* const names[TRACE_EVENTS]= {
+                "lookup","forget","getattr","setattr","access","readlink","opendir","readdir","releasedir",
+                "mknod","symlink","unlink","rmdir","rename","link","open","read","write","statfs","release",
+                "fsync","setxattr","getxattr","listxattr","removexattr",
+                "lock_wait","block_read","block_verify","block_write","hash","flush","description"
+        };
+        return names[event];
+}
+
+/// Signal that writes the rings to the trace file
+#define TRACE_DUMP_SIGNAL SIGUSR1
+
+/*!
+ *  Optional in-memory trace: every thread writes the spans it finished
+ *  into its own ring, without locks, overwriting the oldest ones. A
+ *  helper thread writes the rings as a Chrome trace (chrome://tracing,
+ *  Perfetto) when the process gets TRACE_DUMP_SIGNAL.
+ */
+class TraceLog
+{
+public:
+        TraceLog() :
+                        mCapacity(0), mMutex(), mKey(), mRings(), mFree(), mFile(), mThread(), mRunning(false), mStopping(0) {
+                pthread_mutex_init(&mMutex,NULL);
+                pthread_key_create(&mKey,releaseRing);
+        }
+
+        ~TraceLog() {
+                stop();
+                for (size_t i=0;i<mRings.size();++i)
+                        delete mRings[i];
+                pthread_key_delete(mKey);
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        /// monotonic time in nanoseconds
+        static uint64_t now() {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC,&ts);
+                return static_cast<uint64_t>(ts.tv_sec)*1000000000+ts.tv_nsec;
+        }
+
+        bool enabled() const {
+                return __atomic_load_n(&mCapacity,__ATOMIC_RELAXED)!=0;
+        }
+
+        /*!
+         * enables the rings and starts the thread waiting for the dump
+         * signal, the signal is blocked in the calling thread and in the
+         * threads it creates later
+         * @param capacity spans kept per thread
+         * @param file the trace is written to it
+         */
+        void start(size_t capacity,const std::string& file) {
+                mFile=file;
+                sigset_t signals;
+                sigemptyset(&signals);
+                sigaddset(&signals,TRACE_DUMP_SIGNAL);
+                pthread_sigmask(SIG_BLOCK,&signals,NULL);
+                __atomic_store_n(&mCapacity,capacity,__ATOMIC_RELAXED);
+                mStopping=0;
+                mRunning=(pthread_create(&mThread,NULL,run,this)==0);
+        }
+
+        void stop() {
+                if (!mRunning)
+                        return;
+                __atomic_store_n(&mStopping,1,__ATOMIC_RELEASE);
+                pthread_kill(mThread,TRACE_DUMP_SIGNAL);
+                pthread_join(mThread,NULL);
+                mRunning=false;
+        }
+
+        /*!
+         * stores a finished span in the ring of the calling thread
+         * @param event TraceEvent
+         * @param start now() at the start of the span
+         * @param arg inode, block number or length of the span
+         */
+        void record(int event,uint64_t start,uint64_t arg) {
+                Ring* ring=static_cast<Ring*>(pthread_getspecific(mKey));
+                if (ring==NULL && (ring=attachRing())==NULL)
+                        return;
+                const uint64_t head=ring->head;
+                Record& r=ring->records[head%ring->records.size()];
+                r.start=start;
+                r.duration=now()-start;
+                r.arg=arg;
+                r.event=event;
+                r.tid=ring->tid;
+                __atomic_store_n(&(ring->head),head+1,__ATOMIC_RELEASE);
+        }
+
+        /*!
+         * writes the spans of every ring as a Chrome trace
+         * @return 0 or -errno
+         */
+        int dump(const std::string& file) {
+                const std::string temporary=file+".tmp";
+                FILE* out=fopen(temporary.c_str(),"w");
+                if (out==NULL)
+                        return -errno;
+                fprintf(out,"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+                const int pid=getpid();
+                bool first=true;
+                pthread_mutex_lock(&mMutex);
+                for (size_t i=0;i<mRings.size();++i) {
+                        std::vector<Record> records;
+                        snapshot(*(mRings[i]),records);
+                        for (size_t k=0;k<records.size();++k) {
+                                const Record& r=records[k];
+                                fprintf(out,"%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%llu}}",
+                                        first?"":",\n",traceEventName(r.event),r.event<TRACE_LOCK_WAIT?"fuse":"io",
+                                        r.start/1000.0,r.duration/1000.0,pid,r.tid,static_cast<unsigned long long>(r.arg));
+                                first=false;
+                        }
+                }
+                pthread_mutex_unlock(&mMutex);
+                fprintf(out,"\n]}\n");
+                const bool failed=ferror(out)!=0;
+                if (fclose(out)!=0 || failed) {
+                        unlink(temporary.c_str());
+                        return -EIO;
+                }
+                if (rename(temporary.c_str(),file.c_str())==-1)
+                        return -errno;
+                return 0;
+        }
+
+private:
+        TraceLog(const TraceLog&);
+        TraceLog& operator=(const TraceLog&);
+
+        struct Record {
+                uint64_t start;
+                uint64_t duration;
+                uint64_t arg;
+                uint32_t event;
+                int32_t tid;
+        };
+
+        /// Spans of one thread, written only by its owner
+        struct Ring {
+                Ring(size_t capacity) :
+                                records(capacity), head(0), tid(0) {
+                }
+                std::vector<Record> records;
+                /// Number of spans written so far
+                uint64_t head;
+                /// Thread owning the ring
+                int tid;
+        };
+
+        /// gives the calling thread a ring, a ring of an exited thread is reused
+        Ring* attachRing() {
+                const size_t capacity=__atomic_load_n(&mCapacity,__ATOMIC_RELAXED);
+                if (capacity==0)
+                        return NULL;
+                pthread_mutex_lock(&mMutex);
+                Ring* ring;
+                if (mFree.empty()) {
+                        ring=new Ring(capacity);
+                        mRings.push_back(ring);
+                } else {
+                        ring=mFree.back();
+                        mFree.pop_back();
+                }
+                ring->tid=syscall(SYS_gettid);
+                pthread_mutex_unlock(&mMutex);
+                pthread_setspecific(mKey,ring);
+                return ring;
+        }
+
+        static void releaseRing(void* ring);
+
+        /*!
+         * copies the spans of a ring that are not overwritten while they
+         * are copied
+         */
+        static void snapshot(const Ring& ring,std::vector<Record>& records) {
+                const uint64_t size=ring.records.size();
+                const uint64_t head=__atomic_load_n(&(ring.head),__ATOMIC_ACQUIRE);
+                const uint64_t first=head>size?head-size:0;
+                records.reserve(head-first);
+                for (uint64_t i=first;i<head;++i)
+                        records.push_back(ring.records[i%size]);
+                // the owner went on writing over the oldest ones
+                const uint64_t after=__atomic_load_n(&(ring.head),__ATOMIC_ACQUIRE);
+                const uint64_t valid=after>size?after-size:0;
+                if (valid>first)
+                        records.erase(records.begin(),records.begin()+std::min(valid-first,static_cast<uint64_t>(records.size())));
+        }
+
+        static void* run(void* argument) {
+                TraceLog* log=static_cast<TraceLog*>(argument);
+                sigset_t signals;
+                sigemptyset(&signals);
+                sigaddset(&signals,TRACE_DUMP_SIGNAL);
+                for (;;) {
+                        int signal;
+                        if (sigwait(&signals,&signal)!=0 || __atomic_load_n(&(log->mStopping),__ATOMIC_ACQUIRE))
+                                break;
+                        const int res=log->dump(log->mFile);
+                        if (res<0)
+                                fprintf(stderr,"%s: %s\n",log->mFile.c_str(),strerror(-res));
+                }
+                return NULL;
+        }
+
+        /// Spans kept per thread, 0 while the rings are disabled
+        size_t mCapacity;
+        /// Protects the lists of rings
+        pthread_mutex_t mMutex;
+        /// Ring of the calling thread
+        pthread_key_t mKey;
+        std::vector<Ring*> mRings;
+        /// Rings of exited threads
+        std::vector<Ring*> mFree;
+        std::string mFile;
+        pthread_t mThread;
+        bool mRunning;
+        int mStopping;
+};
+
+/// The trace of the process
+inline TraceLog& traceLog()
+{
+        static TraceLog log;
+        return log;
+}
+
+inline void TraceLog::releaseRing(void* ring)
+{
+        TraceLog& log=traceLog();
+        pthread_mutex_lock(&log.mMutex);
+        log.mFree.push_back(static_cast<Ring*>(ring));
+        pthread_mutex_unlock(&log.mMutex);
+}
+
+/*!
+ *  Traces the lifetime of the object as a span: the probes fire at both
+ *  ends, the ring gets the span when it is enabled. A disabled trace
+ *  costs a load and a branch.
+ */
+class TraceSpan
+{
+public:
+        TraceSpan(int event,uint64_t arg) :
+                        mEvent(event), mArg(arg), mStart(traceLog().enabled()?TraceLog::now():0) {
+                FAILSAFE_PROBE2(span__begin,mEvent,mArg);
+        }
+
+        ~TraceSpan() {
+                FAILSAFE_PROBE2(span__end,mEvent,mArg);
+                if (mStart)
+                        traceLog().record(mEvent,mStart,mArg);
+        }
+
+private:
+        TraceSpan(const TraceSpan&);
+        TraceSpan& operator=(const TraceSpan&);
+
+        int mEvent;
+        uint64_t mArg;
+        uint64_t mStart;
+};
+
+#endif
@@ -35,6 +35,7 @@
 #include <sys/time.h>
 #include <sys/timeb.h>
 #include <gcrypt.h>
+#include "failsafe-trace.h"
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
@@ -54,9 +55,42 @@
 /// Hash size
 #define HASH_SIZE 64
 
-/// Hash method
+/// Hash method of the version 1.00 format
 #define HASH_METHOD GCRY_MD_SHA1
 
+/// Bytes at the end of FailSafeDescription::mLastPath reserved for the extension (version 1.10)
+#define FAILSAFE_DESC_EXTENSION_SIZE 128
+
+/// Size of the nodes of the Merkle tree, the longest hash algorithm needs 32 bytes
+#define MERKLE_HASH_SIZE 32
+
+/// Format flag of version 1.10: the blocks are not chained, a Merkle tree covers them
+#define FAILSAFE_FLAG_MERKLE 0x01
+
+/// Format flag of version 1.10: the data is stored in compressed extents (failsafe-compress.h)
+#define FAILSAFE_FLAG_COMPRESSED 0x02
+
+/// Backing blocks owned by a compressed chunk
+#define COMPRESS_CHUNK_BLOCKS 4
+
+/// Logical bytes of a compressed chunk
+#define COMPRESS_CHUNK_SIZE (COMPRESS_CHUNK_BLOCKS*FAILSAFE_DATA_SIZE)
+
+/// Format flag of version 2.00: full payloads are shared with other files (failsafe-dedup.h)
+#define FAILSAFE_FLAG_DEDUP 0x04
+
+/// Hash algorithms of the blocks, the identifiers are stored on disk
+enum HashAlgorithm {
+        HASH_SHA1=0,
+        HASH_SHA256=1,
+        HASH_BLAKE2B=2,
+        HASH_CRC32C=3,
+        HASH_ALGORITHMS
+};
+
+/// Names of the hash algorithms (mount option)
+static const char* HashAlgorithmNames[HASH_ALGORITHMS]= {"sha1","sha256","blake2b","crc32c"};
+
 const int SUCCESS=0;
 const int ERROR_SIGNATURE=1;
 const int ERROR_VERSION=2;
@@ -69,6 +103,29 @@ static const char* FSDescSignature="FAILDESC";
 
 /// Version for FailSafeFS binary format
 static const char* FSVersion      ="    1.00";
+/// Version for FailSafeFS binary format with FailSafeExtension (non-SHA1 hash)
+static const char* FSVersionExtended="    1.10";
+/// Version for FailSafeFS binary format with power of two blocks and separate headers (failsafe-geometry.h)
+static const char* FSVersionLarge="    2.00";
+
+/*!
+ *  Format extension of version 1.10 and 2.00, stored in
+ *  FailSafeStoreStruct::mReserved and at the end of
+ *  FailSafeDescription::mLastPath
+ *
+ */
+struct FailSafeExtension {
+        /// Hash algorithm of the block (HashAlgorithm)
+        uint8_t mHashAlgorithm;
+        /// Format flags (FAILSAFE_FLAG_*)
+        uint8_t mFlags;
+        /// Bytes of compressed data following the header (FAILSAFE_FLAG_COMPRESSED)
+        uint32_t mStoredSize;
+        /// log2 of the block size of version 2.00
+        uint8_t mBlockShift;
+        /// Reserved for future features
+        char mReserved[25];
+} __attribute__((__packed__)) ;
 
 /*!
  *  FailSafe store struct for data
@@ -172,6 +229,299 @@ inline void randomize(void* destinationAddress,unsigned int size)
         }
 }
 
+/*!
+ * format extension of a data block (meaningful in version 1.10)
+ * @param sourceStruct data block
+ */
+inline FailSafeExtension& extensionOf(FailSafeStoreStruct& sourceStruct)
+{
+        return *reinterpret_cast<FailSafeExtension*>(sourceStruct.mReserved);
+}
+
+inline const FailSafeExtension& extensionOf(const FailSafeStoreStruct& sourceStruct)
+{
+        return *reinterpret_cast<const FailSafeExtension*>(sourceStruct.mReserved);
+}
+
+/*!
+ * format extension of a description block (meaningful in version 1.10)
+ * @param sourceStruct description block
+ */
+inline FailSafeExtension& extensionOf(FailSafeDescription& sourceStruct)
+{
+        return *reinterpret_cast<FailSafeExtension*>(sourceStruct.mLastPath+sizeof(sourceStruct.mLastPath)-FAILSAFE_DESC_EXTENSION_SIZE);
+}
+
+inline const FailSafeExtension& extensionOf(const FailSafeDescription& sourceStruct)
+{
+        return *reinterpret_cast<const FailSafeExtension*>(sourceStruct.mLastPath+sizeof(sourceStruct.mLastPath)-FAILSAFE_DESC_EXTENSION_SIZE);
+}
+
+/*!
+ * root of the Merkle tree of a file, stored after the format extension of
+ * its description (meaningful with FAILSAFE_FLAG_MERKLE)
+ * @param sourceStruct description block
+ */
+inline char* merkleRootOf(FailSafeDescription& sourceStruct)
+{
+        return reinterpret_cast<char*>(&extensionOf(sourceStruct))+sizeof(FailSafeExtension);
+}
+
+inline const char* merkleRootOf(const FailSafeDescription& sourceStruct)
+{
+        return reinterpret_cast<const char*>(&extensionOf(sourceStruct))+sizeof(FailSafeExtension);
+}
+
+/*!
+ * hash algorithm of a block
+ * @param version mVersion of the block
+ * @param extension format extension of the block
+ * @return HashAlgorithm or -1 for an unknown version/algorithm
+ */
+inline int hashAlgorithmOf(const char* version,const FailSafeExtension& extension)
+{
+        if (memcmp(version,FSVersion,8)==0)
+                return HASH_SHA1;
+        if ((memcmp(version,FSVersionExtended,8)==0 || memcmp(version,FSVersionLarge,8)==0) && extension.mHashAlgorithm<HASH_ALGORITHMS)
+                return extension.mHashAlgorithm;
+        return -1;
+}
+
+inline int hashAlgorithmOf(const FailSafeStoreStruct& sourceStruct)
+{
+        return hashAlgorithmOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+inline int hashAlgorithmOf(const FailSafeDescription& sourceStruct)
+{
+        return hashAlgorithmOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+/*!
+ * format flags of a block, blocks of version 1.00 have none
+ * @param version mVersion of the block
+ * @param extension format extension of the block
+ */
+inline int formatFlagsOf(const char* version,const FailSafeExtension& extension)
+{
+        if (memcmp(version,FSVersionExtended,8)==0 || memcmp(version,FSVersionLarge,8)==0)
+                return extension.mFlags;
+        return 0;
+}
+
+inline int formatFlagsOf(const FailSafeStoreStruct& sourceStruct)
+{
+        return formatFlagsOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+inline int formatFlagsOf(const FailSafeDescription& sourceStruct)
+{
+        return formatFlagsOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+/*!
+ * log2 of the block size of a block or file of version 2.00
+ * @param version mVersion of the block
+ * @param extension format extension of the block
+ * @return 0 for the 4096 byte blocks of version 1.x
+ */
+inline int blockShiftOf(const char* version,const FailSafeExtension& extension)
+{
+        if (memcmp(version,FSVersionLarge,8)==0)
+                return extension.mBlockShift;
+        return 0;
+}
+
+inline int blockShiftOf(const FailSafeStoreStruct& sourceStruct)
+{
+        return blockShiftOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+inline int blockShiftOf(const FailSafeDescription& sourceStruct)
+{
+        return blockShiftOf(sourceStruct.mVersion,extensionOf(sourceStruct));
+}
+
+/*!
+ * logical position of the first byte of a block (chunk), derived from its
+ * counter and format. mOffset is not used: a block written in the middle
+ * by version 1.00 holds the position of the write there, while its data
+ * starts at the block boundary.
+ */
+inline int64_t blockDataOffset(const FailSafeStoreStruct& sourceStruct)
+{
+        const int shift=blockShiftOf(sourceStruct);
+        if (shift!=0)
+                return sourceStruct.mBlockCounter<<shift;
+        if (formatFlagsOf(sourceStruct)&FAILSAFE_FLAG_COMPRESSED)
+                return sourceStruct.mBlockCounter*COMPRESS_CHUNK_SIZE;
+        return sourceStruct.mBlockCounter*FAILSAFE_DATA_SIZE;
+}
+
+/*!
+ * finds a hash algorithm by name
+ * @param name name of the algorithm (HashAlgorithmNames)
+ * @return HashAlgorithm or -1
+ */
+inline int hashAlgorithmByName(const char* name)
+{
+        for (int i=0;i<HASH_ALGORITHMS;++i)
+                if (strcmp(name,HashAlgorithmNames[i])==0)
+                        return i;
+        return -1;
+}
+
+/*!
+ * stores the version and format extension belonging to a hash algorithm,
+ * SHA1 blocks without format flags are written in the original 1.00 format
+ * @param version mVersion of the block
+ * @param extension format extension of the block
+ * @param algorithm HashAlgorithm
+ * @param flags format flags (FAILSAFE_FLAG_*)
+ * @param blockShift log2 of the block size of version 2.00, 0 for version 1.x
+ */
+inline void setHashAlgorithm(char* version,FailSafeExtension& extension,int algorithm,int flags=0,int blockShift=0)
+{
+        memset(&extension,0,sizeof(extension));
+        if (algorithm==HASH_SHA1 && flags==0 && blockShift==0) {
+                memcpy(version,FSVersion,8);
+        } else {
+                memcpy(version,blockShift?FSVersionLarge:FSVersionExtended,8);
+                extension.mHashAlgorithm=algorithm;
+                extension.mFlags=flags;
+                extension.mBlockShift=blockShift;
+        }
+}
+
+/*!
+ *  Lookup table of the software CRC32C (Castagnoli) implementation
+ */
+struct CRC32CTable {
+        uint32_t mTable[256];
+
+        CRC32CTable() {
+                for (uint32_t i=0;i<256;++i) {
+                        uint32_t crc=i;
+                        for (int k=0;k<8;++k)
+                                crc=(crc&1)?(crc>>1)^0x82F63B78:(crc>>1);
+                        mTable[i]=crc;
+                }
+        }
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+/*!
+ * CRC32C with the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(uint32_t crc,const unsigned char* ptr,size_t len)
+{
+        uint64_t crc64=crc;
+        for (;len>=8;len-=8,ptr+=8) {
+                uint64_t word;
+                memcpy(&word,ptr,8);
+                crc64=_mm_crc32_u64(crc64,word);
+        }
+        crc=crc64;
+        for (;len>0;--len,++ptr)
+                crc=_mm_crc32_u8(crc,*ptr);
+        return crc;
+}
+#endif
+
+/*!
+ * CRC32C checksum, using the CPU instruction when available
+ * @param ptr data
+ * @param len length of data
+ */
+inline uint32_t crc32c(const void* ptr,size_t len,uint32_t previous=0)
+{
+        const unsigned char* data=static_cast<const unsigned char*>(ptr);
+        uint32_t crc=~previous;
+#if defined(__x86_64__) && defined(__GNUC__)
+        static const bool hardware=__builtin_cpu_supports("sse4.2");
+        if (hardware)
+                return ~crc32cHardware(crc,data,len);
+#endif
+        static const CRC32CTable table;
+        for (size_t i=0;i<len;++i)
+                crc=table.mTable[(crc^data[i])&0xFF]^(crc>>8);
+        return ~crc;
+}
+
+/// Bytes hashed by hashBuffer in this process
+inline uint64_t& hashedBytes()
+{
+        static uint64_t bytes=0;
+        return bytes;
+}
+
+/*!
+ * hash calculation of a buffer
+ * @param algorithm HashAlgorithm
+ * @param hash destination (HASH_SIZE bytes, unused bytes are zeroed)
+ * @param ptr data
+ * @param len length of data
+ */
+inline void hashBuffer(int algorithm,char* hash,const void* ptr,size_t len)
+{
+        TraceSpan span(TRACE_HASH,len);
+        memset(hash,0,HASH_SIZE);
+        __atomic_fetch_add(&hashedBytes(),len,__ATOMIC_RELAXED);
+        switch (algorithm) {
+        case HASH_SHA1:
+                gcry_md_hash_buffer( GCRY_MD_SHA1, hash, ptr,len );
+                break;
+        case HASH_SHA256:
+                gcry_md_hash_buffer( GCRY_MD_SHA256, hash, ptr,len );
+                break;
+        case HASH_BLAKE2B:
+                gcry_md_hash_buffer( GCRY_MD_BLAKE2B_256, hash, ptr,len );
+                break;
+        case HASH_CRC32C: {
+                uint32_t crc=crc32c(ptr,len);
+                memcpy(hash,&crc,sizeof(crc));
+                break;
+        }
+        }
+}
+
+/*!
+ * hash calculation of two buffers following each other
+ * @param algorithm HashAlgorithm
+ * @param hash destination (HASH_SIZE bytes, unused bytes are zeroed)
+ */
+inline void hashBuffers(int algorithm,char* hash,const void* first,size_t firstLen,const void* second,size_t secondLen)
+{
+        TraceSpan span(TRACE_HASH,firstLen+secondLen);
+        memset(hash,0,HASH_SIZE);
+        __atomic_fetch_add(&hashedBytes(),firstLen+secondLen,__ATOMIC_RELAXED);
+        if (algorithm==HASH_CRC32C) {
+                uint32_t crc=crc32c(second,secondLen,crc32c(first,firstLen));
+                memcpy(hash,&crc,sizeof(crc));
+                return;
+        }
+        gcry_buffer_t buffers[2];
+        memset(buffers,0,sizeof(buffers));
+        buffers[0].size=buffers[0].len=firstLen;
+        buffers[0].data=const_cast<void*>(first);
+        buffers[1].size=buffers[1].len=secondLen;
+        buffers[1].data=const_cast<void*>(second);
+        switch (algorithm) {
+        case HASH_SHA1:
+                gcry_md_hash_buffers( GCRY_MD_SHA1, 0, hash, buffers, 2 );
+                break;
+        case HASH_SHA256:
+                gcry_md_hash_buffers( GCRY_MD_SHA256, 0, hash, buffers, 2 );
+                break;
+        case HASH_BLAKE2B:
+                gcry_md_hash_buffers( GCRY_MD_BLAKE2B_256, 0, hash, buffers, 2 );
+                break;
+        }
+}
+
 /*!
  * hash calculation for data block
  * @param sourceStruct struct for HASH calculation
@@ -180,8 +530,7 @@ inline void calculateHASH(FailSafeStoreStruct& sourceStruct)
 {
         char* ptr=(reinterpret_cast<char*>(&sourceStruct))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
         int len=FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE);
-        memset(sourceStruct.mCurrentHash,0,HASH_SIZE);
-        gcry_md_hash_buffer( HASH_METHOD, sourceStruct.mCurrentHash, ptr,len );
+        hashBuffer( hashAlgorithmOf(sourceStruct), sourceStruct.mCurrentHash, ptr,len );
 }
 
 /*!
@@ -192,21 +541,22 @@ inline void calculateDescHASH(FailSafeDescription& sourceStruct)
 {
         char* ptr=(reinterpret_cast<char*>(&sourceStruct))+sizeof(FailSafeDescription::mSignature)+HASH_SIZE;
         int len=FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeDescription::mSignature)+HASH_SIZE);
-        memset(sourceStruct.mCurrentHash,0,HASH_SIZE);
-        gcry_md_hash_buffer( HASH_METHOD, sourceStruct.mCurrentHash, ptr,len );
+        hashBuffer( hashAlgorithmOf(sourceStruct), sourceStruct.mCurrentHash, ptr,len );
 }
 
 /*!
  * hash checking in data block
  * @param sourceStruct struct for HASH checking
  */
-inline bool checkHASH(FailSafeStoreStruct& sourceStruct)
+inline bool checkHASH(const FailSafeStoreStruct& sourceStruct)
 {
         char hash[HASH_SIZE];
-        char* ptr=(reinterpret_cast<char*>(&sourceStruct))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
+        const int algorithm=hashAlgorithmOf(sourceStruct);
+        if (algorithm<0)
+                return false;
+        const char* ptr=(reinterpret_cast<const char*>(&sourceStruct))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
         int len=FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE);
-        memset(hash,0,HASH_SIZE);
-        gcry_md_hash_buffer( HASH_METHOD, hash, ptr,len );
+        hashBuffer( algorithm, hash, ptr,len );
         return memcmp(sourceStruct.mCurrentHash,hash,HASH_SIZE)==0;
 }
 
@@ -214,23 +564,69 @@ inline bool checkHASH(FailSafeStoreStruct& sourceStruct)
  * hash checking in description block
  * @param sourceStruct struct for HASH checking
  */
-inline bool checkDescHASH(FailSafeDescription& sourceStruct)
+inline bool checkDescHASH(const FailSafeDescription& sourceStruct)
 {
         char hash[HASH_SIZE];
-        char* ptr=(reinterpret_cast<char*>(&sourceStruct))+sizeof(FailSafeDescription::mSignature)+HASH_SIZE;
+        const int algorithm=hashAlgorithmOf(sourceStruct);
+        if (algorithm<0)
+                return false;
+        const char* ptr=(reinterpret_cast<const char*>(&sourceStruct))+sizeof(FailSafeDescription::mSignature)+HASH_SIZE;
         int len=FAILSAFE_BLOCK_SIZE-(sizeof(FailSafeDescription::mSignature)+HASH_SIZE);
-        memset(hash,0,HASH_SIZE);
-        gcry_md_hash_buffer( HASH_METHOD, hash, ptr,len );
+        hashBuffer( algorithm, hash, ptr,len );
         return memcmp(sourceStruct.mCurrentHash,hash,HASH_SIZE)==0;
 }
 
 
+/*!
+ * hash calculation for a block of version 2.00: the header without its
+ * data followed by the payload stored apart from it
+ * @param sourceStruct header of the block, only its first FAILSAFE_HEADER_SIZE bytes are stored
+ * @param payload mSizeOfDataInCurrentBlock bytes of data
+ */
+inline void calculateLargeHASH(FailSafeStoreStruct& sourceStruct,const void* payload)
+{
+        char* ptr=(reinterpret_cast<char*>(&sourceStruct))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
+        int len=FAILSAFE_HEADER_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE);
+        hashBuffers( hashAlgorithmOf(sourceStruct), sourceStruct.mCurrentHash, ptr,len, payload,sourceStruct.mSizeOfDataInCurrentBlock );
+}
+
+/*!
+ * checking the header and payload of a block of version 2.00
+ * @param sourceStruct header of the block
+ * @param payload data of the block
+ * @param blockSize size of the payload slot, mSizeOfDataInCurrentBlock must fit into it
+ * @return true, if check is successful
+ */
+inline bool checkLargeConsistency(const FailSafeStoreStruct& sourceStruct,const void* payload,int64_t blockSize)
+{
+        if (memcmp(sourceStruct.mSignature,FSSignature,sizeof(sourceStruct.mSignature))!=0 ||
+                        memcmp(sourceStruct.mVersion,FSVersionLarge,sizeof(sourceStruct.mVersion))!=0 ||
+                        (static_cast<int64_t>(1)<<blockShiftOf(sourceStruct))!=blockSize) {
+                if (debugMode)
+                        std::cerr<<"large block sign error"<<std::endl;
+                return false;
+        }
+        const int algorithm=hashAlgorithmOf(sourceStruct);
+        if (algorithm<0 || sourceStruct.mSizeOfDataInCurrentBlock<0 || sourceStruct.mSizeOfDataInCurrentBlock>blockSize)
+                return false;
+        char hash[HASH_SIZE];
+        const char* ptr=(reinterpret_cast<const char*>(&sourceStruct))+sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE;
+        int len=FAILSAFE_HEADER_SIZE-(sizeof(FailSafeStoreStruct::mSignature)+HASH_SIZE);
+        hashBuffers( algorithm, hash, ptr,len, payload,sourceStruct.mSizeOfDataInCurrentBlock );
+        if (memcmp(sourceStruct.mCurrentHash,hash,HASH_SIZE)!=0) {
+                if (debugMode)
+                        std::cerr<<"large block hash error"<<std::endl;
+                return false;
+        }
+        return true;
+}
+
 /*!
  * checking data struct consistency
  * @param sourceStruct struct for consistency check
  * @return true, if check is successful
  */
-inline bool checkConsistency(FailSafeStoreStruct& sourceStruct)
+inline bool checkConsistency(const FailSafeStoreStruct& sourceStruct)
 {
         bool result=true;
         if (!checkHASH(sourceStruct)) {
@@ -243,7 +639,7 @@ inline bool checkConsistency(FailSafeStoreStruct& sourceStruct)
                 if (debugMode)
                         std::cerr<<"block sign error"<<std::endl;
         }
-        if (memcmp(sourceStruct.mVersion,FSVersion,sizeof(sourceStruct.mVersion))!=0) {
+        if (hashAlgorithmOf(sourceStruct)<0) {
                 result=false;
                 if (debugMode)
                         std::cerr<<"block version error"<<std::endl;
@@ -256,7 +652,7 @@ inline bool checkConsistency(FailSafeStoreStruct& sourceStruct)
  * @param sourceStruct struct for consistency check
  * @return true, if check is successful
  */
-inline bool checkDescConsistency(FailSafeDescription& sourceStruct)
+inline bool checkDescConsistency(const FailSafeDescription& sourceStruct)
 {
         bool result=true;
         if (!checkDescHASH(sourceStruct)) {
@@ -269,7 +665,7 @@ inline bool checkDescConsistency(FailSafeDescription& sourceStruct)
                 if (debugMode)
                         std::cerr<<"Desc sign error"<<std::endl;
         }
-        if (memcmp(sourceStruct.mVersion,FSVersion,sizeof(sourceStruct.mVersion))!=0) {
+        if (hashAlgorithmOf(sourceStruct)<0) {
                 result=false;
                 if (debugMode)
                         std::cerr<<"Desc vers error"<<std::endl;
@@ -277,11 +673,53 @@ inline bool checkDescConsistency(FailSafeDescription& sourceStruct)
         return result;
 }
 
+/*!
+ * parent node of the Merkle tree
+ * @param algorithm HashAlgorithm of the file
+ * @param left left child (MERKLE_HASH_SIZE bytes)
+ * @param right right child, zero for an empty subtree
+ * @param parent destination (MERKLE_HASH_SIZE bytes)
+ */
+inline void merkleParent(int algorithm,const char* left,const char* right,char* parent)
+{
+        char children[2*MERKLE_HASH_SIZE];
+        char hash[HASH_SIZE];
+        memcpy(children,left,MERKLE_HASH_SIZE);
+        memcpy(children+MERKLE_HASH_SIZE,right,MERKLE_HASH_SIZE);
+        hashBuffer(algorithm,hash,children,sizeof(children));
+        memcpy(parent,hash,MERKLE_HASH_SIZE);
+}
+
+/*!
+ * copies the identity of the file from its first block to a block that
+ * is not chained (FAILSAFE_FLAG_MERKLE)
+ * @param dst block to identify
+ * @param firstblock block 0 of the file
+ */
+inline void adoptFileIdentity(FailSafeStoreStruct & dst,const FailSafeStoreStruct &firstblock)
+{
+        memset(dst.mLastHash,0,HASH_SIZE);
+        memset(dst.mCurrentHash,0,HASH_SIZE);
+        dst.mCreationDateOfFirstBlock=firstblock.mCreationDateOfFirstBlock;
+        memcpy(dst.mRandomNumber,firstblock.mRandomNumber,32);
+}
 
-inline void calculateHeader(FailSafeStoreStruct & dst,const FailSafeStoreStruct &lastblock,int64_t datasize,int64_t blockcounter, int64_t offset,int64_t revision)
+/*!
+ * links a block into the hash chain after its predecessor
+ * @param dst block to link
+ * @param lastblock previous block of the file, its hash is final
+ */
+inline void linkBlock(FailSafeStoreStruct & dst,const FailSafeStoreStruct &lastblock)
+{
+        memcpy(dst.mLastHash,lastblock.mCurrentHash,HASH_SIZE);
+        memset(dst.mCurrentHash,0,HASH_SIZE);
+        dst.mCreationDateOfFirstBlock=lastblock.mCreationDateOfFirstBlock;
+        memcpy(dst.mRandomNumber,lastblock.mRandomNumber,32);
+}
+
+inline void calculateHeader(FailSafeStoreStruct & dst,const FailSafeStoreStruct &lastblock,int64_t datasize,int64_t blockcounter, int64_t offset,int64_t revision,int hashAlgorithm=HASH_SHA1,int flags=0,int blockShift=0)
 {
         memcpy(dst.mSignature,FSSignature,sizeof(dst.mSignature));
-        memcpy(dst.mVersion,FSVersion,sizeof(dst.mVersion));
         dst.mSizeOfDataInCurrentBlock=datasize;
         struct timeb tp;
         ftime(&tp);
@@ -294,27 +732,33 @@ inline void calculateHeader(FailSafeStoreStruct & dst,const FailSafeStoreStruct
                 // generate random value
                 randomize(&(dst.mRandomNumber),sizeof(dst.mRandomNumber));
         } else {
-                memcpy(dst.mLastHash,lastblock.mCurrentHash,HASH_SIZE);
-                memset(dst.mCurrentHash,0,HASH_SIZE);
-                dst.mCreationDateOfFirstBlock=lastblock.mCreationDateOfFirstBlock;
-                memcpy(dst.mRandomNumber,lastblock.mRandomNumber,32);
+                linkBlock(dst,lastblock);
         }
         dst.mOffset=offset;
         dst.mRevision=revision;
         if (static_cast<int>(sizeof(dst.data))>datasize)
                 memset(dst.data+datasize,0,sizeof(dst.data)-datasize);
-        memset(dst.mReserved,0,sizeof(dst.mReserved));
+        setHashAlgorithm(dst.mVersion,extensionOf(dst),hashAlgorithm,flags,blockShift);
 }
 
-inline void calculateDescription(FailSafeDescription& dst,const FailSafeStoreStruct &lastblock,std::string path,int64_t uid,int64_t gid,int64_t mode)
+/*!
+ * builds the description following the last block of a file
+ * @param merkleRoot root of the Merkle tree of a file with FAILSAFE_FLAG_MERKLE
+ */
+inline void calculateDescription(FailSafeDescription& dst,const FailSafeStoreStruct &lastblock,std::string path,int64_t uid,int64_t gid,int64_t mode,const char* merkleRoot=NULL)
 {
+        // the description is hashed like the last block of the file
+        const int hashAlgorithm=hashAlgorithmOf(lastblock)<0?HASH_SHA1:hashAlgorithmOf(lastblock);
+        const int flags=formatFlagsOf(lastblock);
+        const int blockShift=blockShiftOf(lastblock);
+        const bool extended=(hashAlgorithm!=HASH_SHA1 || flags!=0 || blockShift!=0);
+        const size_t pathSize=extended?sizeof(dst.mLastPath)-FAILSAFE_DESC_EXTENSION_SIZE:sizeof(dst.mLastPath);
         memcpy(dst.mSignature,FSDescSignature,sizeof(dst.mSignature));
-        memcpy(dst.mVersion,FSVersion,sizeof(dst.mVersion));
         struct timeb tp;
         ftime(&tp);
         dst.mCreationDateOfCurrentBlock=tp.time+tp.millitm*0.001;
         dst.mBlockCounter=lastblock.mBlockCounter+1;
-        dst.mOffset=lastblock.mBlockCounter*FAILSAFE_DATA_SIZE+lastblock.mSizeOfDataInCurrentBlock;
+        dst.mOffset=blockDataOffset(lastblock)+lastblock.mSizeOfDataInCurrentBlock;
         memcpy(dst.mLastHash,lastblock.mCurrentHash,HASH_SIZE);
         memset(dst.mCurrentHash,0,HASH_SIZE);
         dst.mCreationDateOfFirstBlock=lastblock.mCreationDateOfFirstBlock;
@@ -324,15 +768,21 @@ inline void calculateDescription(FailSafeDescription& dst,const FailSafeStoreStr
         dst.mGID=gid;
         dst.mPermissions=mode;
         memset(dst.mLastPath,0,sizeof(dst.mLastPath));
-        if (path.size()+1>sizeof(dst.mLastPath)) {
-                path.erase(0,path.size()+1-sizeof(dst.mLastPath));
+        if (path.size()+1>pathSize) {
+                path.erase(0,path.size()+1-pathSize);
                 dst.mPartialPath=1;
         } else {
                 dst.mPartialPath=0;
         }
-        strncpy(dst.mLastPath,path.c_str(),sizeof(dst.mLastPath));
-        dst.mLastPath[sizeof(dst.mLastPath)-1]='\0';
+        strncpy(dst.mLastPath,path.c_str(),pathSize);
+        dst.mLastPath[pathSize-1]='\0';
         dst.mSizeOfDataInCurrentBlock=strlen(dst.mLastPath);
+        if (!extended)
+                memcpy(dst.mVersion,FSVersion,sizeof(dst.mVersion));
+        else
+                setHashAlgorithm(dst.mVersion,extensionOf(dst),hashAlgorithm,flags,blockShift);
+        if ((flags&FAILSAFE_FLAG_MERKLE) && merkleRoot)
+                memcpy(merkleRootOf(dst),merkleRoot,MERKLE_HASH_SIZE);
         calculateDescHASH(dst);
         checkDescConsistency(dst);
 }
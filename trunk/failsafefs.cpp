@@ -13,23 +13,32 @@
 #endif
 
 #include "failsafe.h"
+#include <fuse_lowlevel.h>
+#include "failsafe-pool.h"
+#include "failsafe-cache.h"
+#include "failsafe-compress.h"
+#include "failsafe-dedup.h"
+#include "failsafe-geometry.h"
+#include "failsafe-io.h"
+#include "failsafe-merkle.h"
+#include "failsafe-scrub.h"
+#include "failsafe-stats.h"
+#include "failsafe-trace.h"
 #include <cassert>
+#include <algorithm>
+#include <cstddef>
 #include <map>
+#include <set>
+#include <vector>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 std::string basepath;
 
-pthread_mutex_t globalMutex;
-
-struct CacheStruct {
-        bool hasDesc;
-        FailSafeDescription desc;
-        bool hasLastBlock;
-        FailSafeStoreStruct lastblock;
-        FailSafeStoreStruct lastwrittenblock;
-        bool hasIncompleteBlock;
-        FailSafeStoreStruct incompleteblock;
-};
+/// Counters shown in FAILSAFE_META_DIR/stats
+Statistics statistics;
 
 class Mutex
 {
@@ -55,576 +64,3334 @@ private:
         pthread_mutex_t& mMutex;
 };
 
-std::map<int64_t,CacheStruct> cache;
+/*!
+ *  Shared (reader) lock on a pthread rwlock for the lifetime of the object
+ */
+class ReadLock
+{
+public:
+        ReadLock(pthread_rwlock_t& lock) :
+                        mLock(lock) {
+                FAILSAFE_PROBE1(lock__acquire,&mLock);
+                const bool contended=pthread_rwlock_tryrdlock( &mLock )!=0;
+                if (contended) {
+                        TraceSpan span(TRACE_LOCK_WAIT,reinterpret_cast<uint64_t>(&mLock));
+                        const uint64_t start=Statistics::now();
+                        pthread_rwlock_rdlock( &mLock );
+                        statistics.lockWait(start);
+                }
+                FAILSAFE_PROBE2(lock__acquired,&mLock,contended);
+        }
+
+        ~ReadLock() {
+                pthread_rwlock_unlock( &mLock );
+                FAILSAFE_PROBE1(lock__release,&mLock);
+        }
+
+private:
+        pthread_rwlock_t& mLock;
+};
 
-static int fs_getattr(const char *path, struct stat *stbuf)
+/*!
+ *  Exclusive (writer) lock on a pthread rwlock for the lifetime of the object
+ */
+class WriteLock
 {
-        std::string localpath=basepath+std::string(path);
-        int res;
+public:
+        WriteLock(pthread_rwlock_t& lock) :
+                        mLock(lock) {
+                FAILSAFE_PROBE1(lock__acquire,&mLock);
+                const bool contended=pthread_rwlock_trywrlock( &mLock )!=0;
+                if (contended) {
+                        TraceSpan span(TRACE_LOCK_WAIT,reinterpret_cast<uint64_t>(&mLock));
+                        const uint64_t start=Statistics::now();
+                        pthread_rwlock_wrlock( &mLock );
+                        statistics.lockWait(start);
+                }
+                FAILSAFE_PROBE2(lock__acquired,&mLock,contended);
+        }
+
+        ~WriteLock() {
+                pthread_rwlock_unlock( &mLock );
+                FAILSAFE_PROBE1(lock__release,&mLock);
+        }
+
+private:
+        pthread_rwlock_t& mLock;
+};
+
+/*!
+ *  Identity of a backing file (device and inode number)
+ */
+struct InodeKey {
+        dev_t dev;
+        ino_t ino;
+
+        bool operator<(const InodeKey& other) const {
+                return (dev<other.dev) || (dev==other.dev && ino<other.ino);
+        }
+};
+
+/*!
+ *  Version of a backing file, it changes whenever the file is modified
+ */
+struct FileStamp {
+        off_t size;
+        struct timespec mtime;
+        struct timespec ctime;
+
+        bool operator==(const FileStamp& other) const {
+                return size==other.size &&
+                       mtime.tv_sec==other.mtime.tv_sec && mtime.tv_nsec==other.mtime.tv_nsec &&
+                       ctime.tv_sec==other.ctime.tv_sec && ctime.tv_nsec==other.ctime.tv_nsec;
+        }
+};
+
+inline FileStamp stampOf(const struct stat& stbuf)
+{
+        FileStamp stamp;
+        stamp.size=stbuf.st_size;
+        stamp.mtime=stbuf.st_mtim;
+        stamp.ctime=stbuf.st_ctim;
+        return stamp;
+}
+
+/*!
+ * unique inode version number for tagging cached blocks
+ */
+inline uint64_t nextGeneration()
+{
+        static uint64_t generation=0;
+        return __sync_add_and_fetch(&generation,1);
+}
+
+/*!
+ *  Read-only mapping of a backing file shared by the readers of an inode
+ */
+struct FileMapping {
+        const char* address;
+        size_t length;
+        /// Version of the backing file that was mapped
+        FileStamp stamp;
+        /// References of the inode and of running reads (guarded by the inode's stateMutex)
+        int refs;
+};
+
+/*!
+ *  Inode of the file system: a backing file with the state shared by its
+ *  open handles, its address is the FUSE inode number
+ */
+struct InodeStruct {
+        InodeStruct(const InodeKey& k) :
+                        key(k), pathFd(-1), lookups(0), lock(), openCount(0), stateMutex(), path(), stamp(), generation(nextGeneration()), verifiedSince(0), verified(), prefetching(0), handles(0), writers(0), unlinked(false), mapping(NULL), dirty(), dirtyFd(-1), merkleFd(-1), merkleLeaves(-1), chainTail(), dedupFd(-1) {
+                pthread_rwlock_init(&lock,NULL);
+                pthread_mutex_init(&stateMutex,NULL);
+        }
+
+        ~InodeStruct() {
+                if (mapping) {
+                        munmap(const_cast<char*>(mapping->address),mapping->length);
+                        delete mapping;
+                }
+                if (pathFd>=0)
+                        close(pathFd);
+                if (dirtyFd>=0)
+                        close(dirtyFd);
+                if (merkleFd>=0)
+                        close(merkleFd);
+                if (dedupFd>=0)
+                        close(dedupFd);
+                pthread_mutex_destroy(&stateMutex);
+                pthread_rwlock_destroy(&lock);
+        }
+
+        /// Identity of the backing file
+        InodeKey key;
+        /// O_PATH descriptor of the backing file while the kernel knows the inode, -1 otherwise
+        int pathFd;
+        /// Lookup count of the kernel (guarded by the inode table shard)
+        uint64_t lookups;
+        /// Readers of the block data take it shared, writers exclusive
+        pthread_rwlock_t lock;
+        /// Number of open handles and other internal references
+        int openCount;
+        /// Protects the path and the verification state below
+        pthread_mutex_t stateMutex;
+        /// Path below the mount point the inode was last reached by, recorded in descriptions
+        std::string path;
+        /// Version of the backing file the verification state belongs to
+        FileStamp stamp;
+        /// Changes with the stamp unless the change was made by this mount, tags cached blocks
+        uint64_t generation;
+        /// Start of the current trust interval
+        time_t verifiedSince;
+        /// Blocks whose hash was checked since they were last read from the disk
+        std::vector<bool> verified;
+        /// Set while a readahead of this inode is queued or running
+        int prefetching;
+        /// Number of open handles (guarded by stateMutex)
+        int handles;
+        /// Number of open handles that may write (guarded by stateMutex)
+        int writers;
+        /// The last name went while handles were open, the last one removes the side data (guarded by stateMutex)
+        bool unlinked;
+        /// Current mapping for the mmap read path or NULL (guarded by stateMutex)
+        FileMapping* mapping;
+        /// Blocks written but not stored yet (guarded by lock)
+        DirtyBlocks dirty;
+        /// Writable descriptor the dirty blocks are stored through, -1 while there are none (guarded by lock)
+        int dirtyFd;
+        /// Merkle tree of a file with FAILSAFE_FLAG_MERKLE, -1 until it is used (guarded by lock)
+        int merkleFd;
+        /// Leaves of the Merkle tree, -1 if they have to be counted again (guarded by lock)
+        int64_t merkleLeaves;
+        /// Last block stored while the file is open for writing (guarded by lock)
+        ChainTail chainTail;
+        /// Block map of a file with FAILSAFE_FLAG_DEDUP, -1 until it is used (guarded by stateMutex)
+        int dedupFd;
+
+private:
+        InodeStruct(const InodeStruct&);
+        InodeStruct& operator=(const InodeStruct&);
+};
+
+/*!
+ *  Per open handle state, its address is stored in fuse_file_info::fh
+ */
+struct CacheStruct {
         int fd;
+        /// Opened for writing, counted in the inode's writers
+        bool writable;
+        InodeKey key;
+        InodeStruct* inode;
+        /// Serializes the lazy loading of the description block
+        pthread_mutex_t descMutex;
+        bool hasDesc;
         FailSafeDescription desc;
-        res = lstat(localpath.c_str(), stbuf);
+        /// Hash algorithm of the blocks written through this handle
+        int hashAlgorithm;
+        /// Format flags of the blocks written through this handle
+        int formatFlags;
+        /// log2 of the block size of a file of version 2.00, 0 for version 1.x
+        int blockShift;
+        /// Highest block (chunk of a compressed file) written through this handle, the description follows it (-1: none)
+        int64_t lastWrittenBlockNr;
+        /// Protects the readahead state below
+        pthread_mutex_t readaheadMutex;
+        /// Block following the previous read, a read starting there is sequential
+        int64_t nextBlockNr;
+        /// Blocks prefetched ahead of sequential reads, shrinks on random access
+        int64_t readaheadWindow;
+        /// End of the blocks already handed to the prefetcher
+        int64_t readaheadEnd;
+};
 
-        if ((res!=-1) && S_ISREG(stbuf->st_mode) && !S_ISDIR(stbuf->st_mode)) {
-                fd = open(localpath.c_str(), O_RDONLY);
-                if (fd == -1) {
-                        return -errno;
+/// Number of independently locked inode table shards
+#define INODE_TABLE_SHARDS 64
+
+/// Closed inodes kept per shard for their verification state and cached blocks
+#define INODE_TABLE_IDLE_PER_SHARD 64
+
+/*!
+ *  Inode table split into shards, so that lookups and opens of unrelated
+ *  files do not serialize on the same mutex
+ *
+ *  An inode lives while the kernel knows it (lookups) or it is referenced
+ *  internally (openCount). Idle inodes are kept for their verification
+ *  state and cached blocks until the shard has too many of them.
+ */
+class InodeTable
+{
+public:
+        InodeTable() :
+                        mShards() {
+        }
+
+        /*!
+         * finds or creates the inode entry and takes a reference to it
+         * @param key identity of the backing file
+         */
+        InodeStruct* acquire(const InodeKey& key) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                InodeStruct* inode=find(shard,key);
+                ++inode->openCount;
+                return inode;
+        }
+
+        /*!
+         * drops a reference taken by acquire
+         * @param key identity of the backing file
+         */
+        void release(const InodeKey& key) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                std::map<InodeKey,InodeStruct*>::iterator it=shard.inodes.find(key);
+                if (it==shard.inodes.end())
+                        return;
+                --(it->second->openCount);
+                if (idle(*(it->second)))
+                        makeIdle(shard);
+        }
+
+        /*!
+         * counts a lookup of the kernel
+         * @param key identity of the backing file
+         * @param fd O_PATH descriptor of the backing file, adopted or closed
+         */
+        InodeStruct* lookup(const InodeKey& key,int fd) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                InodeStruct* inode=find(shard,key);
+                if (inode->pathFd<0)
+                        inode->pathFd=fd;
+                else
+                        close(fd);
+                ++inode->lookups;
+                return inode;
+        }
+
+        /*!
+         * checks whether a backing file is open for writing
+         * @param key identity of the backing file
+         */
+        bool writing(const InodeKey& key) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                std::map<InodeKey,InodeStruct*>::iterator it=shard.inodes.find(key);
+                if (it==shard.inodes.end())
+                        return false;
+                Mutex stateMutex(it->second->stateMutex);
+                return it->second->writers>0;
+        }
+
+        /*!
+         * marks a backing file that lost its last name while handles are
+         * open, the last handle removes its side data
+         * @param key identity of the backing file
+         * @return false if no handle is open
+         */
+        bool unlinkedWhileOpen(const InodeKey& key) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                std::map<InodeKey,InodeStruct*>::iterator it=shard.inodes.find(key);
+                if (it==shard.inodes.end())
+                        return false;
+                Mutex stateMutex(it->second->stateMutex);
+                if (it->second->handles==0)
+                        return false;
+                it->second->unlinked=true;
+                return true;
+        }
+
+        /*!
+         * records the new path of a renamed inode if it is in the table
+         * @param key identity of the backing file
+         * @param path new path below the mount point
+         */
+        void renamed(const InodeKey& key,const std::string& path) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                std::map<InodeKey,InodeStruct*>::iterator it=shard.inodes.find(key);
+                if (it!=shard.inodes.end()) {
+                        Mutex stateMutex(it->second->stateMutex);
+                        it->second->path=path;
                 }
-                if (stbuf->st_size>0 ) {
-                        const int64_t blocks=stbuf->st_size/FAILSAFE_BLOCK_SIZE;
-                        const int64_t reducedblocks=blocks>0?blocks-1:0;
-                        res = pread(fd, &desc, sizeof(FailSafeDescription), reducedblocks*FAILSAFE_BLOCK_SIZE);
-                        stbuf->st_size=desc.mOffset;
-                        if (!checkDescConsistency(desc)) {
-                                close(fd);
-                                return -EIO;
+        }
+
+        /*!
+         * drops lookups the kernel forgot, the descriptor of the backing
+         * file is closed with the last one
+         * @param inode inode the kernel forgets
+         * @param count number of lookups
+         */
+        void forget(InodeStruct* inode,uint64_t count) {
+                Shard& shard=shardOf(inode->key);
+                Mutex mutex(shard.mutex);
+                inode->lookups-=std::min(count,inode->lookups);
+                if (inode->lookups==0) {
+                        close(inode->pathFd);
+                        inode->pathFd=-1;
+                        if (idle(*inode))
+                                makeIdle(shard);
+                }
+        }
+
+private:
+        struct Shard {
+                Shard() :
+                                mutex(), inodes(), idle(0) {
+                        pthread_mutex_init(&mutex,NULL);
+                }
+
+                pthread_mutex_t mutex;
+                std::map<InodeKey,InodeStruct*> inodes;
+                /// Number of entries neither known by the kernel nor referenced
+                int idle;
+        };
+
+        static bool idle(const InodeStruct& inode) {
+                return inode.openCount==0 && inode.lookups==0;
+        }
+
+        /// finds or creates an entry, an idle one stops being idle (called with the shard mutex held)
+        static InodeStruct* find(Shard& shard,const InodeKey& key) {
+                InodeStruct*& inode=shard.inodes[key];
+                if (inode==NULL)
+                        inode=new InodeStruct(key);
+                else if (idle(*inode))
+                        --shard.idle;
+                return inode;
+        }
+
+        /// counts a new idle entry and evicts half of them if there are too many
+        static void makeIdle(Shard& shard) {
+                if (++shard.idle<=INODE_TABLE_IDLE_PER_SHARD)
+                        return;
+                std::map<InodeKey,InodeStruct*>::iterator it=shard.inodes.begin();
+                while (it!=shard.inodes.end() && shard.idle>INODE_TABLE_IDLE_PER_SHARD/2) {
+                        if (idle(*(it->second))) {
+                                delete it->second;
+                                shard.inodes.erase(it++);
+                                --shard.idle;
+                        } else {
+                                ++it;
                         }
                 }
-                close(fd);
         }
-        if (res == -1)
-                return -errno;
 
-        return 0;
+        Shard& shardOf(const InodeKey& key) {
+                uint64_t h=static_cast<uint64_t>(key.ino)*0x9E3779B97F4A7C15ULL^static_cast<uint64_t>(key.dev);
+                return mShards[(h>>32)%INODE_TABLE_SHARDS];
+        }
+
+        Shard mShards[INODE_TABLE_SHARDS];
+};
+
+InodeTable inodes;
+
+/// Number of independently locked attribute cache shards
+#define ATTR_CACHE_SHARDS 16
+
+/// Decoded descriptions kept per attribute cache shard
+#define ATTR_CACHE_PER_SHARD 4096
+
+/*!
+ *  Logical file sizes decoded from description blocks, an entry is valid
+ *  while the backing file keeps the version it was decoded from
+ */
+class AttrCache
+{
+public:
+        AttrCache() :
+                        mShards() {
+        }
+
+        /*!
+         * finds the logical size of a backing file version
+         * @param key identity of the backing file
+         * @param stamp current version of the backing file
+         * @param size receives the logical size
+         * @return false if the version was not decoded yet
+         */
+        bool lookup(const InodeKey& key,const FileStamp& stamp,off_t& size) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                std::map<InodeKey,Entry>::const_iterator it=shard.entries.find(key);
+                if (it==shard.entries.end() || !(it->second.stamp==stamp))
+                        return false;
+                size=it->second.size;
+                return true;
+        }
+
+        /*!
+         * stores the logical size of a backing file version, a full shard
+         * drops half of its entries
+         */
+        void insert(const InodeKey& key,const FileStamp& stamp,off_t size) {
+                Shard& shard=shardOf(key);
+                Mutex mutex(shard.mutex);
+                if (shard.entries.size()>=ATTR_CACHE_PER_SHARD) {
+                        std::map<InodeKey,Entry>::iterator it=shard.entries.begin();
+                        for (size_t i=0;i<ATTR_CACHE_PER_SHARD/2;++i)
+                                shard.entries.erase(it++);
+                }
+                Entry& entry=shard.entries[key];
+                entry.stamp=stamp;
+                entry.size=size;
+        }
+
+private:
+        struct Entry {
+                FileStamp stamp;
+                off_t size;
+        };
+
+        struct Shard {
+                Shard() :
+                                mutex(), entries() {
+                        pthread_mutex_init(&mutex,NULL);
+                }
+
+                pthread_mutex_t mutex;
+                std::map<InodeKey,Entry> entries;
+        };
+
+        Shard& shardOf(const InodeKey& key) {
+                uint64_t h=static_cast<uint64_t>(key.ino)*0x9E3779B97F4A7C15ULL^static_cast<uint64_t>(key.dev);
+                return mShards[(h>>32)%ATTR_CACHE_SHARDS];
+        }
+
+        Shard mShards[ATTR_CACHE_SHARDS];
+};
+
+AttrCache attrCache;
+
+/*!
+ *  Mount options
+ */
+struct FailSafeOptions {
+        /// Number of worker threads building and verifying blocks (0: inline)
+        unsigned int hashThreads;
+        /// Name of the hash algorithm of new files
+        char* hashName;
+        /// Hash algorithm of new files (HashAlgorithm)
+        int hashAlgorithm;
+        /// Seconds after which verified blocks are checked again (0: never)
+        unsigned int verifyTrust;
+        /// Memory of the shared block cache in MiB (0: disabled)
+        unsigned int cacheSize;
+        /// Maximal readahead of sequential reads in KiB (0: disabled)
+        unsigned int readahead;
+        /// Files of at least this many MiB are read through a mapping (0: never)
+        unsigned int mmapMin;
+        /// Name of the block I/O engine
+        char* ioName;
+        /// Seconds between the flushes of dirty blocks (0: stored by every write)
+        unsigned int writeback;
+        /// Dirty blocks of all files in MiB above which writers store them
+        unsigned int dirtySize;
+        /// New files are covered by a Merkle tree instead of the hash chain
+        int merkle;
+        /// zlib level of new files, they are stored in compressed extents (0: not compressed)
+        unsigned int compress;
+        /// Block size of new files, other than 0 they are stored in version 2.00
+        unsigned int blockSize;
+        /// log2 of blockSize, 0 for version 1.00
+        int blockShift;
+        /// Backing files are opened with O_DIRECT, bypassing the page cache of the host
+        int directBacking;
+        /// Full blocks of new files are shared with other files of the same content
+        int dedup;
+        /// Backing tree verified per second in KiB by the scrubber (0: no scrubbing)
+        unsigned int scrubRate;
+        /// Saved position of the scrubber
+        char* scrubCursor;
+        /// Problems found by the scrubber are appended to it
+        char* scrubReport;
+        /// Spans kept per thread by the in-memory trace (0: disabled)
+        unsigned int trace;
+        /// The trace is written to it on TRACE_DUMP_SIGNAL
+        char* traceFile;
+        /// Seconds the kernel may cache attributes
+        double attrTimeout;
+        /// Seconds the kernel may cache name lookups
+        double entryTimeout;
+};
+
+FailSafeOptions options;
+
+/// Workers for header construction and block verification of large requests
+WorkerPool hashPool;
+
+/// Verified blocks shared by every open file
+BlockCache blockCache;
+
+PosixIO posixIO;
+#ifdef HAVE_IO_URING
+UringIO uringIO;
+#endif
+/// Stacked on the engine for O_DIRECT backing files (direct_backing)
+DirectIO directIO;
+/// Engine of the block reads and writes
+IOBackend* blockIO=&posixIO;
+
+/// Shared payloads of the files with FAILSAFE_FLAG_DEDUP
+DedupStore dedupStore;
+
+/// Requests with fewer blocks per worker are not split
+#define PARALLEL_HASH_MIN_BLOCKS 8
+
+/*!
+ * drops a reference to a mapping, the last one unmaps it (called with the
+ * inode's stateMutex held)
+ */
+inline void putMapping(FileMapping* mapping)
+{
+        if (--(mapping->refs)==0) {
+                munmap(const_cast<char*>(mapping->address),mapping->length);
+                delete mapping;
+        }
 }
 
-static int fs_access(const char *path, int mask)
+/*!
+ * detaches the mapping from the inode, running reads keep their reference
+ * (called with the inode's stateMutex held)
+ */
+inline void dropMapping(InodeStruct& inode)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = access(localpath.c_str(), mask);
-        if (res == -1)
-                return -errno;
+        if (inode.mapping) {
+                putMapping(inode.mapping);
+                inode.mapping=NULL;
+        }
+}
 
-        return 0;
+/*!
+ * drops the verification state of an inode if its backing file was
+ * changed by someone else or the trust interval expired
+ * (called with stateMutex held)
+ * @param inode inode to check
+ * @param stbuf current attributes of the backing file
+ */
+inline void checkInodeStamp(InodeStruct& inode,const struct stat& stbuf)
+{
+        const FileStamp stamp=stampOf(stbuf);
+        if (!(stamp==inode.stamp)) {
+                inode.stamp=stamp;
+                inode.generation=nextGeneration();
+                inode.verified.clear();
+                dropMapping(inode);
+        } else if (options.verifyTrust>0 && !inode.verified.empty() && time(NULL)-inode.verifiedSince>static_cast<time_t>(options.verifyTrust)) {
+                inode.verified.clear();
+        }
 }
 
-static int fs_readlink(const char *path, char *buf, size_t size)
+/*!
+ * forgets the verification and the cached copy of blocks written through
+ * this mount and adopts the resulting version of the backing file
+ * @param inode inode the blocks belong to
+ * @param fd descriptor the blocks were written through
+ * @param firstBlockNr first block written
+ * @param count number of blocks written
+ */
+inline void noteWrittenBlocks(InodeStruct& inode,int fd,int64_t firstBlockNr,int64_t count)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = readlink(localpath.c_str(), buf, size - 1);
-        if (res == -1)
-                return -errno;
+        struct stat stbuf;
+        blockCache.invalidate(inode.key.dev,inode.key.ino,firstBlockNr,count);
+        Mutex mutex(inode.stateMutex);
+        const int64_t end=firstBlockNr+count<static_cast<int64_t>(inode.verified.size())?firstBlockNr+count:inode.verified.size();
+        for (int64_t blockNr=firstBlockNr;blockNr<end;++blockNr)
+                inode.verified[blockNr]=false;
+        dropMapping(inode);
+        if (fstat(fd,&stbuf)==0)
+                inode.stamp=stampOf(stbuf);
+        else
+                inode.verified.clear();
+}
 
-        buf[res] = '\0';
-        return 0;
+/*!
+ * maps a large backing file for the mmap read path or reuses its current
+ * mapping (called with the inode's stateMutex held, after checkInodeStamp)
+ * @param inode inode of the file
+ * @param fd backing file
+ * @param stbuf current attributes of the backing file
+ * @return mapping with a reference for the caller, NULL if the file has
+ *         to be read with pread
+ */
+inline FileMapping* getMapping(InodeStruct& inode,int fd,const struct stat& stbuf)
+{
+        // files being written change under the mapping, they use pread
+        // a mapping would bring the file into the page cache again
+        if (options.mmapMin==0 || options.directBacking || inode.writers>0 || stbuf.st_size<(static_cast<off_t>(options.mmapMin)<<20))
+                return NULL;
+        if (inode.mapping==NULL || !(inode.mapping->stamp==inode.stamp)) {
+                dropMapping(inode);
+                void* address=mmap(NULL,stbuf.st_size,PROT_READ,MAP_SHARED,fd,0);
+                if (address==MAP_FAILED)
+                        return NULL;
+                madvise(address,stbuf.st_size,MADV_SEQUENTIAL);
+                FileMapping* mapping=new FileMapping;
+                mapping->address=static_cast<const char*>(address);
+                mapping->length=stbuf.st_size;
+                mapping->stamp=inode.stamp;
+                mapping->refs=1;
+                inode.mapping=mapping;
+        }
+        ++(inode.mapping->refs);
+        return inode.mapping;
 }
 
+/*!
+ *  Reference of a read to a mapping, given back when the read returns
+ */
+class MappingRef
+{
+public:
+        MappingRef(InodeStruct& inode,FileMapping* mapping) :
+                        mInode(inode), mMapping(mapping) {
+        }
+
+        ~MappingRef() {
+                if (mMapping) {
+                        Mutex mutex(mInode.stateMutex);
+                        putMapping(mMapping);
+                }
+        }
+
+        FileMapping* get() const {
+                return mMapping;
+        }
+
+private:
+        MappingRef(const MappingRef&);
+        MappingRef& operator=(const MappingRef&);
+
+        InodeStruct& mInode;
+        FileMapping* mMapping;
+};
 
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                      off_t offset, struct fuse_file_info *fi)
+/*!
+ *  Page aligned array of blocks for staging multi-block I/O
+ */
+class BlockBuffer
 {
-        // TODO: mutex
-        DIR *dp;
-        Mutex mutex(globalMutex);
-        struct dirent *de;
-        std::string localpath=basepath+std::string(path);
-        (void) offset;
-        (void) fi;
+public:
+        BlockBuffer(size_t count) :
+                        mBlocks(NULL) {
+                void* memory=NULL;
+                if (count>0 && posix_memalign(&memory,FAILSAFE_BLOCK_SIZE,count*sizeof(FailSafeStoreStruct))==0)
+                        mBlocks=static_cast<FailSafeStoreStruct*>(memory);
+        }
 
-        dp = opendir(localpath.c_str());
-        if (dp == NULL)
-                return -errno;
+        ~BlockBuffer() {
+                free(mBlocks);
+        }
 
-        while ((de = readdir(dp)) != NULL) {
-                struct stat st;
-                memset(&st, 0, sizeof(st));
-                st.st_ino = de->d_ino;
-                st.st_mode = de->d_type << 12;
-                if (filler(buf, de->d_name, &st, 0))
-                        break;
+        bool valid() const {
+                return mBlocks!=NULL;
+        }
+
+        FailSafeStoreStruct& operator[](size_t index) {
+                return mBlocks[index];
+        }
+
+private:
+        BlockBuffer(const BlockBuffer&);
+        BlockBuffer& operator=(const BlockBuffer&);
+
+        FailSafeStoreStruct* mBlocks;
+};
+
+inline CacheStruct& fileOf(struct fuse_file_info *fi)
+{
+        return *reinterpret_cast<CacheStruct*>(fi->fh);
+}
+
+/*!
+ *  /proc path of a descriptor for the system calls that take no descriptor
+ */
+class FdPath
+{
+public:
+        FdPath(int fd) :
+                        mPath() {
+                snprintf(mPath,sizeof(mPath),"/proc/self/fd/%d",fd);
+        }
+
+        const char* c_str() const {
+                return mPath;
+        }
+
+private:
+        char mPath[32];
+};
+
+/// Root directory of the backing tree, it is never forgotten
+InodeStruct* rootInode=NULL;
+
+inline InodeStruct& inodeOf(fuse_ino_t ino)
+{
+        if (ino==FUSE_ROOT_ID)
+                return *rootInode;
+        return *reinterpret_cast<InodeStruct*>(ino);
+}
+
+/*!
+ * the directory of the file system's own data is hidden in the root
+ */
+inline bool isMetaEntry(InodeStruct& parent,const char* name)
+{
+        return &parent==rootInode && strcmp(name,FAILSAFE_META_DIR)==0;
+}
+
+inline std::string pathOf(InodeStruct& inode)
+{
+        Mutex mutex(inode.stateMutex);
+        return inode.path;
+}
+
+/*!
+ * replaces the physical size of a regular file by the logical size
+ * recorded in its description block
+ * @param inode the file
+ * @param stbuf attributes of the backing file
+ */
+static int logicalSize(InodeStruct& inode,struct stat& stbuf)
+{
+        int res;
+        int fd;
+        FailSafeDescription desc;
+        if (!S_ISREG(stbuf.st_mode) || stbuf.st_size==0)
+                return 0;
+
+        // the description is only decoded once per version of the backing file
+        const InodeKey key= {stbuf.st_dev,stbuf.st_ino};
+        const FileStamp stamp=stampOf(stbuf);
+        off_t size;
+        if (!attrCache.lookup(key,stamp,size)) {
+                fd = open(FdPath(inode.pathFd).c_str(), O_RDONLY);
+                if (fd == -1) {
+                        return -errno;
+                }
+                const int64_t blocks=stbuf.st_size/FAILSAFE_BLOCK_SIZE;
+                const int64_t reducedblocks=blocks>0?blocks-1:0;
+                res = pread(fd, &desc, sizeof(FailSafeDescription), reducedblocks*FAILSAFE_BLOCK_SIZE);
+                if (res == -1) {
+                        res = -errno;
+                        close(fd);
+                        return res;
+                }
+                close(fd);
+                if (!checkDescConsistency(desc)) {
+                        statistics.hashFailures(1);
+                        return -EIO;
+                }
+                size=desc.mOffset;
+                attrCache.insert(key,stamp,size);
         }
+        stbuf.st_size=size;
+        return 0;
+}
+
+/*!
+ * attributes of an inode as seen through the mount
+ */
+static int inodeAttributes(InodeStruct& inode,struct stat& stbuf)
+{
+        if (fstatat(inode.pathFd, "", &stbuf, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW) == -1)
+                return -errno;
+        return logicalSize(inode,stbuf);
+}
 
-        closedir(dp);
+/*!
+ * resolves a name in a directory and counts the lookup
+ * @param parent directory
+ * @param name entry in the directory
+ * @param e receives the inode and its attributes
+ */
+static int lookupEntry(InodeStruct& parent,const char* name,struct fuse_entry_param& e)
+{
+        int res;
+        memset(&e, 0, sizeof(e));
+        if (isMetaEntry(parent, name))
+                return -ENOENT;
+        int fd = openat(parent.pathFd, name, O_PATH|O_NOFOLLOW);
+        if (fd == -1)
+                return -errno;
+        if (fstatat(fd, "", &e.attr, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW) == -1) {
+                res = -errno;
+                close(fd);
+                return res;
+        }
+        const InodeKey key= {e.attr.st_dev,e.attr.st_ino};
+        InodeStruct* inode=inodes.lookup(key,fd);
+        const std::string path=pathOf(parent)+"/"+name;
+        {
+                Mutex mutex(inode->stateMutex);
+                inode->path=path;
+        }
+        res=logicalSize(*inode,e.attr);
+        if (res) {
+                inodes.forget(inode,1);
+                return res;
+        }
+        e.ino=reinterpret_cast<fuse_ino_t>(inode);
+        e.attr_timeout=options.attrTimeout;
+        e.entry_timeout=options.entryTimeout;
         return 0;
 }
 
-static int fs_mknod(const char *path, mode_t mode, dev_t rdev)
+/*!
+ * creates a directory entry and looks it up
+ * @param parent directory
+ * @param name new entry
+ * @param mode type and permissions
+ * @param rdev device number of device nodes
+ * @param link target of symbolic links
+ * @param e receives the new inode
+ */
+static int makeNode(InodeStruct& parent, const char *name, mode_t mode, dev_t rdev, const char* link, struct fuse_entry_param& e)
 {
         int res;
-        std::string localpath=basepath+std::string(path);
-        /* On Linux this could just be 'mknod(path, mode, rdev)' but this
-           is more portable */
         if (S_ISREG(mode)) {
-                res = open(localpath.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
+                res = openat(parent.pathFd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
                 if (res >= 0)
                         res = close(res);
-        } else if (S_ISFIFO(mode))
-                res = mkfifo(localpath.c_str(), mode);
+        } else if (S_ISDIR(mode))
+                res = mkdirat(parent.pathFd, name, mode);
+        else if (S_ISLNK(mode))
+                res = symlinkat(link, parent.pathFd, name);
+        else if (S_ISFIFO(mode))
+                res = mkfifoat(parent.pathFd, name, mode);
         else
-                res = mknod(localpath.c_str(), mode, rdev);
+                res = mknodat(parent.pathFd, name, mode, rdev);
         if (res == -1)
                 return -errno;
 
+        return lookupEntry(parent, name, e);
+}
+
+/*!
+ * prepares the read of a run of consecutive blocks
+ * @param request transfer to fill
+ * @param iov buffer descriptor used by the request
+ * @param fd backing file
+ * @param blocks destination buffer
+ * @param count number of blocks
+ * @param blockNr number of the first block of the run
+ */
+inline void prepareBlockRun(IORequest& request,struct iovec& iov,int fd,FailSafeStoreStruct* blocks,int64_t count,int64_t blockNr)
+{
+        iov.iov_base=blocks;
+        iov.iov_len=count*FAILSAFE_BLOCK_SIZE;
+        request.fd=fd;
+        request.write=false;
+        request.iov=&iov;
+        request.iovcnt=1;
+        request.offset=blockNr*FAILSAFE_BLOCK_SIZE;
+        request.result=0;
+}
+
+/*!
+ * reads a range of a backing file through the block I/O engine, which
+ * takes care of the alignment required by O_DIRECT descriptors
+ * @return bytes read (less at the end of the file) or -errno
+ */
+inline ssize_t readRange(int fd,void* buffer,size_t length,off_t offset)
+{
+        struct iovec iov= {buffer,length};
+        IORequest request= {fd,false,&iov,1,offset,0};
+        blockIO->run(&request,1);
+        return request.result;
+}
+
+/*!
+ * reads a run of consecutive blocks as one transfer
+ * @param fd backing file
+ * @param blocks destination buffer
+ * @param count number of blocks
+ * @param blockNr number of the first block of the run
+ * @return number of whole blocks read (less at the end of the file) or -errno
+ */
+inline int readBlockRun(int fd,FailSafeStoreStruct* blocks,int64_t count,int64_t blockNr)
+{
+        TraceSpan span(TRACE_BLOCK_READ,blockNr);
+        IORequest request;
+        struct iovec iov;
+        prepareBlockRun(request,iov,fd,blocks,count,blockNr);
+        blockIO->run(&request,1);
+        return request.result<0?request.result:request.result/FAILSAFE_BLOCK_SIZE;
+}
+
+/*!
+ * reads a block of an inode, a dirty block is taken as it is, others are
+ * verified (called with the inode's lock held)
+ * @param inode inode of the block
+ * @param fd backing file
+ * @param block destination
+ * @param blockNr number of the block
+ */
+inline int readBlock(InodeStruct& inode,int fd,FailSafeStoreStruct & block, int64_t blockNr)
+{
+        int res=0;
+
+        const FailSafeStoreStruct* dirty=inode.dirty.find(blockNr);
+        if (dirty) {
+                memcpy(&block,dirty,sizeof(FailSafeStoreStruct));
+                return 0;
+        }
+
+        uint64_t generation;
+        {
+                Mutex mutex(inode.stateMutex);
+                generation=inode.generation;
+        }
+        const BlockKey key= {inode.key.dev,inode.key.ino,blockNr};
+        CachedBlock* cached=blockCache.lookup(key,generation);
+        if (cached) {
+                memcpy(&block,&(cached->block),sizeof(FailSafeStoreStruct));
+                blockCache.release(cached);
+        } else {
+                res = readBlockRun(fd, &block, 1, blockNr);
+                if (res<0)
+                        return res;
+                TraceSpan span(TRACE_BLOCK_VERIFY,blockNr);
+                if (res==0 || !checkConsistency(block)) {
+                        statistics.hashFailures(1);
+                        return -EIO;
+                }
+                blockCache.insert(key,generation,block);
+        }
+
         return 0;
 }
 
-static int fs_mkdir(const char *path, mode_t mode)
+/*!
+ * writes a run of consecutive blocks as one vectored transfer
+ * @param fd backing file
+ * @param iov block buffers in on-disk order
+ * @param iovcnt number of entries in iov
+ * @param blockNr number of the first block of the run
+ */
+inline int writeBlockRun(int fd,struct iovec* iov,int iovcnt,int64_t blockNr)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = mkdir(localpath.c_str(), mode);
-        if (res == -1)
-                return -errno;
+        TraceSpan span(TRACE_BLOCK_WRITE,blockNr);
+        IORequest request= {fd,true,iov,iovcnt,blockNr*FAILSAFE_BLOCK_SIZE,0};
+        blockIO->run(&request,1);
+        return request.result<0?request.result:0;
+}
+
+/*!
+ * writes a single block
+ * @param fd backing file
+ * @param block data or description block
+ * @param blockNr position of the block
+ */
+inline int writeBlock(int fd,void* block,int64_t blockNr)
+{
+        struct iovec iov= {block,FAILSAFE_BLOCK_SIZE};
+        return writeBlockRun(fd,&iov,1,blockNr);
+}
 
+/*!
+ * reads and verifies the extent of a compressed chunk
+ * @param fd backing file
+ * @param extent COMPRESS_CHUNK_BLOCKS blocks
+ * @param chunkNr number of the chunk
+ */
+static int readChunk(int fd,FailSafeStoreStruct* extent,int64_t chunkNr)
+{
+        const int read=readBlockRun(fd,extent,COMPRESS_CHUNK_BLOCKS,chunkNr*COMPRESS_CHUNK_BLOCKS);
+        if (read<0)
+                return read;
+        if (read==0 || !checkExtentConsistency(extent,read) || extent->mBlockCounter!=chunkNr) {
+                statistics.hashFailures(1);
+                return -EIO;
+        }
         return 0;
 }
 
-static int fs_unlink(const char *path)
-{
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = unlink(localpath.c_str());
-        if (res == -1)
-                return -errno;
+/*!
+ *  Shared state of a parallel verification of blocks of version 2.00
+ */
+struct LargeVerifyContext {
+        const FailSafeStoreStruct* headers;
+        const char* payloads;
+        /// Reads of the header and payload of every block
+        const IORequest* requests;
+        int64_t firstBlockNr;
+        int shift;
+        int failures;
+};
+
+/*!
+ * verifies blocks read by readLargeBlocks
+ */
+static void verifyLargeBlocks(void* context,size_t begin,size_t end)
+{
+        TraceSpan span(TRACE_BLOCK_VERIFY,end-begin);
+        LargeVerifyContext* verify=static_cast<LargeVerifyContext*>(context);
+        const int64_t blockSize=static_cast<int64_t>(1)<<verify->shift;
+        for (size_t i=begin;i<end;++i) {
+                const FailSafeStoreStruct& header=verify->headers[i];
+                const IORequest* requests=&(verify->requests[2*i]);
+                if (requests[0].result<FAILSAFE_HEADER_SIZE || header.mBlockCounter!=verify->firstBlockNr+static_cast<int64_t>(i) ||
+                                requests[1].result<header.mSizeOfDataInCurrentBlock ||
+                                !checkLargeConsistency(header,verify->payloads+(static_cast<int64_t>(i)<<verify->shift),blockSize))
+                        __sync_fetch_and_add(&(verify->failures),1);
+        }
+}
+
+/*!
+ * reads and verifies a run of blocks of version 2.00, every header and
+ * payload is a transfer of its own, they are submitted together
+ * @param fd backing file
+ * @param mapFd block map of a file with FAILSAFE_FLAG_DEDUP, -1 if every payload is in the backing file
+ * @param headers destination of the headers, one FailSafeStoreStruct each
+ * @param payloads destination of count blocks of 2^Shift bytes
+ * @param count number of blocks
+ * @param firstBlockNr number of the first block
+ */
+template<int Shift>
+static int readLargeBlocks(int fd,int mapFd,FailSafeStoreStruct* headers,char* payloads,int64_t count,int64_t firstBlockNr)
+{
+        typedef BlockGeometry<Shift> Geometry;
+        // shared payloads are read from their slots
+        std::vector<int64_t> slots(mapFd>=0?count:0);
+        int extentFd=-1;
+        if (mapFd>=0) {
+                const int res=readDedupMap(mapFd,firstBlockNr,count,&slots[0]);
+                if (res)
+                        return res;
+                extentFd=dedupStore.extentFd(Shift);
+                if (extentFd<0)
+                        return extentFd;
+        }
+        std::vector<IORequest> requests(2*count);
+        std::vector<struct iovec> iovs(2*count);
+        for (int64_t i=0;i<count;++i) {
+                iovs[2*i].iov_base=&headers[i];
+                iovs[2*i].iov_len=FAILSAFE_HEADER_SIZE;
+                iovs[2*i+1].iov_base=payloads+(i<<Shift);
+                iovs[2*i+1].iov_len=Geometry::PAYLOAD_SIZE;
+                IORequest header= {fd,false,&iovs[2*i],1,Geometry::headerOffset(firstBlockNr+i),0};
+                IORequest payload= {fd,false,&iovs[2*i+1],1,Geometry::dataOffset(firstBlockNr+i),0};
+                if (mapFd>=0 && slots[i]>0) {
+                        payload.fd=extentFd;
+                        payload.offset=(slots[i]-1)<<Shift;
+                }
+                requests[2*i]=header;
+                requests[2*i+1]=payload;
+        }
+        {
+                TraceSpan span(TRACE_BLOCK_READ,firstBlockNr);
+                blockIO->run(&requests[0],requests.size());
+        }
+        for (size_t r=0;r<requests.size();++r)
+                if (requests[r].result<0)
+                        return requests[r].result;
+        LargeVerifyContext verify= {headers,payloads,&requests[0],firstBlockNr,Shift,0};
+        // a block of 2^Shift bytes costs as much to hash as 2^(Shift-12) blocks of version 1.00
+        hashPool.parallelFor(count,std::max(PARALLEL_HASH_MIN_BLOCKS>>(Shift-12),1),verifyLargeBlocks,&verify);
+        if (verify.failures>0) {
+                statistics.hashFailures(verify.failures);
+                return -EIO;
+        }
+        return 0;
+}
+
+/*!
+ * reads the header of a block of version 2.00 without its payload, its
+ * hash is only taken as the link of the following block
+ */
+template<int Shift>
+static int readLargeHeader(int fd,FailSafeStoreStruct& header,int64_t blockNr)
+{
+        const ssize_t res=readRange(fd,&header,FAILSAFE_HEADER_SIZE,BlockGeometry<Shift>::headerOffset(blockNr));
+        if (res<0)
+                return res;
+        if (res<FAILSAFE_HEADER_SIZE || memcmp(header.mSignature,FSSignature,sizeof(header.mSignature))!=0 ||
+                        blockShiftOf(header)!=Shift || header.mBlockCounter!=blockNr) {
+                statistics.hashFailures(1);
+                return -EIO;
+        }
+        return 0;
+}
+
+/// Blocks stored by one transfer of a flush
+#define FLUSH_RUN_BLOCKS 256
+
+/// Placeholder predecessor of dirty blocks, they are linked when flushed
+static const FailSafeStoreStruct unlinkedBlock=FailSafeStoreStruct();
+
+/*!
+ *  Inodes with dirty blocks and the thread storing them periodically
+ *
+ *  Every registered inode holds a reference in the inode table until its
+ *  dirty blocks are stored.
+ */
+class WriteBack
+{
+public:
+        typedef void* (*Thread)(void* argument);
+
+        WriteBack() :
+                        mMutex(), mCondition(), mInodes(), mThread(), mRunning(false), mStopping(false), mUrgent(false) {
+                pthread_mutex_init(&mMutex,NULL);
+                pthread_cond_init(&mCondition,NULL);
+        }
+
+        ~WriteBack() {
+                pthread_cond_destroy(&mCondition);
+                pthread_mutex_destroy(&mMutex);
+        }
+
+        /*!
+         * registers an inode that got its first dirty block
+         */
+        void add(InodeStruct* inode) {
+                inodes.acquire(inode->key);
+                Mutex mutex(mMutex);
+                mInodes.insert(inode);
+        }
+
+        /*!
+         * unregisters an inode whose dirty blocks were stored, the caller
+         * must hold another reference to it
+         */
+        void remove(InodeStruct* inode) {
+                {
+                        Mutex mutex(mMutex);
+                        mInodes.erase(inode);
+                }
+                inodes.release(inode->key);
+        }
+
+        /*!
+         * the registered inodes, each with a reference the caller gives
+         * back by InodeTable::release
+         */
+        std::vector<InodeStruct*> pin() {
+                Mutex mutex(mMutex);
+                std::vector<InodeStruct*> result(mInodes.begin(),mInodes.end());
+                for (size_t i=0;i<result.size();++i)
+                        inodes.acquire(result[i]->key);
+                return result;
+        }
+
+        void start(Thread thread) {
+                mStopping=false;
+                mRunning=(pthread_create(&mThread,NULL,thread,NULL)==0);
+        }
+
+        /*!
+         * asks the thread for a last flush and waits for it
+         */
+        void stop() {
+                {
+                        Mutex mutex(mMutex);
+                        mStopping=true;
+                        pthread_cond_signal(&mCondition);
+                }
+                if (mRunning)
+                        pthread_join(mThread,NULL);
+                mRunning=false;
+        }
+
+        /*!
+         * starts a flush before the period expires (memory pressure)
+         */
+        void wakeup() {
+                Mutex mutex(mMutex);
+                mUrgent=true;
+                pthread_cond_signal(&mCondition);
+        }
+
+        /*!
+         * waits for the next flush
+         * @param seconds period of the flushes
+         * @return false when the thread has to stop
+         */
+        bool wait(unsigned int seconds) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME,&deadline);
+                deadline.tv_sec+=seconds;
+                Mutex mutex(mMutex);
+                while (!mStopping && !mUrgent && pthread_cond_timedwait(&mCondition,&mMutex,&deadline)!=ETIMEDOUT)
+                        ;
+                mUrgent=false;
+                return !mStopping;
+        }
+
+private:
+        WriteBack(const WriteBack&);
+        WriteBack& operator=(const WriteBack&);
+
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCondition;
+        std::set<InodeStruct*> mInodes;
+        pthread_t mThread;
+        bool mRunning;
+        bool mStopping;
+        bool mUrgent;
+};
+
+WriteBack writeBack;
+
+/// Dirty blocks of all inodes above which writers store their own
+inline uint64_t dirtyLimit()
+{
+        return (static_cast<uint64_t>(options.dirtySize)<<20)/FAILSAFE_BLOCK_SIZE;
+}
+
+/*!
+ * opens the Merkle tree of an inode and counts its leaves if they are not
+ * known (called with the inode's lock held exclusively)
+ * @param inode inode of a file with FAILSAFE_FLAG_MERKLE
+ * @param fd backing file
+ */
+static int openMerkleTree(InodeStruct& inode,int fd)
+{
+        if (inode.merkleFd<0) {
+                mkdirat(rootInode->pathFd,FAILSAFE_META_DIR,0700);
+                mkdirat(rootInode->pathFd,MERKLE_DIR,0700);
+                inode.merkleFd=openat(rootInode->pathFd,merklePath(inode.key.dev,inode.key.ino).c_str(),O_RDWR|O_CREAT,0600);
+                if (inode.merkleFd<0)
+                        return -errno;
+        }
+        if (inode.merkleLeaves<0) {
+                // the leaves stored before are counted by the description
+                struct stat stbuf;
+                if (fstat(fd,&stbuf)==-1)
+                        return -errno;
+                FailSafeDescription desc;
+                inode.merkleLeaves=stbuf.st_size/FAILSAFE_BLOCK_SIZE;
+                if (stbuf.st_size>=FAILSAFE_BLOCK_SIZE && readRange(fd,&desc,sizeof(desc),stbuf.st_size-FAILSAFE_BLOCK_SIZE)==static_cast<ssize_t>(sizeof(desc)) &&
+                    checkDescConsistency(desc))
+                        inode.merkleLeaves=desc.mBlockCounter;
+        }
+        return 0;
+}
+
+/*!
+ * removes the Merkle tree and the block map of a backing file without a
+ * name and without open handles, its shared payloads are given back
+ */
+static void removeFileMeta(dev_t dev,ino_t ino)
+{
+        unlinkat(rootInode->pathFd,merklePath(dev,ino).c_str(),0);
+        dedupStore.truncateMap(dev,ino,0);
+}
+
+#ifndef FAILSAFE_NO_MAIN
+/*!
+ * removes the side data of a backing file that lost its last name, a file
+ * still open keeps it readable until its last handle is released
+ */
+static void dropFileMeta(const struct stat& stbuf)
+{
+        if (!S_ISREG(stbuf.st_mode) || stbuf.st_nlink>1)
+                return;
+        const InodeKey key= {stbuf.st_dev,stbuf.st_ino};
+        if (!inodes.unlinkedWhileOpen(key))
+                removeFileMeta(stbuf.st_dev,stbuf.st_ino);
+}
+#endif
+
+/*!
+ * opens the block map of a file with FAILSAFE_FLAG_DEDUP on first use
+ * @param inode the file
+ * @param shift log2 of its block size
+ * @param create the map of a file being written is created
+ * @param mapFd receives the map, -1 if there is none and create is false
+ * @return 0 or -errno
+ */
+static int dedupMapOf(InodeStruct& inode,int shift,bool create,int& mapFd)
+{
+        Mutex mutex(inode.stateMutex);
+        if (inode.dedupFd<0) {
+                const int fd=dedupStore.openMap(inode.key.dev,inode.key.ino,shift,create);
+                if (fd==-ENOENT && !create) {
+                        mapFd=-1;
+                        return 0;
+                }
+                if (fd<0)
+                        return fd;
+                inode.dedupFd=fd;
+        }
+        mapFd=inode.dedupFd;
+        return 0;
+}
+
+/*!
+ * hashes dirty blocks of a Merkle tree, they do not depend on each other
+ * @param context the vector of the dirty blocks
+ */
+static void hashDirtyBlocks(void* context,size_t begin,size_t end)
+{
+        const std::vector<DirtyBlocks::iterator>& blocks=*static_cast<std::vector<DirtyBlocks::iterator>*>(context);
+        for (size_t i=begin;i<end;++i)
+                calculateHASH(*(blocks[i]->second));
+}
+
+/*!
+ * links, hashes and stores the dirty blocks of an inode, consecutive
+ * blocks are written together and the runs are submitted as one batch
+ * (called with the inode's lock held exclusively)
+ * @param inode inode to flush, the caller holds a reference to it
+ */
+static int flushDirty(InodeStruct& inode)
+{
+        TraceSpan span(TRACE_FLUSH,inode.key.ino);
+        int res=0;
+        const int fd=inode.dirtyFd;
+        if (!inode.dirty.empty()) {
+                uint64_t generation;
+                {
+                        Mutex mutex(inode.stateMutex);
+                        generation=inode.generation;
+                }
+                std::vector<DirtyBlocks::iterator> blocks;
+                const bool merkle=(formatFlagsOf(*(inode.dirty.begin()->second))&FAILSAFE_FLAG_MERKLE)!=0;
+                if (merkle) {
+                        // blocks of a Merkle tree only take the identity of the file from block 0
+                        FailSafeStoreStruct first DIRECT_IO_ALIGNED;
+                        // the identity is kept for the next flushes, appends do not read block 0
+                        const FailSafeStoreStruct* identity=inode.dirty.find(0);
+                        if (identity)
+                                inode.chainTail.keepIdentity(generation,*identity);
+                        else
+                                identity=inode.chainTail.identity(generation);
+                        if (identity==NULL && inode.dirty.begin()->first>0) {
+                                res=readBlock(inode,fd,first,0);
+                                if (res)
+                                        return res;
+                                identity=&first;
+                                inode.chainTail.keepIdentity(generation,first);
+                        }
+                        for (DirtyBlocks::iterator it=inode.dirty.begin();it!=inode.dirty.end();++it) {
+                                if (it->first>0)
+                                        adoptFileIdentity(*(it->second),*identity);
+                                blocks.push_back(it);
+                        }
+                        hashPool.parallelFor(blocks.size(),PARALLEL_HASH_MIN_BLOCKS,hashDirtyBlocks,&blocks);
+                } else {
+                        // the chain is linked in block order, a run continues the stored block before it
+                        FailSafeStoreStruct before DIRECT_IO_ALIGNED;
+                        const FailSafeStoreStruct* prev=NULL;
+                        for (DirtyBlocks::iterator it=inode.dirty.begin();it!=inode.dirty.end();++it) {
+                                const int64_t blockNr=it->first;
+                                FailSafeStoreStruct& block=*(it->second);
+                                if (blockNr>0 && (prev==NULL || blocks.back()->first!=blockNr-1)) {
+                                        // an append continues the block stored last without reading it
+                                        prev=inode.chainTail.predecessor(blockNr,generation);
+                                        if (prev==NULL) {
+                                                res=readBlock(inode,fd,before,blockNr-1);
+                                                if (res)
+                                                        return res;
+                                                prev=&before;
+                                        }
+                                }
+                                if (blockNr>0)
+                                        linkBlock(block,*prev);
+                                calculateHASH(block);
+                                prev=&block;
+                                blocks.push_back(it);
+                        }
+                }
+
+                std::vector<struct iovec> iovs(blocks.size());
+                std::vector<IORequest> requests;
+                std::vector<size_t> runStarts;
+                for (size_t i=0;i<blocks.size();++i) {
+                        iovs[i].iov_base=blocks[i]->second;
+                        iovs[i].iov_len=FAILSAFE_BLOCK_SIZE;
+                        if (i==0 || blocks[i]->first!=blocks[i-1]->first+1 || requests.back().iovcnt==FLUSH_RUN_BLOCKS) {
+                                IORequest request= {fd,true,&iovs[i],0,blocks[i]->first*FAILSAFE_BLOCK_SIZE,0};
+                                requests.push_back(request);
+                                runStarts.push_back(i);
+                        }
+                        ++(requests.back().iovcnt);
+                }
+                {
+                        TraceSpan span(TRACE_BLOCK_WRITE,blocks[0]->first);
+                        blockIO->run(&requests[0],requests.size());
+                }
+
+                // the stored blocks are new leaves of the tree
+                if (merkle) {
+                        std::vector<std::pair<int64_t,const char*> > leaves;
+                        for (size_t r=0;r<requests.size();++r)
+                                if (requests[r].result>=0)
+                                        for (size_t i=runStarts[r];i<runStarts[r]+requests[r].iovcnt;++i)
+                                                leaves.push_back(std::make_pair(blocks[i]->first,blocks[i]->second->mCurrentHash));
+                        int merkleRes=openMerkleTree(inode,fd);
+                        if (merkleRes==0 && !leaves.empty()) {
+                                inode.merkleLeaves=std::max(inode.merkleLeaves,leaves.back().first+1);
+                                char root[MERKLE_HASH_SIZE];
+                                merkleRes=MerkleTree(inode.merkleFd,hashAlgorithmOf(*(blocks[0]->second))).update(leaves,inode.merkleLeaves,root);
+                        }
+                        if (merkleRes<0)
+                                res=merkleRes;
+                }
+
+                // stored blocks are known to be valid, they go to the shared cache
+                for (size_t r=0;r<requests.size();++r) {
+                        const size_t begin=runStarts[r];
+                        const size_t end=begin+requests[r].iovcnt;
+                        if (requests[r].result<0) {
+                                res=requests[r].result;
+                                inode.chainTail.clear();
+                                continue;
+                        }
+                        noteWrittenBlocks(inode,fd,blocks[begin]->first,end-begin);
+                        inode.chainTail.keep(blocks[end-1]->first,generation,*(blocks[end-1]->second),NULL);
+                        for (size_t i=begin;i<end;++i) {
+                                const BlockKey key= {inode.key.dev,inode.key.ino,blocks[i]->first};
+                                blockCache.insert(key,generation,*(blocks[i]->second));
+                                inode.dirty.erase(blocks[i]);
+                        }
+                }
+        }
+        if (inode.dirty.empty() && inode.dirtyFd>=0) {
+                close(inode.dirtyFd);
+                inode.dirtyFd=-1;
+                writeBack.remove(&inode);
+        }
+        return res;
+}
+
+/*!
+ * stores the dirty blocks of every inode
+ */
+static void flushAllDirty()
+{
+        std::vector<InodeStruct*> pinned=writeBack.pin();
+        for (size_t i=0;i<pinned.size();++i) {
+                {
+                        WriteLock lock(pinned[i]->lock);
+                        flushDirty(*(pinned[i]));
+                }
+                inodes.release(pinned[i]->key);
+        }
+}
+
+/*!
+ * thread of the periodic flushes
+ */
+static void* writeBackThread(void* argument)
+{
+        (void) argument;
+        while (writeBack.wait(options.writeback))
+                flushAllDirty();
+        return NULL;
+}
+
+/// Background verification of the backing tree
+Scrubber scrubber;
+
+#ifndef FAILSAFE_NO_MAIN
+/*!
+ * the scrubber skips files open for writing, their chain is being changed
+ */
+static bool scrubBusy(const struct stat& stbuf)
+{
+        const InodeKey key= {stbuf.st_dev,stbuf.st_ino};
+        return inodes.writing(key);
+}
+
+/*!
+ * stores the dirty blocks and truncates the backing file of an inode
+ */
+static int truncateInode(InodeStruct& inode, off_t size)
+{
+        // readers must not touch a mapping that shrinks under them
+        WriteLock lock(inode.lock);
+        {
+                Mutex mutex(inode.stateMutex);
+                dropMapping(inode);
+        }
+        int res=flushDirty(inode);
+        if (res)
+                return res;
+        inode.chainTail.clear();
+        if (truncate(FdPath(inode.pathFd).c_str(), size) == -1)
+                return -errno;
+        inode.merkleLeaves=-1;
+        // the shared payloads of the blocks cut off are given back
+        res=dedupStore.truncateMap(inode.key.dev,inode.key.ino,size);
+        if (res)
+                return res;
+        if (size==0) {
+                Mutex mutex(inode.stateMutex);
+                if (inode.dedupFd>=0) {
+                        close(inode.dedupFd);
+                        inode.dedupFd=-1;
+                }
+        }
+        return 0;
+}
+#endif
+
+/// Source and verification state of the blocks of a read request
+enum ReadState {
+        /// Not found in the backing file
+        BLOCK_MISSING,
+        /// Read from the disk or the mapping, not verified yet
+        BLOCK_READ,
+        /// Read from the disk or the mapping, verified by an earlier read
+        BLOCK_TRUSTED,
+        /// Read from the disk or the mapping and verified now
+        BLOCK_CHECKED,
+        /// Found in the shared block cache
+        BLOCK_CACHED,
+        /// Dirty block of the inode, not stored yet
+        BLOCK_DIRTY
+};
+
+/*!
+ *  Shared state of a parallel block verification
+ */
+struct VerifyContext {
+        /// Where each block was found
+        const FailSafeStoreStruct** blocks;
+        /// ReadState of each block
+        std::vector<char>* state;
+        int failures;
+};
+
+/*!
+ * verifies blocks read by readBlockRun or found in the mapping
+ */
+static void verifyBlocks(void* context,size_t begin,size_t end)
+{
+        TraceSpan span(TRACE_BLOCK_VERIFY,end-begin);
+        VerifyContext* verify=static_cast<VerifyContext*>(context);
+        std::vector<char>& state=*(verify->state);
+        for (size_t i=begin;i<end;++i) {
+                if (state[i]==BLOCK_MISSING) {
+                        __sync_fetch_and_add(&(verify->failures),1);
+                } else if (state[i]==BLOCK_READ) {
+                        if (checkConsistency(*(verify->blocks[i])))
+                                state[i]=BLOCK_CHECKED;
+                        else
+                                __sync_fetch_and_add(&(verify->failures),1);
+                }
+        }
+}
+
+/*!
+ *  Blocks prefetched into the shared cache by a worker thread
+ */
+struct PrefetchContext {
+        /// Duplicate of the descriptor of the reading handle, closed by the task
+        int fd;
+        InodeKey key;
+        /// Reference taken from the inode table, given back by the task
+        InodeStruct* inode;
+        int64_t firstBlockNr;
+        int64_t count;
+};
+
+/*!
+ * reads and verifies a range of blocks into the shared cache, stops at
+ * the first block that fails so that the reader reports it
+ */
+static void prefetchBlocks(PrefetchContext& prefetch)
+{
+        InodeStruct& inode=*(prefetch.inode);
+        struct stat stbuf;
+        if (fstat(prefetch.fd,&stbuf)==-1)
+                return;
+        FileStamp stamp;
+        uint64_t generation;
+        {
+                Mutex mutex(inode.stateMutex);
+                checkInodeStamp(inode,stbuf);
+                stamp=inode.stamp;
+                generation=inode.generation;
+        }
+        BlockBuffer blocks(prefetch.count);
+        if (!blocks.valid())
+                return;
+        const int64_t read=readBlockRun(prefetch.fd,&blocks[0],prefetch.count,prefetch.firstBlockNr);
+        int64_t checked=0;
+        BlockKey key= {prefetch.key.dev,prefetch.key.ino,prefetch.firstBlockNr};
+        for (;checked<read && checkConsistency(blocks[checked]);++checked,++key.blockNr)
+                blockCache.insert(key,generation,blocks[checked]);
+
+        Mutex mutex(inode.stateMutex);
+        if (checked>0 && inode.stamp==stamp) {
+                if (inode.verified.empty())
+                        inode.verifiedSince=time(NULL);
+                if (static_cast<int64_t>(inode.verified.size())<prefetch.firstBlockNr+checked)
+                        inode.verified.resize(prefetch.firstBlockNr+checked,false);
+                for (int64_t i=0;i<checked;++i)
+                        inode.verified[prefetch.firstBlockNr+i]=true;
+        }
+}
+
+/*!
+ * worker task of readAhead
+ */
+static void prefetchTask(void* argument)
+{
+        PrefetchContext* prefetch=static_cast<PrefetchContext*>(argument);
+        InodeStruct& inode=*(prefetch->inode);
+        // never wait for a writer: blocking here could starve its parallel hashing
+        if (pthread_rwlock_tryrdlock(&inode.lock)==0) {
+                prefetchBlocks(*prefetch);
+                pthread_rwlock_unlock(&inode.lock);
+        }
+        __sync_lock_release(&inode.prefetching);
+        close(prefetch->fd);
+        inodes.release(prefetch->key);
+        delete prefetch;
+}
+
+/*!
+ * detects sequential reads of a handle and prefetches the blocks ahead of
+ * them, the window doubles with every sequential read and halves with
+ * every random one
+ * @param file handle of the read
+ * @param firstBlockNr first block of the request
+ * @param lastBlockNr last block of the request
+ * @param nextBlockNr block where a sequential continuation would start
+ * @param fileBlocks number of data blocks of the file
+ */
+static void readAhead(CacheStruct& file,int64_t firstBlockNr,int64_t lastBlockNr,int64_t nextBlockNr,int64_t fileBlocks)
+{
+        // without workers the prefetch would only delay the current read
+        if (options.readahead==0 || hashPool.threads()==0 || !blockCache.enabled())
+                return;
+        const int64_t maxWindow=static_cast<int64_t>(options.readahead)*1024/FAILSAFE_DATA_SIZE;
+        Mutex mutex(file.readaheadMutex);
+        const bool sequential=(firstBlockNr==file.nextBlockNr);
+        file.nextBlockNr=nextBlockNr;
+        if (!sequential) {
+                file.readaheadWindow/=2;
+                file.readaheadEnd=0;
+                return;
+        }
+        file.readaheadWindow=std::min(std::max(file.readaheadWindow*2,lastBlockNr-firstBlockNr+1),maxWindow);
+
+        const int64_t first=std::max(file.readaheadEnd,lastBlockNr+1);
+        const int64_t end=std::min(lastBlockNr+1+file.readaheadWindow,fileBlocks);
+        // prefetch in batches of at least half a window
+        if (end-first<std::max(file.readaheadWindow/2,static_cast<int64_t>(1)))
+                return;
+        InodeStruct& inode=*(file.inode);
+        if (__sync_lock_test_and_set(&inode.prefetching,1))
+                return;
+        const int fd=dup(file.fd);
+        if (fd==-1) {
+                __sync_lock_release(&inode.prefetching);
+                return;
+        }
+        PrefetchContext* prefetch=new PrefetchContext;
+        prefetch->fd=fd;
+        prefetch->key=file.key;
+        prefetch->inode=inodes.acquire(file.key);
+        prefetch->firstBlockNr=first;
+        prefetch->count=end-first;
+        file.readaheadEnd=end;
+        hashPool.submit(prefetchTask,prefetch);
+}
+
+/*!
+ * opens the backing file of an inode
+ * @param inode file to open
+ * @param flags open flags of the request
+ * @param handle receives the new handle
+ */
+static int openHandle(InodeStruct& inode, int flags, CacheStruct*& handle)
+{
+        int res;
+        // writers also read, partially overwritten blocks are merged
+        int openflags=O_RDONLY;
+        if ((flags&O_ACCMODE)!=O_RDONLY) openflags=O_RDWR;
+        res = open(FdPath(inode.pathFd).c_str(),openflags|(options.directBacking?O_DIRECT:0) );
+        // file systems without O_DIRECT are used through the page cache
+        if (res == -1 && errno == EINVAL && options.directBacking)
+                res = open(FdPath(inode.pathFd).c_str(),openflags );
+        if (res == -1) {
+                return -errno;
+        }
+        struct stat stbuf;
+        if (fstat(res,&stbuf)==-1) {
+                int err=errno;
+                close(res);
+                return -err;
+        }
+        CacheStruct* cachedItem=new CacheStruct();
+        cachedItem->fd=res;
+        cachedItem->key.dev=stbuf.st_dev;
+        cachedItem->key.ino=stbuf.st_ino;
+        cachedItem->inode=inodes.acquire(cachedItem->key);
+        {
+                Mutex mutex(cachedItem->inode->stateMutex);
+                checkInodeStamp(*(cachedItem->inode),stbuf);
+                cachedItem->writable=(openflags!=O_RDONLY);
+                ++(cachedItem->inode->handles);
+                if (cachedItem->writable)
+                        ++(cachedItem->inode->writers);
+        }
+        pthread_mutex_init(&(cachedItem->descMutex),NULL);
+        pthread_mutex_init(&(cachedItem->readaheadMutex),NULL);
+        cachedItem->nextBlockNr=0;
+        cachedItem->readaheadWindow=0;
+        cachedItem->readaheadEnd=0;
+        cachedItem->hasDesc=false;
+        cachedItem->lastWrittenBlockNr=-1;
+        handle=cachedItem;
+        return 0;
+}
+
+/*!
+ * loads the description of the file of a handle on its first read or
+ * write and resolves the format the handle writes: an existing file keeps
+ * its own, an empty one takes the format of the mount options
+ * (called with the handle's descMutex held)
+ * @return 0 or -errno
+ */
+static int loadDescription(CacheStruct& file)
+{
+        // an empty file has no blocks
+        FailSafeDescription desc=FailSafeDescription();
+        desc.mRevision=1;
+        file.hashAlgorithm=options.hashAlgorithm;
+        file.formatFlags=options.compress?FAILSAFE_FLAG_COMPRESSED:(options.merkle?FAILSAFE_FLAG_MERKLE:(options.dedup?FAILSAFE_FLAG_DEDUP:0));
+        file.blockShift=options.blockShift;
+        struct stat stbuf;
+        if (fstat(file.fd, &stbuf)==-1)
+                return -errno;
+        if (stbuf.st_size>FAILSAFE_BLOCK_SIZE) {
+                const int res=readRange(file.fd, &desc, FAILSAFE_BLOCK_SIZE, stbuf.st_size-FAILSAFE_BLOCK_SIZE);
+                if (res < 0)
+                        return res;
+                if (!checkDescConsistency(desc)) {
+                        statistics.hashFailures(1);
+                        return -EIO;
+                }
+                file.hashAlgorithm=hashAlgorithmOf(desc);
+                file.formatFlags=formatFlagsOf(desc);
+                file.blockShift=blockShiftOf(desc);
+        }
+        memcpy(&(file.desc),&desc,sizeof(desc));
+        file.hasDesc=true;
+        return 0;
+}
+
+/*!
+ * receives the data of a read as a vector pointing into the verified
+ * blocks, they are only valid until it returns
+ * @param context argument given to readHandle
+ * @param iov payload pieces in file order
+ * @param count number of pieces, 0 at the end of the file
+ * @return a non-negative value or -errno
+ */
+typedef int (*ReadSink)(void* context,const struct iovec* iov,int count);
+
+/*!
+ * reads and verifies the chunks of a compressed file covering a range,
+ * only these chunks are decompressed
+ * @param fd backing file
+ * @param size length of the range, it ends in the file
+ * @param offset start of the range
+ * @return result of the sink or -errno
+ */
+static int readCompressed(int fd, size_t size, off_t offset, ReadSink sink, void* context)
+{
+        const int64_t firstChunkNr=offset/COMPRESS_CHUNK_SIZE;
+        const int64_t count=(offset+size-1)/COMPRESS_CHUNK_SIZE-firstChunkNr+1;
+        // the unused blocks of the chunks are holes, reading them costs no disk I/O
+        BlockBuffer extents(count*COMPRESS_CHUNK_BLOCKS);
+        if (!extents.valid())
+                return -ENOMEM;
+        const int read=readBlockRun(fd,&extents[0],count*COMPRESS_CHUNK_BLOCKS,firstChunkNr*COMPRESS_CHUNK_BLOCKS);
+        if (read<0)
+                return read;
+        std::vector<char> data(count*COMPRESS_CHUNK_SIZE);
+        for (int64_t i=0;i<count;++i) {
+                const FailSafeStoreStruct* extent=&extents[i*COMPRESS_CHUNK_BLOCKS];
+                if (!checkExtentConsistency(extent,read-i*COMPRESS_CHUNK_BLOCKS) || extent->mBlockCounter!=firstChunkNr+i)
+                        return -EIO;
+                int res=decompressChunk(extent,&data[i*COMPRESS_CHUNK_SIZE]);
+                if (res)
+                        return res;
+        }
+        struct iovec iov= {&data[offset%COMPRESS_CHUNK_SIZE],size};
+        return sink(context,&iov,1);
+}
+
+/*!
+ * reads and verifies the blocks of a file of version 2.00 covering a
+ * range, the pieces handed to the sink point into their payloads
+ * @param fd backing file
+ * @param mapFd block map of a file with FAILSAFE_FLAG_DEDUP or -1
+ * @param size length of the range, it ends in the file
+ * @param offset start of the range
+ * @return result of the sink or -errno
+ */
+template<int Shift>
+static int readLarge(int fd, int mapFd, size_t size, off_t offset, ReadSink sink, void* context)
+{
+        typedef BlockGeometry<Shift> Geometry;
+        const int64_t firstBlockNr=Geometry::blockOf(offset);
+        const int64_t count=Geometry::blockOf(offset+size-1)-firstBlockNr+1;
+        BlockBuffer headers(count);
+        BlockBuffer payloads(count<<(Shift-12));
+        if (!headers.valid() || !payloads.valid())
+                return -ENOMEM;
+        char* data=reinterpret_cast<char*>(&payloads[0]);
+        int res=readLargeBlocks<Shift>(fd,mapFd,&headers[0],data,count,firstBlockNr);
+        if (res)
+                return res;
+        std::vector<struct iovec> iov(count);
+        int64_t localoffset=offset;
+        int64_t remain=size;
+        for (int64_t i=0;remain>0;++i) {
+                const int64_t start=Geometry::offsetInBlock(localoffset);
+                const int64_t transfer=std::min(remain,Geometry::PAYLOAD_SIZE-start);
+                // the file is longer than its blocks
+                if (start+transfer>headers[i].mSizeOfDataInCurrentBlock) {
+                        statistics.hashFailures(1);
+                        return -EIO;
+                }
+                iov[i].iov_base=data+(i<<Shift)+start;
+                iov[i].iov_len=transfer;
+                remain-=transfer;
+                localoffset+=transfer;
+        }
+        return sink(context,&iov[0],count);
+}
+
+/*!
+ * readLarge for the block size of a file
+ * @param shift log2 of the block size
+ */
+static int readLargeFile(int shift, int fd, int mapFd, size_t size, off_t offset, ReadSink sink, void* context)
+{
+        switch (shift) {
+        case 12:
+                return readLarge<12>(fd,mapFd,size,offset,sink,context);
+        case 13:
+                return readLarge<13>(fd,mapFd,size,offset,sink,context);
+        case 14:
+                return readLarge<14>(fd,mapFd,size,offset,sink,context);
+        case 15:
+                return readLarge<15>(fd,mapFd,size,offset,sink,context);
+        case 16:
+                return readLarge<16>(fd,mapFd,size,offset,sink,context);
+        case 17:
+                return readLarge<17>(fd,mapFd,size,offset,sink,context);
+        case 18:
+                return readLarge<18>(fd,mapFd,size,offset,sink,context);
+        case 19:
+                return readLarge<19>(fd,mapFd,size,offset,sink,context);
+        case 20:
+                return readLarge<20>(fd,mapFd,size,offset,sink,context);
+        }
+        return -EIO;
+}
+
+/*!
+ * reads and verifies data of an open file and hands it to a sink without
+ * copying it
+ * @return result of the sink or -errno
+ */
+static int readHandle(CacheStruct& file, size_t size, off_t offset, ReadSink sink, void* context)
+{
+        ReadLock lock(file.inode->lock);
+        int fd=file.fd;
+        int res;
+
+        Mutex descMutex(file.descMutex);
+        if (file.hasDesc==false) {
+                res=loadDescription(file);
+                if (res)
+                        return res;
+        }
+        const int64_t filesize=file.desc.mOffset;
+        const int formatFlags=file.formatFlags;
+        const bool compressed=(formatFlags&FAILSAFE_FLAG_COMPRESSED)!=0;
+        const int blockShift=file.blockShift;
+        descMutex.unlock();
+
+        if (offset>=filesize || size==0)
+                return sink(context,NULL,0);
+        if (static_cast<int64_t>(offset+size)>filesize)
+                size=filesize-offset;
+        if (compressed)
+                return readCompressed(fd,size,offset,sink,context);
+        if (blockShift) {
+                int mapFd=-1;
+                if (formatFlags&FAILSAFE_FLAG_DEDUP) {
+                        res=dedupMapOf(*(file.inode),blockShift,false,mapFd);
+                        if (res)
+                                return res;
+                }
+                return readLargeFile(blockShift,fd,mapFd,size,offset,sink,context);
+        }
+
+        const int64_t firstBlockNr=offset/FAILSAFE_DATA_SIZE;
+        const int64_t count=(offset+size-1)/FAILSAFE_DATA_SIZE-firstBlockNr+1;
+        struct stat stbuf;
+        if (fstat(fd,&stbuf)==-1)
+                return -errno;
+
+        InodeStruct& inode=*(file.inode);
+        std::vector<char> state(count,BLOCK_MISSING);
+        std::vector<char> verified(count,0);
+        FileStamp stamp;
+        uint64_t generation;
+        FileMapping* mapping;
+        {
+                Mutex mutex(inode.stateMutex);
+                checkInodeStamp(inode,stbuf);
+                stamp=inode.stamp;
+                generation=inode.generation;
+                mapping=getMapping(inode,fd,stbuf);
+                for (int64_t i=0;i<count && firstBlockNr+i<static_cast<int64_t>(inode.verified.size());++i)
+                        verified[i]=inode.verified[firstBlockNr+i];
+        }
+        MappingRef mappingRef(inode,mapping);
+        std::vector<const FailSafeStoreStruct*> sources(count,static_cast<const FailSafeStoreStruct*>(NULL));
+        CachedBlockRefs cached(blockCache,count);
+        BlockBuffer blocks(mapping?0:count);
+
+        // dirty blocks are newer than the backing file
+        if (!inode.dirty.empty()) {
+                for (int64_t i=0;i<count;++i) {
+                        sources[i]=inode.dirty.find(firstBlockNr+i);
+                        if (sources[i])
+                                state[i]=BLOCK_DIRTY;
+                }
+        }
+        if (mapping) {
+                // blocks are verified and copied straight from the page cache
+                const int64_t mappedBlocks=mapping->length/FAILSAFE_BLOCK_SIZE;
+                const int64_t mappedCount=std::min(count,std::max(mappedBlocks-firstBlockNr,static_cast<int64_t>(0)));
+                const char* first=mapping->address+firstBlockNr*FAILSAFE_BLOCK_SIZE;
+                const size_t pageOffset=(firstBlockNr*FAILSAFE_BLOCK_SIZE)%getpagesize();
+                if (mappedCount>0)
+                        madvise(const_cast<char*>(first-pageOffset),mappedCount*FAILSAFE_BLOCK_SIZE+pageOffset,MADV_WILLNEED);
+                for (int64_t i=0;i<mappedCount;++i) {
+                        if (sources[i])
+                                continue;
+                        sources[i]=reinterpret_cast<const FailSafeStoreStruct*>(first+i*FAILSAFE_BLOCK_SIZE);
+                        state[i]=verified[i]?BLOCK_TRUSTED:BLOCK_READ;
+                }
+        } else {
+                if (!blocks.valid())
+                        return -ENOMEM;
+                readAhead(file,firstBlockNr,firstBlockNr+count-1,(offset+size)/FAILSAFE_DATA_SIZE,(filesize+FAILSAFE_DATA_SIZE-1)/FAILSAFE_DATA_SIZE);
+
+                // blocks of the shared cache are used directly, the others are read in runs
+                BlockKey key= {file.key.dev,file.key.ino,firstBlockNr};
+                for (int64_t i=0;i<count;++i,++key.blockNr) {
+                        if (sources[i])
+                                continue;
+                        cached[i]=blockCache.lookup(key,generation);
+                        if (cached[i]) {
+                                sources[i]=&(cached[i]->block);
+                                state[i]=BLOCK_CACHED;
+                        }
+                }
+                // the runs between cached and dirty blocks are submitted as one batch
+                std::vector<IORequest> requests;
+                std::vector<struct iovec> iovs((count+1)/2);
+                std::vector<int64_t> runStarts;
+                for (int64_t i=0;i<count;) {
+                        if (sources[i]) {
+                                ++i;
+                                continue;
+                        }
+                        int64_t run=1;
+                        while (i+run<count && !sources[i+run])
+                                ++run;
+                        IORequest request;
+                        prepareBlockRun(request,iovs[requests.size()],fd,&blocks[i],run,firstBlockNr+i);
+                        requests.push_back(request);
+                        runStarts.push_back(i);
+                        i+=run;
+                }
+                if (!requests.empty()) {
+                        TraceSpan span(TRACE_BLOCK_READ,firstBlockNr);
+                        blockIO->run(&requests[0],requests.size());
+                }
+                for (size_t r=0;r<requests.size();++r) {
+                        if (requests[r].result<0)
+                                return requests[r].result;
+                        // blocks verified by earlier reads of the same file version are not hashed again
+                        const int64_t begin=runStarts[r];
+                        for (int64_t k=begin;k<begin+requests[r].result/FAILSAFE_BLOCK_SIZE;++k) {
+                                sources[k]=&blocks[k];
+                                state[k]=verified[k]?BLOCK_TRUSTED:BLOCK_READ;
+                        }
+                }
+        }
+
+        VerifyContext verify= {&sources[0],&state,0};
+        hashPool.parallelFor(count,PARALLEL_HASH_MIN_BLOCKS,verifyBlocks,&verify);
+        if (verify.failures>0) {
+                statistics.hashFailures(verify.failures);
+                return -EIO;
+        }
+
+        {
+                Mutex mutex(inode.stateMutex);
+                if (inode.stamp==stamp) {
+                        if (inode.verified.empty())
+                                inode.verifiedSince=time(NULL);
+                        if (static_cast<int64_t>(inode.verified.size())<firstBlockNr+count)
+                                inode.verified.resize(firstBlockNr+count,false);
+                        for (int64_t i=0;i<count;++i)
+                                if (state[i]==BLOCK_CHECKED)
+                                        inode.verified[firstBlockNr+i]=true;
+                }
+        }
+        if (!mapping) {
+                BlockKey key= {file.key.dev,file.key.ino,firstBlockNr};
+                for (int64_t i=0;i<count;++i,++key.blockNr)
+                        if (state[i]==BLOCK_CHECKED || state[i]==BLOCK_TRUSTED)
+                                blockCache.insert(key,generation,blocks[i]);
+        }
+
+        // the pieces point into the mapping, the cache, the dirty map or the read buffer
+        std::vector<struct iovec> iov(count);
+        int64_t localoffset=offset;
+        int64_t remain=size;
+        for (int64_t i=0;remain>0;++i) {
+                const int64_t start=localoffset%FAILSAFE_DATA_SIZE;
+                const int64_t transfer=(remain>FAILSAFE_DATA_SIZE-start)?(FAILSAFE_DATA_SIZE-start):remain;
+                iov[i].iov_base=const_cast<char*>(sources[i]->data+start);
+                iov[i].iov_len=transfer;
+                remain-=transfer;
+                localoffset+=transfer;
+        }
+        return sink(context,&iov[0],count);
+}
+
+/*!
+ * writes data to a compressed file, the chunks are recompressed and stored
+ * at once (called with the inode's lock held exclusively)
+ * @param file handle to write through
+ * @param src data in memory or in a pipe
+ * @param offset position of the data
+ * @param filesize size of the file before the write
+ * @return number of bytes written or -errno
+ */
+static int writeCompressed(CacheStruct& file, struct fuse_bufvec& src, off_t offset, int64_t filesize,
+                           int64_t revision, int hashAlgorithm, int formatFlags)
+{
+        const int fd=file.fd;
+        const int64_t size=fuse_buf_size(&src);
+        const int64_t end=std::max(filesize,static_cast<int64_t>(offset+size));
+        // chunks between the end of the file and the data are filled with zeros
+        const int64_t firstChunkNr=std::min(static_cast<int64_t>(offset),filesize)/COMPRESS_CHUNK_SIZE;
+        const int64_t lastChunkNr=(offset+size-1)/COMPRESS_CHUNK_SIZE;
+        const int64_t count=lastChunkNr-firstChunkNr+1;
+
+        BlockBuffer extents((count+1)*COMPRESS_CHUNK_BLOCKS);
+        if (!extents.valid())
+                return -ENOMEM;
+        // the last extent of the buffer is used for reading the chunks kept in part
+        FailSafeStoreStruct* kept=&extents[count*COMPRESS_CHUNK_BLOCKS];
+        FailSafeStoreStruct prev=FailSafeStoreStruct();
+        int res;
+        if (firstChunkNr>0) {
+                res=readChunk(fd,kept,firstChunkNr-1);
+                if (res)
+                        return res;
+                memcpy(&prev,kept,sizeof(prev));
+        }
+
+        std::vector<char> data(COMPRESS_CHUNK_SIZE);
+        std::vector<IORequest> requests(count);
+        std::vector<struct iovec> iovs(count);
+        for (int64_t i=0;i<count;++i) {
+                const int64_t chunkNr=firstChunkNr+i;
+                const int64_t chunkOffset=chunkNr*COMPRESS_CHUNK_SIZE;
+                const int64_t datasize=std::min(end-chunkOffset,static_cast<int64_t>(COMPRESS_CHUNK_SIZE));
+                const int64_t start=std::max(static_cast<int64_t>(offset),chunkOffset);
+                const int64_t stop=std::min(static_cast<int64_t>(offset+size),chunkOffset+datasize);
+                memset(&data[0],0,COMPRESS_CHUNK_SIZE);
+                // read-modify-write of a chunk which is partially kept
+                if (chunkOffset<filesize && (start>chunkOffset || stop<std::min(filesize,chunkOffset+datasize))) {
+                        res=readChunk(fd,kept,chunkNr);
+                        if (res==0)
+                                res=decompressChunk(kept,&data[0]);
+                        if (res)
+                                return res;
+                }
+                if (start<stop) {
+                        struct fuse_bufvec dst;
+                        dst.count=1;
+                        dst.idx=0;
+                        dst.off=0;
+                        dst.buf[0].size=stop-start;
+                        dst.buf[0].flags=static_cast<enum fuse_buf_flags>(0);
+                        dst.buf[0].mem=&data[start-chunkOffset];
+                        dst.buf[0].fd=-1;
+                        dst.buf[0].pos=0;
+                        const ssize_t copied=fuse_buf_copy(&dst,&src,static_cast<enum fuse_buf_copy_flags>(0));
+                        if (copied<0)
+                                return copied;
+                        if (copied!=stop-start)
+                                return -EIO;
+                }
+                FailSafeStoreStruct* extent=&extents[i*COMPRESS_CHUNK_BLOCKS];
+                calculateHeader(*extent,prev,datasize,chunkNr,chunkOffset,revision,hashAlgorithm,formatFlags);
+                res=compressChunk(extent,&data[0],datasize,options.compress?options.compress:Z_DEFAULT_COMPRESSION);
+                if (res)
+                        return res;
+                memcpy(&prev,extent,sizeof(prev));
+                iovs[i].iov_base=extent;
+                iovs[i].iov_len=extentBlocksOf(*extent)*FAILSAFE_BLOCK_SIZE;
+                IORequest request= {fd,true,&iovs[i],1,chunkNr*COMPRESS_CHUNK_BLOCKS*FAILSAFE_BLOCK_SIZE,0};
+                requests[i]=request;
+        }
+        {
+                TraceSpan span(TRACE_BLOCK_WRITE,firstChunkNr*COMPRESS_CHUNK_BLOCKS);
+                blockIO->run(&requests[0],requests.size());
+        }
+        for (int64_t i=0;i<count;++i)
+                if (requests[i].result<0)
+                        return requests[i].result;
+        noteWrittenBlocks(*(file.inode),fd,firstChunkNr*COMPRESS_CHUNK_BLOCKS,count*COMPRESS_CHUNK_BLOCKS);
+        if (lastChunkNr>file.lastWrittenBlockNr)
+                file.lastWrittenBlockNr=lastChunkNr;
+        return size;
+}
+
+/// gives back the shared payloads referenced by a write that failed
+static void releaseDedupEntries(int shift,const std::vector<int64_t>& entries)
+{
+        for (size_t i=0;i<entries.size();++i)
+                if (entries[i]>0)
+                        dedupStore.release(shift,entries[i]-1);
+}
+
+/*!
+ * writes data to a file of version 2.00, the blocks are built and stored
+ * at once: the payloads as whole pages, the headers into the header
+ * regions of their groups. A full block of a file with
+ * FAILSAFE_FLAG_DEDUP references the payload in the dedup store instead,
+ * its payload is not written when the store knows it already.
+ * @param file handle to write through
+ * @param src data in memory or in a pipe
+ * @param offset position of the data
+ * @param filesize size of the file before the write
+ * @return number of bytes written or -errno
+ */
+template<int Shift>
+static int writeLarge(CacheStruct& file, struct fuse_bufvec& src, off_t offset, int64_t filesize,
+                      int64_t revision, int hashAlgorithm, int formatFlags)
+{
+        typedef BlockGeometry<Shift> Geometry;
+        const int fd=file.fd;
+        const int64_t size=fuse_buf_size(&src);
+        const int64_t end=std::max(filesize,static_cast<int64_t>(offset+size));
+        // blocks between the end of the file and the data are filled with zeros
+        const int64_t firstBlockNr=Geometry::blockOf(std::min(static_cast<int64_t>(offset),filesize));
+        const int64_t lastBlockNr=Geometry::blockOf(offset+size-1);
+        const int64_t count=lastBlockNr-firstBlockNr+1;
+
+        // one more header and payload for reading the blocks kept in part
+        BlockBuffer headers(count+1);
+        BlockBuffer payloads((count+1)<<(Shift-12));
+        if (!headers.valid() || !payloads.valid())
+                return -ENOMEM;
+        FailSafeStoreStruct* keptHeader=&headers[count];
+        char* kept=reinterpret_cast<char*>(&payloads[0])+(count<<Shift);
+        FailSafeStoreStruct prev=FailSafeStoreStruct();
+        InodeStruct& inode=*(file.inode);
+        uint64_t generation;
+        {
+                Mutex mutex(inode.stateMutex);
+                generation=inode.generation;
+        }
+        int res;
+        int mapFd=-1;
+        if (formatFlags&FAILSAFE_FLAG_DEDUP) {
+                res=dedupMapOf(inode,Shift,true,mapFd);
+                if (res)
+                        return res;
+        }
+        // an append continues the block stored last without reading it
+        const FailSafeStoreStruct* stored=inode.chainTail.predecessor(firstBlockNr,generation);
+        if (stored) {
+                memcpy(&prev,stored,FAILSAFE_HEADER_SIZE);
+        } else if (firstBlockNr>0) {
+                res=readLargeHeader<Shift>(fd,prev,firstBlockNr-1);
+                if (res)
+                        return res;
+        }
+
+        std::vector<IORequest> requests;
+        requests.reserve(2*count);
+        std::vector<struct iovec> iovs(2*count);
+        // slot+1 of the shared payload of each block, 0 if it is in the file
+        std::vector<int64_t> entries(mapFd>=0?count:0);
+        for (int64_t i=0;i<count;++i) {
+                const int64_t blockNr=firstBlockNr+i;
+                const int64_t blockOffset=blockNr<<Shift;
+                const int64_t datasize=std::min(end-blockOffset,Geometry::PAYLOAD_SIZE);
+                const int64_t start=std::max(static_cast<int64_t>(offset),blockOffset);
+                const int64_t stop=std::min(static_cast<int64_t>(offset+size),blockOffset+datasize);
+                char* payload=reinterpret_cast<char*>(&payloads[0])+(i<<Shift);
+                // read-modify-write of a block which is partially kept
+                if (blockOffset<filesize && (start>blockOffset || stop<std::min(filesize,blockOffset+datasize))) {
+                        const FailSafeStoreStruct* storedHeader=inode.chainTail.find(blockNr,generation);
+                        const char* storedPayload=inode.chainTail.payload();
+                        if (storedHeader==NULL) {
+                                res=readLargeBlocks<Shift>(fd,mapFd,keptHeader,kept,1,blockNr);
+                                if (res) {
+                                        releaseDedupEntries(Shift,entries);
+                                        return res;
+                                }
+                                storedHeader=keptHeader;
+                                storedPayload=kept;
+                        }
+                        memcpy(payload,storedPayload,storedHeader->mSizeOfDataInCurrentBlock);
+                        memset(payload+storedHeader->mSizeOfDataInCurrentBlock,0,Geometry::PAYLOAD_SIZE-storedHeader->mSizeOfDataInCurrentBlock);
+                } else {
+                        memset(payload,0,largeStoredSize(datasize));
+                }
+                if (start<stop) {
+                        struct fuse_bufvec dst;
+                        dst.count=1;
+                        dst.idx=0;
+                        dst.off=0;
+                        dst.buf[0].size=stop-start;
+                        dst.buf[0].flags=static_cast<enum fuse_buf_flags>(0);
+                        dst.buf[0].mem=payload+(start-blockOffset);
+                        dst.buf[0].fd=-1;
+                        dst.buf[0].pos=0;
+                        const ssize_t copied=fuse_buf_copy(&dst,&src,static_cast<enum fuse_buf_copy_flags>(0));
+                        if (copied!=stop-start) {
+                                releaseDedupEntries(Shift,entries);
+                                return copied<0?copied:-EIO;
+                        }
+                }
+                FailSafeStoreStruct& header=headers[i];
+                calculateHeader(header,prev,datasize,blockNr,blockOffset,revision,hashAlgorithm,formatFlags,Shift);
+                calculateLargeHASH(header,payload);
+                memcpy(&prev,&header,FAILSAFE_HEADER_SIZE);
+                iovs[2*i].iov_base=payload;
+                iovs[2*i].iov_len=largeStoredSize(datasize);
+                iovs[2*i+1].iov_base=&header;
+                iovs[2*i+1].iov_len=FAILSAFE_HEADER_SIZE;
+                IORequest payloadWrite= {fd,true,&iovs[2*i],1,Geometry::dataOffset(blockNr),0};
+                IORequest headerWrite= {fd,true,&iovs[2*i+1],1,Geometry::headerOffset(blockNr),0};
+                if (mapFd>=0 && datasize==Geometry::PAYLOAD_SIZE) {
+                        char key[DEDUP_KEY_SIZE];
+                        DedupStore::keyOf(payload,Shift,key);
+                        const int64_t slot=dedupStore.reference(Shift,key,payload);
+                        if (slot<0) {
+                                releaseDedupEntries(Shift,entries);
+                                return slot;
+                        }
+                        entries[i]=slot+1;
+                } else {
+                        requests.push_back(payloadWrite);
+                }
+                requests.push_back(headerWrite);
+        }
+        {
+                TraceSpan span(TRACE_BLOCK_WRITE,firstBlockNr);
+                blockIO->run(&requests[0],requests.size());
+        }
+        for (size_t r=0;r<requests.size();++r)
+                if (requests[r].result<0) {
+                        inode.chainTail.clear();
+                        releaseDedupEntries(Shift,entries);
+                        return requests[r].result;
+                }
+        if (mapFd>=0) {
+                res=dedupStore.updateMap(mapFd,Shift,firstBlockNr,entries);
+                if (res) {
+                        inode.chainTail.clear();
+                        releaseDedupEntries(Shift,entries);
+                        return res;
+                }
+                // a shared payload leaves a hole where the file kept its own one
+                for (int64_t i=0;i<count;++i)
+                        if (entries[i] && ((firstBlockNr+i)<<Shift)<filesize)
+                                fallocate(fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,Geometry::dataOffset(firstBlockNr+i),Geometry::PAYLOAD_SIZE);
+        }
+        const int64_t firstPage=Geometry::groupOffset(firstBlockNr)/FAILSAFE_BLOCK_SIZE;
+        noteWrittenBlocks(inode,fd,firstPage,Geometry::descOffset(lastBlockNr)/FAILSAFE_BLOCK_SIZE-firstPage);
+        inode.chainTail.keep(lastBlockNr,generation,headers[count-1],reinterpret_cast<char*>(&payloads[0])+((count-1)<<Shift));
+        if (lastBlockNr>file.lastWrittenBlockNr)
+                file.lastWrittenBlockNr=lastBlockNr;
+        return size;
+}
+
+/*!
+ * writeLarge for the block size of a file
+ * @param shift log2 of the block size
+ */
+static int writeLargeFile(int shift, CacheStruct& file, struct fuse_bufvec& src, off_t offset, int64_t filesize,
+                          int64_t revision, int hashAlgorithm, int formatFlags)
+{
+        switch (shift) {
+        case 12:
+                return writeLarge<12>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 13:
+                return writeLarge<13>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 14:
+                return writeLarge<14>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 15:
+                return writeLarge<15>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 16:
+                return writeLarge<16>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 17:
+                return writeLarge<17>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 18:
+                return writeLarge<18>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 19:
+                return writeLarge<19>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        case 20:
+                return writeLarge<20>(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        }
+        return -EIO;
+}
+
+/*!
+ * reads the last block of a file of version 2.00 for its description
+ * @param tail receives the verified header
+ * @param descNr receives the position of the description in FAILSAFE_BLOCK_SIZE units
+ */
+template<int Shift>
+static int readLargeTail(int fd,int mapFd,FailSafeStoreStruct& tail,int64_t tailNr,int64_t& descNr)
+{
+        BlockBuffer payload(static_cast<size_t>(1)<<(Shift-12));
+        if (!payload.valid())
+                return -ENOMEM;
+        int res=readLargeBlocks<Shift>(fd,mapFd,&tail,reinterpret_cast<char*>(&payload[0]),1,tailNr);
+        descNr=BlockGeometry<Shift>::descOffset(tailNr)/FAILSAFE_BLOCK_SIZE;
+        return res;
+}
+
+static int readLargeTailFile(int shift,int fd,int mapFd,FailSafeStoreStruct& tail,int64_t tailNr,int64_t& descNr)
+{
+        switch (shift) {
+        case 12:
+                return readLargeTail<12>(fd,mapFd,tail,tailNr,descNr);
+        case 13:
+                return readLargeTail<13>(fd,mapFd,tail,tailNr,descNr);
+        case 14:
+                return readLargeTail<14>(fd,mapFd,tail,tailNr,descNr);
+        case 15:
+                return readLargeTail<15>(fd,mapFd,tail,tailNr,descNr);
+        case 16:
+                return readLargeTail<16>(fd,mapFd,tail,tailNr,descNr);
+        case 17:
+                return readLargeTail<17>(fd,mapFd,tail,tailNr,descNr);
+        case 18:
+                return readLargeTail<18>(fd,mapFd,tail,tailNr,descNr);
+        case 19:
+                return readLargeTail<19>(fd,mapFd,tail,tailNr,descNr);
+        case 20:
+                return readLargeTail<20>(fd,mapFd,tail,tailNr,descNr);
+        }
+        return -EIO;
+}
+
+/*!
+ * writes data to an open file, the blocks stay dirty until they are flushed
+ * @param file handle to write through
+ * @param src data in memory or in a pipe, it is copied straight into the
+ *        payload of the dirty blocks
+ * @param offset position of the data
+ * @return number of bytes written or -errno
+ */
+static int writeHandle(CacheStruct& file, struct fuse_bufvec& src, off_t offset)
+{
+        WriteLock lock(file.inode->lock);
+        int fd=file.fd;
+        int res=0;
+
+        const size_t size=fuse_buf_size(&src);
+        size_t remain=size;
+
+        Mutex descMutex(file.descMutex);
+        if (file.hasDesc==false) {
+                res=loadDescription(file);
+                if (res)
+                        return res;
+        }
+        const int64_t revision=file.desc.mRevision;
+        const int hashAlgorithm=file.hashAlgorithm;
+        const int formatFlags=file.formatFlags;
+        const int blockShift=file.blockShift;
+        const int64_t filesize=file.desc.mOffset;
+        if (static_cast<int64_t>(offset+size)>file.desc.mOffset)
+                file.desc.mOffset=offset+size;
+        descMutex.unlock();
+
+        if (size==0)
+                return 0;
+        if (formatFlags&FAILSAFE_FLAG_COMPRESSED)
+                return writeCompressed(file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+        if (blockShift)
+                return writeLargeFile(blockShift,file,src,offset,filesize,revision,hashAlgorithm,formatFlags);
+
+        InodeStruct& inode=*(file.inode);
+        if (inode.dirtyFd<0) {
+                inode.dirtyFd=dup(fd);
+                if (inode.dirtyFd==-1)
+                        return -errno;
+                writeBack.add(&inode);
+        }
+
+        // blocks are only modified in the dirty map, they are hashed and stored when flushed
+        const int64_t firstBlockNr=offset/FAILSAFE_DATA_SIZE;
+        for (int64_t blockNr=firstBlockNr;remain>0;++blockNr) {
+                const size_t start=(blockNr==firstBlockNr)?offset%FAILSAFE_DATA_SIZE:0;
+                const size_t transfer=(remain>FAILSAFE_DATA_SIZE-start)?(FAILSAFE_DATA_SIZE-start):remain;
+                const int64_t blockOffset=blockNr*FAILSAFE_DATA_SIZE;
+                int64_t datasize=start+transfer;
+                FailSafeStoreStruct* block=inode.dirty.find(blockNr);
+                if (block) {
+                        if (block->mSizeOfDataInCurrentBlock>datasize)
+                                datasize=block->mSizeOfDataInCurrentBlock;
+                        block->mSizeOfDataInCurrentBlock=datasize;
+                } else {
+                        // a block after a hole could not be linked into the chain (or the tree)
+                        if (blockNr>0 && blockOffset-FAILSAFE_DATA_SIZE>=filesize && inode.dirty.find(blockNr-1)==NULL)
+                                return -EIO;
+                        FailSafeStoreStruct kept DIRECT_IO_ALIGNED;
+                        const FailSafeStoreStruct* stored=NULL;
+                        const bool partial=blockOffset<filesize && (start!=0 || blockOffset+static_cast<int64_t>(transfer)<filesize);
+                        if (partial) {
+                                // read-modify-write of a block which is partially kept, an
+                                // append completes the block stored last from memory
+                                uint64_t generation;
+                                {
+                                        Mutex mutex(inode.stateMutex);
+                                        generation=inode.generation;
+                                }
+                                stored=inode.chainTail.find(blockNr,generation);
+                                if (stored==NULL) {
+                                        res=readBlock(inode,fd,kept,blockNr);
+                                        if (res)
+                                                return res;
+                                        stored=&kept;
+                                }
+                                if (stored->mSizeOfDataInCurrentBlock>datasize)
+                                        datasize=stored->mSizeOfDataInCurrentBlock;
+                        }
+                        block=inode.dirty.insert(blockNr);
+                        if (block==NULL)
+                                return -ENOMEM;
+                        if (partial)
+                                memcpy(block->data,stored->data,FAILSAFE_DATA_SIZE);
+                        else
+                                memset(block->data,0,start);
+                        calculateHeader(*block,unlinkedBlock,datasize,blockNr,blockOffset,revision,hashAlgorithm,formatFlags);
+                }
+                struct fuse_bufvec dst;
+                dst.count=1;
+                dst.idx=0;
+                dst.off=0;
+                dst.buf[0].size=transfer;
+                dst.buf[0].flags=static_cast<enum fuse_buf_flags>(0);
+                dst.buf[0].mem=block->data+start;
+                dst.buf[0].fd=-1;
+                dst.buf[0].pos=0;
+                const ssize_t copied=fuse_buf_copy(&dst,&src,static_cast<enum fuse_buf_copy_flags>(0));
+                if (copied<0)
+                        return copied;
+                if (static_cast<size_t>(copied)!=transfer)
+                        return -EIO;
+                if (blockNr>file.lastWrittenBlockNr)
+                        file.lastWrittenBlockNr=blockNr;
+                remain-=transfer;
+        }
+
+        // without write-back, and above the memory limit, the blocks are stored now
+        if (options.writeback==0 || DirtyBlocks::total()>dirtyLimit()) {
+                res=flushDirty(inode);
+                if (res)
+                        return res;
+                if (DirtyBlocks::total()>dirtyLimit())
+                        writeBack.wakeup();
+        }
+        return size;
+}
+
+/*!
+ * flushes the dirty blocks of the inode, writes the description of a
+ * written file and closes the handle
+ */
+static int releaseHandle(CacheStruct* file)
+{
+        int fd=file->fd;
+        int result=0;
+        if (file->writable) {
+                InodeStruct& inode=*(file->inode);
+                WriteLock lock(inode.lock);
+                result=flushDirty(inode);
+                if (result==0 && file->lastWrittenBlockNr>=0) {
+                        TraceSpan span(TRACE_DESCRIPTION,file->lastWrittenBlockNr);
+                        // aligned, so that the description is stored without a bounce buffer
+                        FailSafeDescription desc DIRECT_IO_ALIGNED;
+                        FailSafeStoreStruct tail DIRECT_IO_ALIGNED;
+                        struct stat stbuf;
+                        // the description always follows the last block (or chunk) of the file
+                        const bool compressed=(file->formatFlags&FAILSAFE_FLAG_COMPRESSED)!=0;
+                        const int64_t tailNr=std::max(file->lastWrittenBlockNr,file->desc.mBlockCounter-1);
+                        int64_t descNr=tailNr+1;
+                        uint64_t generation;
+                        {
+                                Mutex mutex(inode.stateMutex);
+                                generation=inode.generation;
+                        }
+                        const FailSafeStoreStruct* stored=compressed?NULL:inode.chainTail.find(tailNr,generation);
+                        if (stored && file->blockShift) {
+                                memcpy(&tail,stored,FAILSAFE_HEADER_SIZE);
+                                descNr=largeDescPosition(file->blockShift,tailNr)/FAILSAFE_BLOCK_SIZE;
+                        } else if (stored) {
+                                memcpy(&tail,stored,sizeof(tail));
+                        } else if (file->blockShift) {
+                                int mapFd=-1;
+                                if (file->formatFlags&FAILSAFE_FLAG_DEDUP)
+                                        result=dedupMapOf(inode,file->blockShift,false,mapFd);
+                                if (result==0)
+                                        result=readLargeTailFile(file->blockShift,fd,mapFd,tail,tailNr,descNr);
+                        } else if (compressed) {
+                                BlockBuffer extent(COMPRESS_CHUNK_BLOCKS);
+                                result=extent.valid()?readChunk(fd,&extent[0],tailNr):-ENOMEM;
+                                if (result==0)
+                                        memcpy(&tail,&extent[0],sizeof(tail));
+                        } else {
+                                result=readBlock(inode,fd,tail,tailNr);
+                        }
+                        if (result==0 && fstat(fd,&stbuf)==-1)
+                                result=-errno;
+                        // the tree is cut or extended to the last block, its root goes to the description
+                        char root[MERKLE_HASH_SIZE];
+                        if (result==0 && (formatFlagsOf(tail)&FAILSAFE_FLAG_MERKLE)) {
+                                result=openMerkleTree(inode,fd);
+                                if (result==0) {
+                                        inode.merkleLeaves=tail.mBlockCounter+1;
+                                        std::vector<std::pair<int64_t,const char*> > last(1,std::make_pair(static_cast<int64_t>(tail.mBlockCounter),static_cast<const char*>(tail.mCurrentHash)));
+                                        result=MerkleTree(inode.merkleFd,hashAlgorithmOf(tail)).update(last,inode.merkleLeaves,root);
+                                }
+                        }
+                        if (result==0) {
+                                calculateDescription(desc,tail,pathOf(inode),stbuf.st_uid,stbuf.st_gid,stbuf.st_mode,root);
+                                if (compressed)
+                                        descNr=(tail.mBlockCounter+1)*COMPRESS_CHUNK_BLOCKS;
+                                result=writeBlock(fd, &desc, descNr);
+                                noteWrittenBlocks(inode,fd,descNr,1);
+                        }
+                }
+                // the last block is only kept while the file is written
+                Mutex mutex(inode.stateMutex);
+                if (inode.writers==1)
+                        inode.chainTail.clear();
+        }
+        bool removed;
+        {
+                Mutex mutex(file->inode->stateMutex);
+                if (file->writable)
+                        --(file->inode->writers);
+                removed=(--(file->inode->handles)==0 && file->inode->unlinked);
+        }
+        // the open descriptor keeps the inode number from being reused meanwhile
+        if (removed) {
+                InodeStruct& inode=*(file->inode);
+                WriteLock lock(inode.lock);
+                removeFileMeta(file->key.dev,file->key.ino);
+                if (inode.merkleFd>=0) {
+                        close(inode.merkleFd);
+                        inode.merkleFd=-1;
+                }
+                inode.merkleLeaves=-1;
+                Mutex mutex(inode.stateMutex);
+                if (inode.dedupFd>=0) {
+                        close(inode.dedupFd);
+                        inode.dedupFd=-1;
+                }
+                inode.unlinked=false;
+        }
+        inodes.release(file->key);
+        pthread_mutex_destroy(&(file->descMutex));
+        pthread_mutex_destroy(&(file->readaheadMutex));
+        delete file;
+        close(fd);
+        return result;
+}
+
+// failsafe-bench includes this file and drives the handle layer above without mounting
+#ifndef FAILSAFE_NO_MAIN
 
+/*!
+ * stores the dirty blocks of the inode of a writable handle
+ */
+static int syncHandle(CacheStruct& file)
+{
+        if (file.writable) {
+                WriteLock lock(file.inode->lock);
+                return flushDirty(*(file.inode));
+        }
         return 0;
 }
 
-static int fs_rmdir(const char *path)
+/*!
+ * text of the statistics file: the counters of the operations and the
+ * state of the caches, the write-back and the scrubber
+ */
+static std::string statisticsText()
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = rmdir(localpath.c_str());
-        if (res == -1)
-                return -errno;
-
-        return 0;
+        std::ostringstream text;
+        statistics.format(text);
+        text<<"hashed_bytes: "<<__atomic_load_n(&hashedBytes(),__ATOMIC_RELAXED)<<"\n";
+        text<<"cache_blocks: "<<blockCache.size()<<"\n";
+        text<<"cache_capacity_blocks: "<<blockCache.capacity()<<"\n";
+        text<<"cache_hits: "<<blockCache.hits()<<"\n";
+        text<<"cache_misses: "<<blockCache.misses()<<"\n";
+        text<<"cache_evictions: "<<blockCache.evictions()<<"\n";
+        text<<"dirty_blocks: "<<DirtyBlocks::total()<<"\n";
+        text<<"scrub_files: "<<scrubber.files()<<"\n";
+        text<<"scrub_blocks: "<<scrubber.blocks()<<"\n";
+        text<<"scrub_errors: "<<scrubber.errors()<<"\n";
+        text<<"dedup_hits: "<<dedupStore.hits()<<"\n";
+        text<<"dedup_stored: "<<dedupStore.stored()<<"\n";
+        return text.str();
 }
 
-static int fs_symlink(const char *from, const char *to)
-{
-        int res;
-        std::string localfrom=basepath+std::string(from);
-        std::string localto=basepath+std::string(to);
 
-        res = symlink(localfrom.c_str(), localto.c_str());
-        if (res == -1)
-                return -errno;
+/*
+ *  The mount shows FAILSAFE_META_DIR of the root as a virtual read-only
+ *  directory instead of the backing one. It is not listed by readdir, so
+ *  it is not walked by find or backups, but it can be looked up. Its only
+ *  entry is the statistics file, which is rendered when it is opened.
+ */
 
-        return 0;
-}
+/// Node id of the virtual directory, real node ids are inode addresses
+#define META_DIR_ID 2
 
-static int fs_rename(const char *from, const char *to)
-{
-        int res;
-        std::string localfrom=basepath+std::string(from);
-        std::string localto=basepath+std::string(to);
+/// Node id of the statistics file in the virtual directory
+#define STATS_FILE_ID 3
 
-        res = rename(localfrom.c_str(), localto.c_str());
-        if (res == -1)
-                return -errno;
+#define STATS_FILE_NAME "stats"
 
-        return 0;
+inline bool isVirtual(fuse_ino_t ino)
+{
+        return ino==META_DIR_ID || ino==STATS_FILE_ID;
 }
 
-static int fs_link(const char *from, const char *to)
+static void virtualAttributes(fuse_ino_t ino, struct stat& stbuf)
 {
-        int res;
-        std::string localfrom=basepath+std::string(from);
-        std::string localto=basepath+std::string(to);
-
-        res = link(localfrom.c_str(), localto.c_str());
-        if (res == -1)
-                return -errno;
-
-        return 0;
+        static const time_t mounted=time(NULL);
+        memset(&stbuf, 0, sizeof(stbuf));
+        stbuf.st_ino=ino;
+        stbuf.st_uid=getuid();
+        stbuf.st_gid=getgid();
+        stbuf.st_atime=stbuf.st_mtime=stbuf.st_ctime=mounted;
+        if (ino==META_DIR_ID) {
+                stbuf.st_mode=S_IFDIR|0555;
+                stbuf.st_nlink=2;
+        } else {
+                // the size is not known before the file is rendered, it is read with direct_io
+                stbuf.st_mode=S_IFREG|0444;
+                stbuf.st_nlink=1;
+        }
 }
 
-static int fs_chmod(const char *path, mode_t mode)
+/*!
+ * looks up the virtual entries
+ * @return 0, -ENOENT or 1 if the name is not virtual
+ */
+static int lookupVirtual(fuse_ino_t parent, const char* name, struct fuse_entry_param& e)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = chmod(localpath.c_str(), mode);
-        if (res == -1)
-                return -errno;
-
+        fuse_ino_t ino;
+        if (parent==META_DIR_ID && strcmp(name, STATS_FILE_NAME)==0)
+                ino=STATS_FILE_ID;
+        else if (parent==META_DIR_ID || parent==STATS_FILE_ID)
+                return -ENOENT;
+        else if (isMetaEntry(inodeOf(parent), name))
+                ino=META_DIR_ID;
+        else
+                return 1;
+        memset(&e, 0, sizeof(e));
+        e.ino=ino;
+        virtualAttributes(ino, e.attr);
+        e.attr_timeout=options.attrTimeout;
+        e.entry_timeout=options.entryTimeout;
         return 0;
 }
 
-static int fs_chown(const char *path, uid_t uid, gid_t gid)
+/*!
+ * answers requests that would modify a virtual entry or an entry of the
+ * virtual directory
+ * @return true if the request was answered
+ */
+static bool refuseVirtual(fuse_req_t req, fuse_ino_t ino, const char* name=NULL)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = lchown(localpath.c_str(), uid, gid);
-        if (res == -1)
-                return -errno;
-
-        return 0;
+        if (!isVirtual(ino) && (name==NULL || !isMetaEntry(inodeOf(ino), name)))
+                return false;
+        fuse_reply_err(req, EPERM);
+        return true;
 }
 
-static int fs_truncate(const char *path, off_t size)
+static void fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-        int res;
-
-        std::string localpath=basepath+std::string(path);
-        res = truncate(localpath.c_str(), size);
-        if (res == -1)
-                return -errno;
-
-        return 0;
+        TraceSpan span(TRACE_LOOKUP, parent);
+        struct fuse_entry_param e;
+        int res = lookupVirtual(parent, name, e);
+        if (res > 0)
+                res = lookupEntry(inodeOf(parent), name, e);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_entry(req, &e);
 }
 
-static int fs_utimens(const char *path, const struct timespec ts[2])
+static void fs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
 {
-        std::string localpath=basepath+std::string(path);
-        int res;
-        struct timeval tv[2];
-
-        tv[0].tv_sec = ts[0].tv_sec;
-        tv[0].tv_usec = ts[0].tv_nsec / 1000;
-        tv[1].tv_sec = ts[1].tv_sec;
-        tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
-        res = utimes(localpath.c_str(), tv);
-        if (res == -1)
-                return -errno;
+        TraceSpan span(TRACE_FORGET, ino);
+        if (!isVirtual(ino))
+                inodes.forget(&inodeOf(ino), nlookup);
+        fuse_reply_none(req);
+}
 
-        return 0;
+static void fs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+        TraceSpan span(TRACE_FORGET, count);
+        for (size_t i=0;i<count;++i)
+                if (!isVirtual(forgets[i].ino))
+                        inodes.forget(&inodeOf(forgets[i].ino), forgets[i].nlookup);
+        fuse_reply_none(req);
 }
 
-inline int readBlock(int fd,FailSafeStoreStruct & block, int64_t blockNr)
+static void fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-        int res=0;
+        TraceSpan span(TRACE_GETATTR, ino);
+        (void) fi;
+        const uint64_t start = Statistics::now();
+        struct stat stbuf;
+        int res = 0;
+        if (isVirtual(ino))
+                virtualAttributes(ino, stbuf);
+        else
+                res = inodeAttributes(inodeOf(ino), stbuf);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_attr(req, &stbuf, options.attrTimeout);
+        statistics.record(STATS_GETATTR, start, res);
+}
 
-        if (cache[fd].hasIncompleteBlock==true && (cache[fd].lastblock.mBlockCounter==blockNr)) {
-                memcpy(&block,&(cache[fd].incompleteblock),sizeof(FailSafeStoreStruct));
-                return 0;
+static void fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+        TraceSpan span(TRACE_SETATTR, ino);
+        (void) fi;
+        if (refuseVirtual(req, ino))
+                return;
+        InodeStruct& inode=inodeOf(ino);
+        int res = 0;
+        if (to_set & FUSE_SET_ATTR_MODE) {
+                if (chmod(FdPath(inode.pathFd).c_str(), attr->st_mode) == -1)
+                        res = -errno;
         }
-
-        if (cache[fd].hasLastBlock==true && (cache[fd].lastblock.mBlockCounter==blockNr)) {
-                memcpy(&block,&(cache[fd].lastblock),sizeof(FailSafeStoreStruct));
-        } else {
-                res = pread(fd, &block, FAILSAFE_BLOCK_SIZE,blockNr*FAILSAFE_BLOCK_SIZE);
-                if (res==-1)
-                        return -errno;
-                if (!checkConsistency(block)) {
-                        return -EIO;
-                }
+        if (res == 0 && (to_set & (FUSE_SET_ATTR_UID|FUSE_SET_ATTR_GID))) {
+                uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : static_cast<uid_t>(-1);
+                gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : static_cast<gid_t>(-1);
+                if (fchownat(inode.pathFd, "", uid, gid, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW) == -1)
+                        res = -errno;
         }
-
-        return 0;
+        if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+                res = truncateInode(inode, attr->st_size);
+        if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME))) {
+                struct timespec ts[2];
+                ts[0].tv_sec = 0;
+                ts[0].tv_nsec = UTIME_OMIT;
+                ts[1] = ts[0];
+                if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                        ts[0].tv_nsec = UTIME_NOW;
+                else if (to_set & FUSE_SET_ATTR_ATIME)
+                        ts[0] = attr->st_atim;
+                if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                        ts[1].tv_nsec = UTIME_NOW;
+                else if (to_set & FUSE_SET_ATTR_MTIME)
+                        ts[1] = attr->st_mtim;
+                if (utimensat(AT_FDCWD, FdPath(inode.pathFd).c_str(), ts, 0) == -1)
+                        res = -errno;
+        }
+        struct stat stbuf;
+        if (res == 0)
+                res = inodeAttributes(inode, stbuf);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_attr(req, &stbuf, options.attrTimeout);
 }
 
-inline int writeBlock(int fd,FailSafeStoreStruct & block, int64_t blockNr)
+static void fs_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-        int res=0;
-
-        if (cache[fd].hasIncompleteBlock==true && (cache[fd].lastblock.mBlockCounter!=blockNr)) {
-                calculateHASH(cache[fd].incompleteblock);
-                res = pwrite(fd, &(cache[fd].incompleteblock), FAILSAFE_BLOCK_SIZE,cache[fd].incompleteblock.mBlockCounter*FAILSAFE_BLOCK_SIZE);
-                cache[fd].hasIncompleteBlock = false;
-                if (res==-1)
-                        return -errno;
+        TraceSpan span(TRACE_ACCESS, ino);
+        if (isVirtual(ino)) {
+                fuse_reply_err(req, (mask & W_OK) ? EACCES : 0);
+                return;
         }
+        int res = access(FdPath(inodeOf(ino).pathFd).c_str(), mask);
+        fuse_reply_err(req, res == -1 ? errno : 0);
+}
 
-        if (block.mSizeOfDataInCurrentBlock==FAILSAFE_DATA_SIZE) {
-                calculateHASH(block);
-                res = pwrite(fd, &block, FAILSAFE_BLOCK_SIZE,blockNr*FAILSAFE_BLOCK_SIZE);
-                if (res==-1)
-                        return -errno;
-                memcpy(&(cache[fd].lastwrittenblock),&block,sizeof(FailSafeStoreStruct));
-        } else {
-                memcpy(&(cache[fd].incompleteblock),&block,sizeof(FailSafeStoreStruct));
-                cache[fd].hasIncompleteBlock=true;
+static void fs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+        TraceSpan span(TRACE_READLINK, ino);
+        if (isVirtual(ino)) {
+                fuse_reply_err(req, EINVAL);
+                return;
         }
-        return 0;
+        char buf[PATH_MAX + 1];
+        int res = readlinkat(inodeOf(ino).pathFd, "", buf, sizeof(buf) - 1);
+        if (res == -1) {
+                fuse_reply_err(req, errno);
+                return;
+        }
+
+        buf[res] = '\0';
+        fuse_reply_readlink(req, buf);
 }
 
-inline int flushBlock(int fd)
+/*!
+ *  Open directory stream, its address is stored in fuse_file_info::fh
+ */
+struct DirHandle {
+        DIR *dp;
+        /// Position the next entry is read from
+        off_t offset;
+        /// Entry read but not yet returned, it did not fit into the reply
+        struct dirent *entry;
+};
+
+static void fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-        if (cache[fd].hasIncompleteBlock==true) {
-                int res = pwrite(fd, &(cache[fd].incompleteblock), FAILSAFE_BLOCK_SIZE,cache[fd].incompleteblock.mBlockCounter*FAILSAFE_BLOCK_SIZE);
-                memcpy(&(cache[fd].lastwrittenblock),&(cache[fd].incompleteblock),sizeof(FailSafeStoreStruct));
-                if (res==-1)
-                        return -errno;
-                cache[fd].hasIncompleteBlock=false;
-                memcpy(&(cache[fd].lastblock),&(cache[fd].incompleteblock),sizeof(FailSafeStoreStruct));
-                cache[fd].hasLastBlock=true;
+        TraceSpan span(TRACE_OPENDIR, ino);
+        if (isVirtual(ino)) {
+                // the virtual directory has no stream
+                fi->fh=0;
+                if (ino==META_DIR_ID)
+                        fuse_reply_open(req, fi);
+                else
+                        fuse_reply_err(req, ENOTDIR);
+                return;
         }
-        return 0;
+        int fd = openat(inodeOf(ino).pathFd, ".", O_RDONLY|O_DIRECTORY);
+        if (fd == -1) {
+                fuse_reply_err(req, errno);
+                return;
+        }
+        DIR *dp = fdopendir(fd);
+        if (dp == NULL) {
+                int err = errno;
+                close(fd);
+                fuse_reply_err(req, err);
+                return;
+        }
+        DirHandle* dir=new DirHandle;
+        dir->dp=dp;
+        dir->offset=0;
+        dir->entry=NULL;
+        fi->fh=reinterpret_cast<uint64_t>(dir);
+        fuse_reply_open(req, fi);
 }
 
-static int fs_open(const char *path, struct fuse_file_info *fi)
+/*!
+ * lists the virtual directory, the offset of an entry is its index + 1
+ */
+static void readVirtualDir(fuse_req_t req, size_t size, off_t offset)
 {
-        Mutex mutex(globalMutex);
-        int res;
-        std::string localpath=basepath+std::string(path);
-        int openflags=O_RDONLY;
-        if ( fi->flags && O_WRONLY) openflags=O_RDWR;
-        res = open(localpath.c_str(),openflags );
-        if (res == -1) {
-                return -errno;
+        static const char* const names[]= {".","..",STATS_FILE_NAME};
+        static const fuse_ino_t ids[]= {META_DIR_ID,FUSE_ROOT_ID,STATS_FILE_ID};
+        std::vector<char> buf(size);
+        size_t used=0;
+        for (off_t i=offset;i<static_cast<off_t>(sizeof(names)/sizeof(names[0]));++i) {
+                struct stat st;
+                virtualAttributes(ids[i], st);
+                if (ids[i]==FUSE_ROOT_ID)
+                        st.st_mode=S_IFDIR;
+                const size_t entrySize = fuse_add_direntry(req, &buf[0] + used, size - used, names[i], &st, i + 1);
+                if (entrySize > size - used)
+                        break;
+                used += entrySize;
         }
-        fi->fh=res;
-        CacheStruct cachedItem;
-        cachedItem.hasDesc=false;
-        cachedItem.hasLastBlock=false;
-        cachedItem.hasIncompleteBlock=false;
-        cache[res]=cachedItem;
-        return 0;
+        fuse_reply_buf(req, &buf[0], used);
 }
 
-static int fs_read(const char *path, char *buf, size_t size, off_t offset,
-                   struct fuse_file_info *fi)
+static void fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
 {
-        Mutex mutex(globalMutex);
-        int fd=fi->fh;
-        int res;
-
-        int transfer;
-        std::string localpath=basepath+std::string(path);
-        FailSafeStoreStruct block;
-
-        char *ptr=buf;
-        int64_t localoffset=offset;
-
-        int64_t remain;
-
-        memset(buf,0,size);
-
-        FailSafeDescription desc;
-        struct stat stbuf;
-
-        if (cache[fd].hasDesc==false) {
-                lstat(localpath.c_str(), &stbuf);
-                if (stbuf.st_size>FAILSAFE_BLOCK_SIZE) {
-                        res = pread(fd, &desc, FAILSAFE_BLOCK_SIZE,stbuf.st_size-FAILSAFE_BLOCK_SIZE);
-                        if (!checkDescConsistency(desc)) {
-                                return -EIO;
-                        }
-                        if (res == -1) {
-                                res = -errno;
+        TraceSpan span(TRACE_READDIR, ino);
+        if (ino==META_DIR_ID) {
+                readVirtualDir(req, size, offset);
+                return;
+        }
+        InodeStruct& parent=inodeOf(ino);
+        DirHandle& dir=*reinterpret_cast<DirHandle*>(fi->fh);
+        std::vector<char> buf(size);
+        size_t used=0;
+
+        if (offset != dir.offset) {
+                seekdir(dir.dp, offset);
+                dir.entry=NULL;
+                dir.offset=offset;
+        }
+        for (;;) {
+                if (dir.entry == NULL) {
+                        errno = 0;
+                        dir.entry = readdir(dir.dp);
+                        if (dir.entry == NULL) {
+                                if (errno && used == 0) {
+                                        fuse_reply_err(req, errno);
+                                        return;
+                                }
+                                break;
                         }
-                } else {
-                        desc.mRevision=1;
-                        desc.mOffset=0;
                 }
-                memcpy(&(cache[fd].desc),&desc,sizeof(desc));
-                cache[fd].hasDesc=true;
-        } else {
-                desc.mRevision=cache[fd].desc.mRevision;
-                desc.mOffset=cache[fd].desc.mOffset;
+                const off_t next = telldir(dir.dp);
+                if (isMetaEntry(parent, dir.entry->d_name)) {
+                        dir.entry = NULL;
+                        dir.offset = next;
+                        continue;
+                }
+                struct stat st;
+                memset(&st, 0, sizeof(st));
+                st.st_ino = dir.entry->d_ino;
+                st.st_mode = dir.entry->d_type << 12;
+                const size_t entrySize = fuse_add_direntry(req, &buf[0] + used, size - used, dir.entry->d_name, &st, next);
+                if (entrySize > size - used)
+                        break;
+                used += entrySize;
+                dir.entry = NULL;
+                dir.offset = next;
         }
+        fuse_reply_buf(req, &buf[0], used);
+}
 
-
-        int64_t filesize=desc.mOffset;
-        remain=(static_cast<int64_t>(offset+size)>filesize)?(filesize-offset):size;
-        localoffset=offset;
-
-        if (localoffset%FAILSAFE_DATA_SIZE!=0) {
-                //read prev block
-                res=0;
-                int64_t blockNr=localoffset/FAILSAFE_DATA_SIZE;
-                res=readBlock(fd,block,blockNr);
-                if (res)
-                        return res;
-
-                // update block
-                transfer=(remain>FAILSAFE_DATA_SIZE-(localoffset%FAILSAFE_DATA_SIZE))?(FAILSAFE_DATA_SIZE-(localoffset%FAILSAFE_DATA_SIZE)):remain;
-                memcpy(ptr,block.data+(localoffset%FAILSAFE_DATA_SIZE),transfer);
-                remain-=transfer;
-                ptr+=transfer;
-                localoffset+=transfer;
+static void fs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        TraceSpan span(TRACE_RELEASEDIR, ino);
+        DirHandle* dir=reinterpret_cast<DirHandle*>(fi->fh);
+        if (dir) {
+                closedir(dir->dp);
+                delete dir;
         }
+        fuse_reply_err(req, 0);
+}
 
-        for (;remain>0;) {
-
-                transfer=(remain>FAILSAFE_DATA_SIZE)?FAILSAFE_DATA_SIZE:remain;
-                res=readBlock(fd,block,localoffset/FAILSAFE_DATA_SIZE);
-                if (res)
-                        return res;
-                memcpy(ptr,block.data,transfer);
-                remain-=transfer;
-                ptr+=transfer;
-                localoffset+=transfer;
+static void fs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, dev_t rdev)
+{
+        TraceSpan span(TRACE_MKNOD, parent);
+        if (refuseVirtual(req, parent, name))
+                return;
+        // symbolic links need their target, they come through fs_symlink
+        if (S_ISLNK(mode)) {
+                fuse_reply_err(req, EINVAL);
+                return;
         }
-        return localoffset-offset;
+        struct fuse_entry_param e;
+        int res = makeNode(inodeOf(parent), name, mode, rdev, NULL, e);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_entry(req, &e);
 }
 
-static int fs_write(const char *path, const char *buf, size_t size,
-                    off_t offset, struct fuse_file_info *fi)
+static void fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-        Mutex mutex(globalMutex);
-        std::string localpath=basepath+std::string(path);
-        int fd=fi->fh;
-        int res=0;
+        fs_mknod(req, parent, name, S_IFDIR | mode, 0);
+}
 
-        int transfer=0;
-        int64_t revision=1;
-        size_t remain=size;
-        char *ptr=const_cast<char*>(buf);
-        size_t localoffset=offset;
-        FailSafeStoreStruct lastblock,block;
-        FailSafeDescription desc;
+static void fs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+        TraceSpan span(TRACE_SYMLINK, parent);
+        if (refuseVirtual(req, parent, name))
+                return;
+        struct fuse_entry_param e;
+        int res = makeNode(inodeOf(parent), name, S_IFLNK, 0, link, e);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_entry(req, &e);
+}
+
+static void fs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        TraceSpan span(TRACE_UNLINK, parent);
+        if (refuseVirtual(req, parent, name))
+                return;
         struct stat stbuf;
+        const bool known = fstatat(inodeOf(parent).pathFd, name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0;
+        int res = unlinkat(inodeOf(parent).pathFd, name, 0);
+        if (res == 0 && known)
+                dropFileMeta(stbuf);
+        fuse_reply_err(req, res == -1 ? errno : 0);
+}
 
-        memset(&block,0,sizeof(block));
-        memset(&lastblock,0,sizeof(block));
+static void fs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+        TraceSpan span(TRACE_RMDIR, parent);
+        if (refuseVirtual(req, parent, name))
+                return;
+        int res = unlinkat(inodeOf(parent).pathFd, name, AT_REMOVEDIR);
+        fuse_reply_err(req, res == -1 ? errno : 0);
+}
 
-        if (cache[fd].hasDesc==false) {
-                if (lstat(localpath.c_str(), &stbuf)==0) {
-                        if (stbuf.st_size>FAILSAFE_BLOCK_SIZE) {
-                                res = pread(fd, &desc, sizeof(FailSafeDescription), stbuf.st_size-FAILSAFE_BLOCK_SIZE);
-                                if (res == -1) {
-                                        return -errno;
-                                }
-                                revision=desc.mRevision;
-                        }
-                } else {
-                        return -errno;
-                }
-                memcpy(&(cache[fd].desc),&desc,sizeof(desc));
-                cache[fd].hasDesc=true;
-        } else {
-                revision=cache[fd].desc.mRevision;
+static void fs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname)
+{
+        TraceSpan span(TRACE_RENAME, parent);
+        if (refuseVirtual(req, parent, name) || refuseVirtual(req, newparent, newname))
+                return;
+        InodeStruct& to=inodeOf(newparent);
+        struct stat replaced;
+        const bool replacing = fstatat(to.pathFd, newname, &replaced, AT_SYMLINK_NOFOLLOW) == 0;
+        int res = renameat(inodeOf(parent).pathFd, name, to.pathFd, newname);
+        if (res == -1) {
+                fuse_reply_err(req, errno);
+                return;
         }
-
-        localoffset=offset;
-
-        size_t localoffset_mod_data=localoffset%FAILSAFE_DATA_SIZE;
-        size_t localoffset_div_datasize=localoffset/FAILSAFE_DATA_SIZE;
-        if (localoffset_div_datasize>0 && localoffset_mod_data==0) {
-                res=readBlock(fd,block,localoffset_div_datasize-1);
-                if (res)
-                        return res;
+        // descriptions written later record the new name
+        struct stat stbuf;
+        if (fstatat(to.pathFd, newname, &stbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+                const InodeKey key= {stbuf.st_dev,stbuf.st_ino};
+                inodes.renamed(key, pathOf(to)+"/"+newname);
+                if (replacing && replaced.st_ino != stbuf.st_ino)
+                        dropFileMeta(replaced);
         }
+        fuse_reply_err(req, 0);
+}
 
-        if (localoffset_mod_data!=0) {
-                res=readBlock(fd,block,localoffset_div_datasize);
-                if (res)
-                        return res;
-
-                transfer=(remain>FAILSAFE_DATA_SIZE-localoffset_mod_data)?(FAILSAFE_DATA_SIZE-localoffset_mod_data):remain;
-                memcpy(block.data+localoffset_mod_data,ptr,transfer);
-                calculateHeader(block,lastblock,transfer+(localoffset_mod_data),localoffset/FAILSAFE_DATA_SIZE, localoffset,revision);
+static void fs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+        TraceSpan span(TRACE_LINK, ino);
+        if (refuseVirtual(req, ino) || refuseVirtual(req, newparent, newname))
+                return;
+        InodeStruct& parent=inodeOf(newparent);
+        struct fuse_entry_param e;
+        int res = linkat(AT_FDCWD, FdPath(inodeOf(ino).pathFd).c_str(), parent.pathFd, newname, AT_SYMLINK_FOLLOW);
+        if (res == -1) {
+                fuse_reply_err(req, errno);
+                return;
+        }
+        res = lookupEntry(parent, newname, e);
+        if (res)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_entry(req, &e);
+}
 
-                res=writeBlock(fd,block,localoffset_div_datasize);
-                if (res)
-                        return res;
+/*!
+ * opens the statistics file, its handle is a snapshot of the text
+ */
+static int openVirtual(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        if (ino==META_DIR_ID)
+                return -EISDIR;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+                return -EACCES;
+        std::string* text=new std::string(statisticsText());
+        fi->fh=reinterpret_cast<uint64_t>(text);
+        fi->direct_io=1;
+        if (fuse_reply_open(req, fi) == -ENOENT)
+                delete text;
+        return 0;
+}
 
-                remain-=transfer;
-                ptr+=transfer;
-                localoffset+=transfer;
+static void fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        TraceSpan span(TRACE_OPEN, ino);
+        const uint64_t start = Statistics::now();
+        CacheStruct* file=NULL;
+        int res = isVirtual(ino) ? openVirtual(req, ino, fi) : openHandle(inodeOf(ino), fi->flags, file);
+        if (res==0 && isVirtual(ino)) {
+                statistics.record(STATS_OPEN, start, 0);
+                return;
         }
-
-        for (;remain>0;) {
-                memcpy(&lastblock,&block,sizeof(block));
-                transfer=(remain>FAILSAFE_DATA_SIZE)?FAILSAFE_DATA_SIZE:remain;
-                //data
-                memcpy(block.data,ptr,transfer);
-                //header
-                calculateHeader(block,lastblock,transfer+(localoffset_mod_data),localoffset/FAILSAFE_DATA_SIZE, localoffset,revision);
-                //write out
-                res=writeBlock(fd,block,localoffset/FAILSAFE_DATA_SIZE);
-                if (res)
-                        return res;
-                remain-=transfer;
-                ptr+=transfer;
-                localoffset+=transfer;
+        if (res) {
+                fuse_reply_err(req, -res);
+                statistics.record(STATS_OPEN, start, res);
+                return;
         }
-        return size;
+        fi->fh=reinterpret_cast<uint64_t>(file);
+        if (fuse_reply_open(req, fi) == -ENOENT) {
+                // the request was interrupted
+                releaseHandle(file);
+        }
+        statistics.record(STATS_OPEN, start, 0);
 }
 
-static int fs_statfs(const char *path, struct statvfs *stbuf)
+/*!
+ * sink of fs_read: the reply is gathered from the verified blocks, the
+ * request is finished even if it cannot be sent
+ */
+static int replyBlocks(void* context, const struct iovec* iov, int count)
 {
-        int res;
-        std::string localpath=basepath+std::string(path);
-        res = statvfs(localpath.c_str(), stbuf);
-        if (res == -1)
-                return -errno;
-
+        fuse_reply_iov(static_cast<fuse_req_t>(context), iov, count);
         return 0;
 }
 
-static int fs_release(const char *path, struct fuse_file_info *fi)
+static void fs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                    off_t offset, struct fuse_file_info *fi)
 {
-        Mutex mutex(globalMutex);
-        (void) path;
-        int fd=fi->fh;
-        if (fi->flags&O_WRONLY) {
-                flushBlock(fi->fh);
-                int res;
-                std::string localpath=std::string(path);
-                FailSafeDescription desc;
-                struct stat stbuf;
-                stat((basepath+localpath).c_str(),&stbuf);
-                calculateDescription(desc,cache[fd].lastwrittenblock,localpath,stbuf.st_uid,stbuf.st_gid,stbuf.st_mode);
-
-                res = pwrite(fd, &desc, FAILSAFE_BLOCK_SIZE, (cache[fd].lastwrittenblock.mBlockCounter+1)*FAILSAFE_BLOCK_SIZE);
-                if (res == -1) {
-                        return -errno;
-                }
+        TraceSpan span(TRACE_READ, ino);
+        const uint64_t start = Statistics::now();
+        int res = 0;
+        if (ino == STATS_FILE_ID) {
+                const std::string& text=*reinterpret_cast<std::string*>(fi->fh);
+                const size_t begin = std::min(static_cast<size_t>(offset), text.size());
+                fuse_reply_buf(req, text.data() + begin, std::min(size, text.size() - begin));
+        } else {
+                res = readHandle(fileOf(fi), size, offset, replyBlocks, req);
+                if (res < 0)
+                        fuse_reply_err(req, -res);
         }
-        cache.erase(fi->fh);
-        close(fi->fh);
+        statistics.record(STATS_READ, start, res);
+}
 
+static void fs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                         off_t offset, struct fuse_file_info *fi)
+{
+        TraceSpan span(TRACE_WRITE, ino);
+        const uint64_t start = Statistics::now();
+        int res = writeHandle(fileOf(fi), *bufv, offset);
+        if (res < 0)
+                fuse_reply_err(req, -res);
+        else
+                fuse_reply_write(req, res);
+        statistics.record(STATS_WRITE, start, res);
+}
+
+static void fs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+        TraceSpan span(TRACE_STATFS, ino);
+        struct statvfs stbuf;
+        int res = statvfs(FdPath(inodeOf(isVirtual(ino) ? FUSE_ROOT_ID : ino).pathFd).c_str(), &stbuf);
+        if (res == -1)
+                fuse_reply_err(req, errno);
+        else
+                fuse_reply_statfs(req, &stbuf);
+}
+
+static void fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+        TraceSpan span(TRACE_RELEASE, ino);
+        const uint64_t start = Statistics::now();
+        int res = 0;
+        if (ino == STATS_FILE_ID)
+                delete reinterpret_cast<std::string*>(fi->fh);
+        else
+                res = releaseHandle(&fileOf(fi));
         fi->fh=0;
-        return 0;
+        fuse_reply_err(req, -res);
+        statistics.record(STATS_RELEASE, start, res);
 }
 
-static int fs_fsync(const char *path, int isdatasync,
-                    struct fuse_file_info *fi)
+static void fs_fsync(fuse_req_t req, fuse_ino_t ino, int isdatasync,
+                     struct fuse_file_info *fi)
 {
-        Mutex mutex(globalMutex);
-        if (fi->flags & O_WRONLY)
-                flushBlock(fi->fh);
-        (void) path;
+        TraceSpan span(TRACE_FSYNC, ino);
         (void) isdatasync;
-        return 0;
+        const uint64_t start = Statistics::now();
+        const int res = ino == STATS_FILE_ID ? 0 : syncHandle(fileOf(fi));
+        fuse_reply_err(req, -res);
+        statistics.record(STATS_FSYNC, start, res);
 }
 
 #ifdef HAVE_SETXATTR
 /* xattr operations are optional and can safely be left unimplemented */
-static int fs_setxattr(const char *path, const char *name, const char *value,
-                       size_t size, int flags)
+static void fs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags)
 {
-        std::string localpath=basepath+std::string(path);
-        int res = lsetxattr(localpath.c_str(), name, value, size, flags);
-        if (res == -1)
-                return -errno;
-        return 0;
+        TraceSpan span(TRACE_SETXATTR, ino);
+        if (refuseVirtual(req, ino))
+                return;
+        int res = setxattr(FdPath(inodeOf(ino).pathFd).c_str(), name, value, size, flags);
+        fuse_reply_err(req, res == -1 ? errno : 0);
 }
 
-static int fs_getxattr(const char *path, const char *name, char *value,
-                       size_t size)
+static void fs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        size_t size)
 {
-        std::string localpath=basepath+std::string(path);
-        int res = lgetxattr(localpath.c_str(), name, value, size);
+        TraceSpan span(TRACE_GETXATTR, ino);
+        if (isVirtual(ino)) {
+                fuse_reply_err(req, ENODATA);
+                return;
+        }
+        std::vector<char> value(size);
+        int res = getxattr(FdPath(inodeOf(ino).pathFd).c_str(), name, size ? &value[0] : NULL, size);
         if (res == -1)
-                return -errno;
-        return res;
+                fuse_reply_err(req, errno);
+        else if (size == 0)
+                fuse_reply_xattr(req, res);
+        else
+                fuse_reply_buf(req, &value[0], res);
 }
 
-static int fs_listxattr(const char *path, char *list, size_t size)
+static void fs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-        std::string localpath=basepath+std::string(path);
-        int res = llistxattr(localpath.c_str(), list, size);
+        TraceSpan span(TRACE_LISTXATTR, ino);
+        if (isVirtual(ino)) {
+                if (size == 0)
+                        fuse_reply_xattr(req, 0);
+                else
+                        fuse_reply_buf(req, NULL, 0);
+                return;
+        }
+        std::vector<char> list(size);
+        int res = listxattr(FdPath(inodeOf(ino).pathFd).c_str(), size ? &list[0] : NULL, size);
         if (res == -1)
-                return -errno;
-        return res;
+                fuse_reply_err(req, errno);
+        else if (size == 0)
+                fuse_reply_xattr(req, res);
+        else
+                fuse_reply_buf(req, &list[0], res);
 }
 
-static int fs_removexattr(const char *path, const char *name)
+static void fs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
-        std::string localpath=basepath+std::string(path);
-        int res = lremovexattr(localpath.c_str(), name);
-        if (res == -1)
-                return -errno;
-        return 0;
+        TraceSpan span(TRACE_REMOVEXATTR, ino);
+        if (refuseVirtual(req, ino))
+                return;
+        int res = removexattr(FdPath(inodeOf(ino).pathFd).c_str(), name);
+        fuse_reply_err(req, res == -1 ? errno : 0);
 }
 #endif /* HAVE_SETXATTR */
 
-static struct fuse_operations fs_oper;
+static struct fuse_lowlevel_ops fs_oper;
+
+#define FS_OPT(t, p, v) { t, offsetof(FailSafeOptions, p), v }
+
+static struct fuse_opt fs_opts[] = {
+        FS_OPT("attr_timeout=%lf", attrTimeout, 0),
+        FS_OPT("entry_timeout=%lf", entryTimeout, 0),
+        FS_OPT("hash_threads=%u", hashThreads, 0),
+        FS_OPT("hash=%s", hashName, 0),
+        FS_OPT("verify_trust=%u", verifyTrust, 0),
+        FS_OPT("cache_size=%u", cacheSize, 0),
+        FS_OPT("readahead=%u", readahead, 0),
+        FS_OPT("mmap_min=%u", mmapMin, 0),
+        FS_OPT("io=%s", ioName, 0),
+        FS_OPT("writeback=%u", writeback, 0),
+        FS_OPT("dirty_size=%u", dirtySize, 0),
+        FS_OPT("merkle", merkle, 1),
+        FS_OPT("compress", compress, 1),
+        FS_OPT("compress=%u", compress, 0),
+        FS_OPT("block_size=%u", blockSize, 0),
+        FS_OPT("direct_backing", directBacking, 1),
+        FS_OPT("dedup", dedup, 1),
+        FS_OPT("scrub_rate=%u", scrubRate, 0),
+        FS_OPT("scrub_cursor=%s", scrubCursor, 0),
+        FS_OPT("scrub_report=%s", scrubReport, 0),
+        FS_OPT("trace=%u", trace, 0),
+        FS_OPT("trace_file=%s", traceFile, 0),
+        FUSE_OPT_END
+};
 
 int main(int argc, char *argv[])
 {
         srand(static_cast<unsigned>(time(0)));
+        fs_oper.lookup	 = fs_lookup;
+        fs_oper.forget	 = fs_forget;
+        fs_oper.forget_multi = fs_forget_multi;
         fs_oper.getattr	 = fs_getattr;
+        fs_oper.setattr	 = fs_setattr;
         fs_oper.access	 = fs_access;
         fs_oper.readlink = fs_readlink;
+        fs_oper.opendir	 = fs_opendir;
         fs_oper.readdir	 = fs_readdir;
+        fs_oper.releasedir = fs_releasedir;
         fs_oper.mknod	 = fs_mknod;
         fs_oper.mkdir	 = fs_mkdir;
         fs_oper.symlink	 = fs_symlink;
@@ -632,13 +3399,9 @@ int main(int argc, char *argv[])
         fs_oper.rmdir	 = fs_rmdir;
         fs_oper.rename	 = fs_rename;
         fs_oper.link	 = fs_link;
-        fs_oper.chmod	 = fs_chmod;
-        fs_oper.chown	 = fs_chown;
-        fs_oper.truncate = fs_truncate;
-        fs_oper.utimens	 = fs_utimens;
         fs_oper.open	 = fs_open;
         fs_oper.read	 = fs_read;
-        fs_oper.write	 = fs_write;
+        fs_oper.write_buf = fs_write_buf;
         fs_oper.statfs	 = fs_statfs;
         fs_oper.release	 = fs_release;
         fs_oper.fsync	 = fs_fsync;
@@ -649,11 +3412,12 @@ int main(int argc, char *argv[])
         fs_oper.removexattr  = fs_removexattr;
 #endif
 
-        globalMutex = PTHREAD_MUTEX_INITIALIZER;
         if ((sizeof(FailSafeStoreStruct)!=FAILSAFE_BLOCK_SIZE)||(sizeof(FailSafeDescription)!=FAILSAFE_BLOCK_SIZE)) {
                 abort();
         }
         umask(0);
+        gcry_check_version(NULL);
+        gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
         // use first argument as source dir
         if (argc>2) {
@@ -663,7 +3427,114 @@ int main(int argc, char *argv[])
                         std::cerr<<"First parameter must be the source directory!"<<std::endl;
                         return 1;
                 }
-                return fuse_main(argc-1, argv+1, &fs_oper, NULL);
+                struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv+1);
+                long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+                options.hashThreads=cpus>1?cpus-1:0;
+                options.cacheSize=64;
+                options.readahead=1024;
+                options.writeback=5;
+                options.dirtySize=32;
+                options.attrTimeout=1.0;
+                options.entryTimeout=1.0;
+                if (fuse_opt_parse(&args, &options, fs_opts, NULL) == -1)
+                        return 1;
+                options.hashAlgorithm=HASH_SHA1;
+                if (options.hashName) {
+                        options.hashAlgorithm=hashAlgorithmByName(options.hashName);
+                        if (options.hashAlgorithm<0) {
+                                std::cerr<<"Unknown hash algorithm: "<<options.hashName<<std::endl;
+                                return 1;
+                        }
+                }
+                if (options.compress>9) {
+                        std::cerr<<"Compression level must be between 0 and 9"<<std::endl;
+                        return 1;
+                }
+                options.blockShift=0;
+                if (options.blockSize) {
+                        options.blockShift=largeBlockShiftOf(options.blockSize);
+                        if (options.blockShift<0) {
+                                std::cerr<<"Block size must be a power of two between 4096 and 1048576"<<std::endl;
+                                return 1;
+                        }
+                        if (options.compress || options.merkle) {
+                                std::cerr<<"Block size cannot be combined with compress or merkle"<<std::endl;
+                                return 1;
+                        }
+                } else if (options.dedup) {
+                        std::cerr<<"Dedup needs block_size"<<std::endl;
+                        return 1;
+                }
+                if (options.ioName && strcmp(options.ioName,"posix")!=0 && strcmp(options.ioName,"uring")!=0) {
+                        std::cerr<<"Unknown I/O engine: "<<options.ioName<<std::endl;
+                        return 1;
+                }
+
+                int rootFd=open(basepath.c_str(),O_PATH|O_DIRECTORY);
+                if (rootFd==-1 || fstat(rootFd,&st)==-1) {
+                        std::cerr<<"First parameter must be the source directory!"<<std::endl;
+                        return 1;
+                }
+                const InodeKey rootKey= {st.st_dev,st.st_ino};
+                rootInode=inodes.lookup(rootKey,rootFd);
+                // files written with dedup are read also by mounts without it
+                dedupStore.setRoot(rootFd);
+
+                char *mountpoint;
+                int multithreaded;
+                int foreground;
+                if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+                        return 1;
+                int res=1;
+                struct fuse_chan *ch=fuse_mount(mountpoint, &args);
+                if (ch) {
+                        struct fuse_session *se=fuse_lowlevel_new(&args, &fs_oper, sizeof(fs_oper), NULL);
+                        if (se) {
+                                if (fuse_set_signal_handlers(se) != -1) {
+                                        fuse_session_add_chan(se, ch);
+                                        // worker threads and rings do not survive the fork of daemonizing
+                                        fuse_daemonize(foreground);
+                                        // the state of the scrubber and the trace are kept next to the backing directory
+                                        std::string state=basepath;
+                                        while (state.size()>1 && state[state.size()-1]=='/')
+                                                state.erase(state.size()-1);
+#ifdef HAVE_IO_URING
+                                        // io_uring is used unless the kernel lacks it or posix is asked for
+                                        if ((options.ioName==NULL || strcmp(options.ioName,"uring")==0) && uringIO.available())
+                                                blockIO=&uringIO;
+#endif
+                                        if (options.directBacking) {
+                                                directIO.setEngine(blockIO);
+                                                blockIO=&directIO;
+                                        }
+                                        // before the other threads, they inherit the blocked dump signal
+                                        if (options.trace>0)
+                                                traceLog().start(options.trace,options.traceFile?options.traceFile:state+".trace.json");
+                                        hashPool.start(options.hashThreads);
+                                        blockCache.setCapacity(static_cast<size_t>(options.cacheSize)<<20);
+                                        if (options.writeback>0)
+                                                writeBack.start(writeBackThread);
+                                        if (options.scrubRate>0) {
+                                                scrubber.start(basepath,options.scrubCursor?options.scrubCursor:state+".scrub-cursor",
+                                                               options.scrubReport?options.scrubReport:state+".scrub-report",
+                                                               static_cast<uint64_t>(options.scrubRate)<<10,scrubBusy);
+                                        }
+                                        res=multithreaded?fuse_session_loop_mt(se):fuse_session_loop(se);
+                                        scrubber.stop();
+                                        writeBack.stop();
+                                        flushAllDirty();
+                                        hashPool.stop();
+                                        traceLog().stop();
+                                        fuse_remove_signal_handlers(se);
+                                        fuse_session_remove_chan(ch);
+                                }
+                                fuse_session_destroy(se);
+                        }
+                        fuse_unmount(mountpoint, ch);
+                }
+                free(mountpoint);
+                fuse_opt_free_args(&args);
+                return res?1:0;
         } else {
                 std::cerr<<"First parameter must be the source directory!"<<std::endl;
                 std::cerr<<"Second parameter must be the mount point!"<<std::endl;
@@ -671,3 +3542,4 @@ int main(int argc, char *argv[])
 
         return 1;
 }
+#endif /* FAILSAFE_NO_MAIN */